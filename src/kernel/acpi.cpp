@@ -91,7 +91,33 @@ namespace acpi
         return (this->header.length - sizeof(DescriptionHeader)) / sizeof(uint64_t);
     }
 
+    size_t MADT::LocalAPICIDs(uint8_t *apic_ids, size_t max) const
+    {
+        const uint8_t kTypeLocalAPIC = 0;
+        const uint32_t kLocalAPICEnabled = 1;
+
+        size_t count = 0;
+        auto p = reinterpret_cast<const uint8_t *>(this) + sizeof(MADT);
+        const auto end = reinterpret_cast<const uint8_t *>(this) + this->header.length;
+        // 要素は [0]種別 [1]長さ、Processor Local APICは [2]ACPI Processor UID [3]APIC ID [4-7]フラグ
+        while (p + 2 <= end && p[1] >= 2 && count < max)
+        {
+            if (p[0] == kTypeLocalAPIC && p[1] >= 8)
+            {
+                uint32_t flags;
+                memcpy(&flags, p + 4, sizeof(flags));
+                if (flags & kLocalAPICEnabled)
+                {
+                    apic_ids[count++] = p[3];
+                }
+            }
+            p += p[1];
+        }
+        return count;
+    }
+
     const FADT *fadt;
+    const MADT *madt;
 
     void WaitMilliseconds(unsigned long msec)
     {
@@ -133,13 +159,17 @@ namespace acpi
         }
 
         fadt = nullptr;
+        madt = nullptr;
         for (size_t i = 0; i < xsdt.Count(); i++)
         {
             const auto &entry = xsdt[i];
-            if (entry.IsValid("FACP")) // FADTのシグネチャはFACP
+            if (fadt == nullptr && entry.IsValid("FACP")) // FADTのシグネチャはFACP
             {
                 fadt = reinterpret_cast<const FADT *>(&entry);
-                break;
+            }
+            else if (madt == nullptr && entry.IsValid("APIC")) // MADTのシグネチャはAPIC
+            {
+                madt = reinterpret_cast<const MADT *>(&entry);
             }
         }
         if (fadt == nullptr)
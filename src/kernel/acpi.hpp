@@ -78,10 +78,40 @@ namespace acpi
         char reserved3[2766 - 116];
     } __attribute__((packed));
 
+    /**
+     * @brief MADT（Multiple APIC Description Table）
+     *
+     * ヘッダの後ろに、Local APICやI/O APICなどを表す可変長の要素（先頭2バイトが種別と長さ）が並ぶ。
+     * プロセッサごとのLocal APIC IDを知るために使う。
+     */
+    struct MADT
+    {
+        DescriptionHeader header;
+        uint32_t lapic_address; // Local APICのレジスタの物理アドレス
+        uint32_t flags;
+
+        /**
+         * @brief 有効なプロセッサのLocal APIC IDを並べる
+         *
+         * 種別0（Processor Local APIC）の要素のうち、Enabledフラグが立っているものを数える。
+         * APIC IDが255を超えるプロセッサ（種別9のx2APIC）は扱わない。
+         *
+         * @param apic_ids 書き込む先
+         * @param max apic_idsの要素数
+         * @return size_t 書き込んだ数
+         */
+        size_t LocalAPICIDs(uint8_t *apic_ids, size_t max) const;
+    } __attribute__((packed));
+
     extern const FADT *fadt;
+    /** @brief 見つからなければnullptr */
+    extern const MADT *madt;
     const int kPMTimerFreq = 3579545; // ACPI PMタイマは3.579545[MHz]の周期
 
     /***/
     void WaitMilliseconds(unsigned long msec);
+    /**
+     * @brief XSDTからFADTとMADTを探す。FADTが無ければ止まる
+     */
     void Initialize(const RSDP &rsdp);
 } // namespace acpi
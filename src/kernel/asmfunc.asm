@@ -71,6 +71,26 @@ SetDSAll: ; 各セグメントレジスタ(ds, es, fs, gs)に引数の値(0)を
     mov gs, di
     ret
 
+global LoadTR ; void LoadTR(uint16_t sel);
+LoadTR: ; TSSディスクリプタのセレクタをTRレジスタに設定する
+    ltr di
+    ret
+
+global GetCR2 ; uint64_t GetCR2();
+GetCR2: ; ページフォルトを起こしたアドレスを返す
+    mov rax, cr2
+    ret
+
+global GetCR0 ; uint64_t GetCR0();
+GetCR0:
+    mov rax, cr0
+    ret
+
+global SetCR0 ; void SetCR0(uint64_t value);
+SetCR0:
+    mov cr0, rdi
+    ret
+
 global SetCR3; void SetCR3(uint64_t value);
 SetCR3: ; 与えられたPML4テーブルの物理アドレスをCR3レジスタに設定する。
     mov cr3, rdi
@@ -81,6 +101,140 @@ GetCR3: ; 現在のcr3を返す
     mov rax, cr3
     ret
 
+global GetCR4 ; uint64_t GetCR4();
+GetCR4:
+    mov rax, cr4
+    ret
+
+global SetCR4 ; void SetCR4(uint64_t value);
+SetCR4:
+    mov cr4, rdi
+    ret
+
+global SetXCR0 ; void SetXCR0(uint64_t value);
+SetXCR0: ; xsetbvはECXで指定した拡張制御レジスタにEDX:EAXを書き込む
+    xor ecx, ecx
+    mov eax, edi
+    mov rdx, rdi
+    shr rdx, 32
+    xsetbv
+    ret
+
+global InvalidateTLB ; void InvalidateTLB(uint64_t addr);
+InvalidateTLB: ; addrを含むページのTLBの要素を捨てる
+    invlpg [rdi]
+    ret
+
+global ReadMSR ; uint64_t ReadMSR(uint32_t msr);
+ReadMSR: ; rdmsrはECXで指定したMSRの上位32bitをEDXに、下位32bitをEAXに返す
+    mov ecx, edi
+    rdmsr
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global WriteMSR ; void WriteMSR(uint32_t msr, uint64_t value);
+WriteMSR:
+    mov ecx, edi
+    mov eax, esi
+    mov rdx, rsi
+    shr rdx, 32
+    wrmsr
+    ret
+
+global ReadTSC ; uint64_t ReadTSC();
+ReadTSC: ; rdtscはTSCの上位32bitをEDXに、下位32bitをEAXに返すのでRAXにまとめる
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global CPUID ; void CPUID(uint32_t eax, uint32_t ecx, uint32_t *eax_out, uint32_t *ebx_out, uint32_t *ecx_out, uint32_t *edx_out);
+CPUID:
+    push rbx ; cpuidが書き換えるRBXは呼び出し先で保存する決まり
+    mov r10, rdx ; cpuidがRDX, RCXを書き換えるので出力先を退避
+    mov r11, rcx
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r10], eax
+    mov [r11], ebx
+    mov [r8], ecx
+    mov [r9], edx
+    pop rbx
+    ret
+
+global FXSave ; void FXSave(void *area);
+FXSave:
+    fxsave64 [rdi]
+    ret
+
+global FXRstor ; void FXRstor(const void *area);
+FXRstor:
+    fxrstor64 [rdi]
+    ret
+
+global XSaveOpt ; void XSaveOpt(void *area);
+XSaveOpt: ; EDX:EAXで保存する状態を選ぶ。全ビットを立ててXCR0で有効な状態を全て保存する
+    mov eax, 0xffffffff
+    mov edx, eax
+    xsaveopt64 [rdi]
+    ret
+
+global XRstor ; void XRstor(const void *area);
+XRstor:
+    mov eax, 0xffffffff
+    mov edx, eax
+    xrstor64 [rdi]
+    ret
+
+extern fpu_owner_area
+extern fpu_current_area
+extern fpu_xsaveopt_enabled
+
+global IntHandlerDeviceNotAvailable ; #NMのハンドラ
+IntHandlerDeviceNotAvailable: ; CR0.TSが立っている間にFPU/SSE命令を使うと起きる。FPUの状態を持ち主から実行中のタスクへ移す
+    ; C++で書くと、コンパイラがSSEレジスタを退避する命令で再び#NMが起きたり、移した後の状態を壊したりするのでアセンブリで書く
+    push rax
+    push rcx
+    push rdx
+    push r8
+    clts
+    ; fpu_owner_areaとfpu_current_areaはCPUごとの配列。TRはCPU番号iのTSSセレクタ 0x18 + 16 * iを指すので、
+    ; (TR - 0x18) / 2 が配列の要素（8バイト）のオフセットになる（smp.hppのCurrentCPU）
+    xor r8d, r8d
+    str r8w
+    sub r8d, 0x18
+    shr r8d, 1
+    mov eax, 0xffffffff
+    mov edx, eax
+    mov rcx, [fpu_owner_area + r8]
+    cmp rcx, [fpu_current_area + r8]
+    je .done
+    test rcx, rcx
+    jz .restore
+    cmp byte [fpu_xsaveopt_enabled], 0
+    je .fxsave
+    xsaveopt64 [rcx]
+    jmp .restore
+.fxsave:
+    fxsave64 [rcx]
+.restore:
+    mov rcx, [fpu_current_area + r8]
+    mov [fpu_owner_area + r8], rcx
+    cmp byte [fpu_xsaveopt_enabled], 0
+    je .fxrstor
+    xrstor64 [rcx]
+    jmp .done
+.fxrstor:
+    fxrstor64 [rcx]
+.done:
+    pop r8
+    pop rdx
+    pop rcx
+    pop rax
+    o64 iret
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
@@ -130,8 +284,6 @@ SwitchContext: ; RDI, RSIで受けたctxを交換する みかん本316から319
     mov dx, gs
     mov [rsi + 0x38], rdx
 
-    fxsave [rsi + 0xc0]
-
     ; iret 用のスタックフレーム
     push qword [rdi + 0x28] ; SS
     push qword [rdi + 0x70] ; RSP
@@ -139,11 +291,17 @@ SwitchContext: ; RDI, RSIで受けたctxを交換する みかん本316から319
     push qword [rdi + 0x20] ; CS
     push qword [rdi + 0x08] ; RIP
 
-    ; コンテキストの復帰
-    fxrstor [rdi + 0xc0]
-
+    ; コンテキストの復帰。FPUの状態はここでは切り替えず、#NMのハンドラに任せる（fpu.hpp）
+    ; CR3が変わらなければ書き込まない（書き込むとTLBが捨てられる）。
+    ; bit63はPCIDのTLBを残すかの指示で、読み出したCR3には現れないので比較から除く
     mov rax, [rdi + 0x00]
+    mov rcx, cr3
+    mov rdx, rax
+    btr rdx, 63
+    cmp rdx, rcx
+    je .cr3_unchanged
     mov cr3, rax
+.cr3_unchanged:
     mov rax, [rdi + 0x30]
     mov fs, ax
     mov rax, [rdi + 0x38]
@@ -168,3 +326,96 @@ SwitchContext: ; RDI, RSIで受けたctxを交換する みかん本316から319
 
     o64 iret
 ; #@@range_end(switch_context)
+
+; APを起動するトランポリン。StartApplicationProcessors（smp.cpp）が1MiB未満のページの先頭にコピーし、
+; そのページ番号をSIPIのベクタにする。APはCS = ページ番号 << 8、IP = 0のリアルモードで実行を始める。
+; コピー先で動くので、アドレスは全てap_trampolineからの相対で計算する。
+align 16
+bits 16
+global ap_trampoline
+ap_trampoline:
+    cli
+    mov ax, cs
+    mov ds, ax
+    ; INIT直後はSS:SP = 0:0なので、コピー先のページの末尾をスタックにしてから遠いリターンに使う
+    mov ss, ax
+    mov sp, 0x1000
+    xor ebx, ebx
+    mov bx, ax
+    shl ebx, 4 ; ebx = コピー先の物理アドレス
+    ; 一時的なGDTのベースアドレスを物理アドレスに直してから登録する
+    lea eax, [ebx + .gdt - ap_trampoline]
+    mov [.gdtr - ap_trampoline + 2], eax
+    lgdt [.gdtr - ap_trampoline]
+    mov eax, cr0
+    or eax, 1 ; PE
+    mov cr0, eax
+    ; 32bitのコードセグメントへ遠いリターンで移る
+    lea eax, [ebx + .protected_mode - ap_trampoline]
+    push dword 0x08
+    push eax
+    o32 retf
+
+bits 32
+.protected_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    lea esp, [ebx + 0x1000] ; フラットなSSに合わせて、同じページの末尾を線形アドレスで指し直す
+    ; BSPと同じCR4（PAEを含む）、CR3、EFER（LMEを含む）を設定してからCR0.PGを立てるとロングモードに入る
+    mov eax, [ebx + ap_trampoline_params - ap_trampoline + 0x08]
+    mov cr4, eax
+    mov eax, [ebx + ap_trampoline_params - ap_trampoline + 0x00]
+    mov cr3, eax
+    mov ecx, 0xc0000080 ; IA32_EFER
+    mov eax, [ebx + ap_trampoline_params - ap_trampoline + 0x10]
+    xor edx, edx
+    wrmsr
+    mov eax, [ebx + ap_trampoline_params - ap_trampoline + 0x18]
+    mov cr0, eax
+    lea eax, [ebx + .long_mode - ap_trampoline]
+    push dword 0x18
+    push eax
+    retf
+
+bits 64
+.long_mode:
+    mov ebx, ebx ; 64bitモードに入った直後のレジスタの上位32bitは不定なので0にする
+    ; トークンが自分宛て（0x100 | 自分のLocal APIC ID）なら0に書き換えて引数を受け取る。
+    ; BSPが待つのを諦めて0にした後や、次のAPのために書き換えた後に遅れて来たAPは、引数に触れずに止まる
+    mov r8, rbx
+    mov eax, 1
+    cpuid
+    shr ebx, 24 ; 初期Local APIC ID
+    or ebx, 0x100
+    mov eax, ebx
+    mov rbx, r8
+    xor edx, edx
+    lock cmpxchg [rbx + ap_trampoline_params - ap_trampoline + 0x38], rdx
+    jne .park
+    mov rsp, [rbx + ap_trampoline_params - ap_trampoline + 0x20]
+    mov rdi, [rbx + ap_trampoline_params - ap_trampoline + 0x30]
+    mov rax, [rbx + ap_trampoline_params - ap_trampoline + 0x28]
+    call rax ; APMain(cpu)は戻らない
+.park:
+    cli
+    hlt
+    jmp .park
+
+align 16
+.gdt:
+    dq 0
+    dq 0x00cf9a000000ffff ; 0x08: 32bitコード
+    dq 0x00cf92000000ffff ; 0x10: データ
+    dq 0x00af9a000000ffff ; 0x18: 64bitコード
+.gdtr:
+    dw 4 * 8 - 1
+    dd 0 ; ベースアドレスは実行時に書き込む
+
+align 8
+global ap_trampoline_params
+ap_trampoline_params: ; smp.cppのAPTrampolineParamsと同じ並び（cr3, cr4, efer, cr0, stack, entry, cpu, token）
+    times 8 dq 0
+global ap_trampoline_end
+ap_trampoline_end:
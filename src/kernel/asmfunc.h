@@ -33,6 +33,34 @@ extern "C"
 
     void SetDSAll(uint16_t value);
 
+    /**
+     * @brief TRレジスタにTSSディスクリプタのセレクタを設定する
+     * 
+     * @param sel 
+     */
+    void LoadTR(uint16_t sel);
+
+    /**
+     * @brief CR2レジスタ（ページフォルトを起こしたアドレス）の値を返す
+     * 
+     * @return uint64_t 
+     */
+    uint64_t GetCR2();
+
+    /**
+     * @brief CR0レジスタの値を返す
+     * 
+     * @return uint64_t 
+     */
+    uint64_t GetCR0();
+
+    /**
+     * @brief CR0レジスタを設定する
+     * 
+     * @param value 
+     */
+    void SetCR0(uint64_t value);
+
     /**
      * @brief 指定したPML4テーブルの物理アドレスをCR3レジスタに登録
      * 
@@ -47,6 +75,104 @@ extern "C"
      */
     uint64_t GetCR3();
 
+    /**
+     * @brief CR4レジスタの値を返す
+     * 
+     * @return uint64_t 
+     */
+    uint64_t GetCR4();
+
+    /**
+     * @brief CR4レジスタを設定する
+     * 
+     * @param value 
+     */
+    void SetCR4(uint64_t value);
+
+    /**
+     * @brief XCR0（xsaveで扱う状態を選ぶ拡張制御レジスタ）を設定する。CR4.OSXSAVEを立ててから呼ぶ
+     * 
+     * @param value 
+     */
+    void SetXCR0(uint64_t value);
+
+    /**
+     * @brief addrを含むページのTLBの要素を無効化する（invlpg）
+     * 
+     * @param addr 仮想アドレス
+     */
+    void InvalidateTLB(uint64_t addr);
+
+    /**
+     * @brief モデル固有レジスタ（MSR）を読む
+     * 
+     * @param msr MSRのアドレス
+     * @return uint64_t 
+     */
+    uint64_t ReadMSR(uint32_t msr);
+
+    /**
+     * @brief モデル固有レジスタ（MSR）に書き込む
+     * 
+     * @param msr MSRのアドレス
+     * @param value 
+     */
+    void WriteMSR(uint32_t msr, uint64_t value);
+
+    /**
+     * @brief タイムスタンプカウンタ（TSC）の値を読む
+     * 
+     * @return uint64_t 
+     */
+    uint64_t ReadTSC();
+
+    /**
+     * @brief CPUID命令を実行する
+     * 
+     * @param eax 機能番号（リーフ）
+     * @param ecx サブリーフ
+     * @param eax_out 
+     * @param ebx_out 
+     * @param ecx_out 
+     * @param edx_out 
+     */
+    void CPUID(uint32_t eax, uint32_t ecx, uint32_t *eax_out, uint32_t *ebx_out, uint32_t *ecx_out, uint32_t *edx_out);
+
+    /**
+     * @brief FPUの状態をareaに保存する（fxsave）。areaは16バイト境界に置く
+     * 
+     * @param area 512バイト
+     */
+    void FXSave(void *area);
+
+    /**
+     * @brief FXSaveで保存したFPUの状態を復帰する（fxrstor）
+     * 
+     * @param area 
+     */
+    void FXRstor(const void *area);
+
+    /**
+     * @brief XCR0で有効にした状態をareaに保存する（xsaveopt）。areaは64バイト境界に置く
+     * 
+     * 前回XRstorで復帰した領域に保存する場合、変更されていない部分の書き込みを省く。
+     * 
+     * @param area 
+     */
+    void XSaveOpt(void *area);
+
+    /**
+     * @brief XSaveOptで保存した状態を復帰する（xrstor）
+     * 
+     * @param area 
+     */
+    void XRstor(const void *area);
+
+    /**
+     * @brief #NM（Device Not Available）の割り込みハンドラ。IDTに登録するだけで、直接呼ばない
+     */
+    void IntHandlerDeviceNotAvailable();
+
     /**
      * @brief 
      * 
@@ -54,4 +180,14 @@ extern "C"
      * @param current_ctx 
      */
     void SwitchContext(void *next_ctx, void *current_ctx);
+
+    /**
+     * @brief APを起動するトランポリン（リアルモードから始まるコード）の先頭
+     *
+     * ここでは実行せず、ap_trampoline_endまでを1MiB未満のページの先頭にコピーして使う（smp.cpp）。
+     */
+    extern uint8_t ap_trampoline[];
+    /** @brief トランポリンの中の、APに渡す値を書き込む場所 */
+    extern uint8_t ap_trampoline_params[];
+    extern uint8_t ap_trampoline_end[];
 }
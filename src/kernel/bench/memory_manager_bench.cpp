@@ -0,0 +1,389 @@
+/**
+ * @file memory_manager_bench.cpp
+ * @brief 物理メモリマネージャをホスト（Linux）上で動かすベンチマーク
+ *
+ * memory_manager.cppをそのままホスト向けにビルドし、架空のUEFIメモリマップで初期化してから
+ * 割当と解放を繰り返す負荷をかけ、1操作あたりの時間、最悪の待ち時間、断片化の推移を表示する。
+ * エンジンはカーネルと同じくMEMORY_MANAGER_BUDDYの有無で切り替わるので、
+ * make benchで両方のエンジンをビルドして同じ条件で比べられる。
+ * 計測の前に、管理範囲外のフレーム（フレーム0）を割り当てないことを確かめ、割り当てた場合は失敗で終了する。
+ *
+ * フレームの中身には触らないので、実際に大きなメモリを確保する必要はない。
+ */
+
+#include <sys/types.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+
+// カーネルの他のファイルが提供するものの代わり
+extern "C"
+{
+    caddr_t program_break, program_break_end;
+
+    uint64_t ReadTSC()
+    {
+        uint32_t lo, hi;
+        __asm__ volatile("rdtsc"
+                         : "=a"(lo), "=d"(hi));
+        return (static_cast<uint64_t>(hi) << 32) | lo;
+    }
+}
+
+int Log(LogLevel level, const char *format, ...)
+{
+    if (level > kWarn)
+    {
+        return 0;
+    }
+
+    va_list ap;
+    va_start(ap, format);
+    const int result = vfprintf(stderr, format, ap);
+    va_end(ap);
+    return result;
+}
+
+namespace
+{
+#ifdef MEMORY_MANAGER_BUDDY
+    const char *const kEngineName = "buddy";
+#else
+    const char *const kEngineName = "bitmap";
+#endif
+
+    using Clock = std::chrono::steady_clock;
+
+    uint64_t ElapsedNanoseconds(Clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+
+    /**
+     * @brief 架空のUEFIメモリマップを組み立てる
+     *
+     * 記述子はアドレスの昇順に追加する。記述子の間の隙間はMMIO領域などメモリマップに現れない部分を表す。
+     */
+    class MemoryMapBuilder
+    {
+    public:
+        MemoryMapBuilder &Add(MemoryType type, uintptr_t start, uintptr_t bytes)
+        {
+            descriptors_.push_back({static_cast<uint32_t>(type), start, 0, bytes / kUEFIPageSize, 0});
+            return *this;
+        }
+
+        MemoryMap Map()
+        {
+            const auto bytes = descriptors_.size() * sizeof(MemoryDescriptor);
+            return {bytes, descriptors_.data(), bytes, 0, sizeof(MemoryDescriptor), 1};
+        }
+
+    private:
+        std::vector<MemoryDescriptor> descriptors_;
+    };
+
+    /**
+     * @brief QEMUで128MiBを割り当てた程度の小さな仮想マシン
+     */
+    MemoryMapBuilder SmallVMLayout()
+    {
+        MemoryMapBuilder builder;
+        builder.Add(MemoryType::kEfiConventionalMemory, 0, 0xa0000)
+            .Add(MemoryType::kEfiLoaderData, 0x100000, 2_MiB)
+            .Add(MemoryType::kEfiConventionalMemory, 0x300000, 109_MiB - 0x300000)
+            .Add(MemoryType::kEfiBootServicesData, 109_MiB, 8_MiB)
+            .Add(MemoryType::kEfiACPIReclaimMemory, 117_MiB, 1_MiB)
+            .Add(MemoryType::kEfiRuntimeServicesData, 118_MiB, 6_MiB)
+            .Add(MemoryType::kEfiReservedMemoryType, 124_MiB, 4_MiB);
+        return builder;
+    }
+
+    /**
+     * @brief 64GiBの物理メモリと、2GiBから4GiBのMMIO領域の穴を持つマシン
+     */
+    MemoryMapBuilder Large64GiBLayout()
+    {
+        MemoryMapBuilder builder;
+        builder.Add(MemoryType::kEfiConventionalMemory, 0x1000, 0x9f000 - 0x1000)
+            .Add(MemoryType::kEfiLoaderData, 0x100000, 2_MiB)
+            .Add(MemoryType::kEfiConventionalMemory, 0x300000, 1_GiB - 0x300000)
+            .Add(MemoryType::kEfiACPIMemoryNVS, 1_GiB, 64_KiB)
+            .Add(MemoryType::kEfiConventionalMemory, 1_GiB + 64_KiB, 1_GiB - 64_KiB - 32_MiB)
+            .Add(MemoryType::kEfiBootServicesCode, 2_GiB - 32_MiB, 32_MiB)
+            .Add(MemoryType::kEfiConventionalMemory, 4_GiB, 12_GiB)
+            .Add(MemoryType::kEfiRuntimeServicesCode, 16_GiB, 4_MiB)
+            .Add(MemoryType::kEfiConventionalMemory, 16_GiB + 4_MiB, 24_GiB - 4_MiB)
+            .Add(MemoryType::kEfiReservedMemoryType, 40_GiB, 256_MiB)
+            .Add(MemoryType::kEfiConventionalMemory, 40_GiB + 256_MiB, 26_GiB - 256_MiB);
+        return builder;
+    }
+
+    /**
+     * @brief 4GiBの範囲に小さな空き領域と予約領域が交互に並ぶマシン
+     *
+     * カーネルのヒープを置ける程度の連続した空き領域は先頭に用意しておく。
+     */
+    MemoryMapBuilder FragmentedLayout()
+    {
+        MemoryMapBuilder builder;
+        builder.Add(MemoryType::kEfiLoaderData, 0x100000, 2_MiB)
+            .Add(MemoryType::kEfiConventionalMemory, 0x300000, 16_MiB);
+        std::mt19937_64 rng{20};
+        uintptr_t addr = 0x300000 + 16_MiB;
+        while (addr < 4_GiB)
+        {
+            const uintptr_t free_bytes = (1 + rng() % 512) * kBytesPerFrame;
+            const uintptr_t reserved_bytes = (1 + rng() % 16) * kBytesPerFrame;
+            builder.Add(MemoryType::kEfiConventionalMemory, addr, free_bytes)
+                .Add(rng() % 2 ? MemoryType::kEfiRuntimeServicesData : MemoryType::kEfiReservedMemoryType,
+                     addr + free_bytes, reserved_bytes);
+            addr += free_bytes + reserved_bytes;
+        }
+        return builder;
+    }
+
+    /**
+     * @brief 物理アドレス0からBoot Services Dataが置かれたマシン
+     *
+     * ReclaimBootServicesMemoryがフレーム0を含む記述子を解放するので、
+     * エンジンがフレーム0（nullptr）を割り当ててしまわないか確かめるのに使う。
+     */
+    MemoryMapBuilder BootServicesAtZeroLayout()
+    {
+        MemoryMapBuilder builder;
+        builder.Add(MemoryType::kEfiBootServicesData, 0, 0xa0000)
+            .Add(MemoryType::kEfiLoaderData, 0x100000, 2_MiB)
+            .Add(MemoryType::kEfiConventionalMemory, 0x300000, 64_MiB);
+        return builder;
+    }
+
+    /**
+     * @brief 空きフレームを1つずつ全て確保し、管理範囲外のフレームが返らないか確かめる
+     *
+     * @return bool 範囲外のフレームが返らなければtrue
+     */
+    bool CheckAllocationsInRange(const char *name, MemoryMapBuilder builder)
+    {
+        const auto memory_map = builder.Map();
+        InitializeMemoryManager(memory_map);
+        ReclaimBootServicesMemory(memory_map);
+
+        std::vector<FrameID> frames;
+        bool ok = true;
+        while (true)
+        {
+            const auto frame = memory_manager->Allocate(1);
+            if (frame.error)
+            {
+                break;
+            }
+            if (frame.value.ID() == 0)
+            {
+                printf("[%s] layout %s: FAILED: frame 0 allocated after %zu allocations\n",
+                       kEngineName, name, frames.size());
+                ok = false;
+                break;
+            }
+            frames.push_back(frame.value);
+        }
+        for (const auto frame : frames)
+        {
+            memory_manager->Free(frame, 1);
+        }
+
+        if (ok)
+        {
+            printf("[%s] layout %s: %zu frames allocated, none outside the managed range\n\n",
+                   kEngineName, name, frames.size());
+        }
+        return ok;
+    }
+
+    /**
+     * @brief 割当と解放を繰り返す負荷の種類
+     */
+    struct Workload
+    {
+        const char *name;
+        /** @brief 1回の割当で要求するフレーム数を返す */
+        std::function<size_t(std::mt19937_64 &)> frames;
+    };
+
+    const Workload kWorkloads[] = {
+        {"small", [](std::mt19937_64 &rng) -> size_t
+         { return rng() % 10 < 7 ? 1 : 2 + rng() % 7; }},
+        {"mixed", [](std::mt19937_64 &rng) -> size_t
+         {
+             const auto kind = rng() % 100;
+             return kind < 80 ? 1 : kind < 95 ? 2 + rng() % 63 : 256 + rng() % 1793;
+         }},
+        {"large", [](std::mt19937_64 &rng) -> size_t
+         { return 512 + rng() % 15873; }},
+    };
+
+    /** @brief 計測する操作の回数 */
+    const size_t kOperations = 200000;
+    /** @brief 断片化の推移を記録する回数 */
+    const size_t kSamples = 8;
+
+    /**
+     * @brief 1回分の待ち時間を集計する
+     */
+    class LatencyRecorder
+    {
+    public:
+        void Record(uint64_t ns) { samples_.push_back(ns); }
+
+        void Print(const char *label)
+        {
+            if (samples_.empty())
+            {
+                printf("  %-5s      -\n", label);
+                return;
+            }
+            std::sort(samples_.begin(), samples_.end());
+            uint64_t total = 0;
+            for (const auto ns : samples_)
+            {
+                total += ns;
+            }
+            printf("  %-5s %8zu ops  %8.1f ns/op  p50 %6lu ns  p99 %8lu ns  worst %9lu ns\n",
+                   label, samples_.size(), static_cast<double>(total) / samples_.size(),
+                   samples_[samples_.size() / 2], samples_[samples_.size() * 99 / 100], samples_.back());
+        }
+
+    private:
+        std::vector<uint64_t> samples_;
+    };
+
+    void PrintFragmentation(size_t op)
+    {
+        const auto stats = memory_manager->Stats();
+        printf("    after %7zu ops: free %8llu KiB  largest %8llu KiB  fragmentation %5.1f%%\n",
+               op, stats.free_frames * kBytesPerFrame / 1024, stats.largest_free_frames * kBytesPerFrame / 1024,
+               stats.FragmentationPermille() / 10.0);
+    }
+
+    /**
+     * @brief 使用中のフレームが空きフレームの半分程度になるまで確保してから、割当と解放を無作為に繰り返す
+     */
+    void RunWorkload(const Workload &workload)
+    {
+        struct Allocation
+        {
+            FrameID frame;
+            size_t num_frames;
+        };
+        std::vector<Allocation> live;
+        size_t live_frames = 0, failures = 0;
+        std::mt19937_64 rng{1};
+
+        const auto target_frames = memory_manager->Stats().free_frames / 2;
+        while (live_frames < target_frames)
+        {
+            const auto num_frames = workload.frames(rng);
+            const auto frame = memory_manager->Allocate(num_frames);
+            if (frame.error)
+            {
+                break;
+            }
+            live.push_back({frame.value, num_frames});
+            live_frames += num_frames;
+        }
+
+        printf("  workload %s (%zu allocations live, %llu KiB):\n",
+               workload.name, live.size(), live_frames * kBytesPerFrame / 1024);
+        LatencyRecorder alloc_latency, free_latency;
+        for (size_t op = 0; op < kOperations; ++op)
+        {
+            if (op % (kOperations / kSamples) == 0)
+            {
+                PrintFragmentation(op);
+            }
+
+            // 使用量が目標を超えていれば解放を多めにして、使用量を目標の周りに保つ
+            const bool do_free = !live.empty() && rng() % 100 < (live_frames > target_frames ? 60 : 40);
+            if (do_free)
+            {
+                const auto index = rng() % live.size();
+                const auto allocation = live[index];
+                live[index] = live.back();
+                live.pop_back();
+                live_frames -= allocation.num_frames;
+
+                const auto start = Clock::now();
+                memory_manager->Free(allocation.frame, allocation.num_frames);
+                free_latency.Record(ElapsedNanoseconds(start));
+            }
+            else
+            {
+                const auto num_frames = workload.frames(rng);
+                const auto start = Clock::now();
+                const auto frame = memory_manager->Allocate(num_frames);
+                const auto ns = ElapsedNanoseconds(start);
+                if (frame.error)
+                {
+                    ++failures;
+                    continue;
+                }
+                alloc_latency.Record(ns);
+                live.push_back({frame.value, num_frames});
+                live_frames += num_frames;
+            }
+        }
+        PrintFragmentation(kOperations);
+
+        alloc_latency.Print("alloc");
+        free_latency.Print("free");
+        printf("  failed allocations: %zu\n", failures);
+
+        for (const auto &allocation : live)
+        {
+            memory_manager->Free(allocation.frame, allocation.num_frames);
+        }
+    }
+
+    void RunLayout(const char *name, MemoryMapBuilder builder)
+    {
+        const auto memory_map = builder.Map();
+        const auto start = Clock::now();
+        InitializeMemoryManager(memory_map);
+        ReclaimBootServicesMemory(memory_map);
+        const auto init_ns = ElapsedNanoseconds(start);
+
+        const auto stats = memory_manager->Stats();
+        printf("[%s] layout %s: %llu descriptors, total %llu MiB, free %llu MiB, initialized in %lu us\n",
+               kEngineName, name, memory_map.map_size / memory_map.descriptor_size,
+               stats.total_frames * kBytesPerFrame / 1_MiB, stats.free_frames * kBytesPerFrame / 1_MiB,
+               init_ns / 1000);
+
+        for (const auto &workload : kWorkloads)
+        {
+            RunWorkload(workload);
+        }
+        printf("\n");
+    }
+} // namespace
+
+int main()
+{
+    if (!CheckAllocationsInRange("boot-services-at-0", BootServicesAtZeroLayout()))
+    {
+        return 1;
+    }
+    RunLayout("small-vm", SmallVMLayout());
+    RunLayout("64gib-holes", Large64GiBLayout());
+    RunLayout("fragmented", FragmentedLayout());
+    return 0;
+}
@@ -0,0 +1,433 @@
+#include "memory_manager.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace
+{
+    const size_t kNoFreeBlock = std::numeric_limits<size_t>::max();
+
+    /** @brief 2^order >= num_framesとなる最小のorderを返す */
+    int OrderOf(size_t num_frames)
+    {
+        int order = 0;
+        while ((static_cast<size_t>(1) << order) < num_frames)
+        {
+            ++order;
+        }
+        return order;
+    }
+} // namespace
+
+// 要約ビットマップは割当・解放のたびに辿るので、位置は再帰で求めずに表を引く
+constexpr std::array<size_t, (BuddyMemoryManager::kMaxOrder + 1) * BuddyMemoryManager::kSummaryLevels>
+    BuddyMemoryManager::kSummaryOffsets = []
+{
+    std::array<size_t, (kMaxOrder + 1) * kSummaryLevels> offsets{};
+    for (int order = 0; order <= kMaxOrder; ++order)
+    {
+        for (int level = 1; level <= kSummaryLevels; ++level)
+        {
+            offsets[order * kSummaryLevels + level - 1] = SummaryOffset(order, level);
+        }
+    }
+    return offsets;
+}();
+
+BuddyMemoryManager::BuddyMemoryManager()
+    : free_map_{}, summary_map_{}, free_count_{},
+      range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}}, tagged_frames_{}
+{
+    static_assert(MapOffset(kMaxOrder + 1) == kMapLineCount);
+    static_assert(SummaryOffset(kMaxOrder + 1, 1) <= kSummaryLineCount);
+    static_assert(SummaryLinesAt(0, kSummaryLevels) <= 2, "add a summary level");
+
+    // 最大次数のブロックで全フレームを覆う
+    for (size_t i = 0; i < LinesAt(kMaxOrder); ++i)
+    {
+        free_map_[MapOffset(kMaxOrder) + i] = ~static_cast<MapLineType>(0);
+        UpdateSummary(kMaxOrder, i);
+    }
+    free_count_[kMaxOrder] = kFrameCount >> kMaxOrder;
+}
+
+WithError<FrameID> BuddyMemoryManager::Allocate(size_t num_frames, MemoryTag tag)
+{
+    const int order = OrderOf(num_frames);
+    if (order > kMaxOrder)
+    {
+        const auto frame = AllocateLarge(num_frames);
+        if (!frame.error)
+        {
+            tagged_frames_[static_cast<size_t>(tag)] += num_frames;
+        }
+        return frame;
+    }
+
+    // 空きブロックがある最小の次数を探す
+    int block_order = order;
+    while (block_order <= kMaxOrder && free_count_[block_order] == 0)
+    {
+        ++block_order;
+    }
+    if (block_order > kMaxOrder)
+    {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    // 見つけたブロックを半分ずつに分割し、後ろ半分を1つ下の次数の空きブロックにする
+    size_t index = TakeFreeBlock(block_order);
+    while (block_order > order)
+    {
+        --block_order;
+        index <<= 1;
+        SetFreeBlock(block_order, index + 1, true);
+    }
+
+    // 2のべき乗に切り上げた余りは返却しておく
+    const size_t start = index << order;
+    FreeRange(start + num_frames, start + (static_cast<size_t>(1) << order));
+    tagged_frames_[static_cast<size_t>(tag)] += num_frames;
+    return {FrameID{start}, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error BuddyMemoryManager::Free(FrameID start_frame, size_t num_frames, MemoryTag tag)
+{
+    FreeRange(start_frame.ID(), start_frame.ID() + num_frames);
+    tagged_frames_[static_cast<size_t>(tag)] -= num_frames;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void BuddyMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames)
+{
+    RemoveRange(start_frame.ID(), start_frame.ID() + num_frames);
+}
+
+Error BuddyMemoryManager::AllocateAt(FrameID start_frame, size_t num_frames, MemoryTag tag)
+{
+    const size_t end = start_frame.ID() + num_frames;
+    if (start_frame.ID() < range_begin_.ID() || end > range_end_.ID())
+    {
+        return MAKE_ERROR(Error::kAlreadyAllocated);
+    }
+
+    // 範囲の全フレームがいずれかの空きブロックに含まれているか確かめる
+    for (size_t frame = start_frame.ID(); frame < end;)
+    {
+        int order = 0;
+        while (order <= kMaxOrder && !IsFreeBlock(order, frame >> order))
+        {
+            ++order;
+        }
+        if (order > kMaxOrder)
+        {
+            return MAKE_ERROR(Error::kAlreadyAllocated);
+        }
+        frame = ((frame >> order) + 1) << order;
+    }
+
+    RemoveRange(start_frame.ID(), end);
+    tagged_frames_[static_cast<size_t>(tag)] += num_frames;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void BuddyMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end)
+{
+    // 範囲外のフレームは空きブロックから外しておけば割り当てられることはない
+    RemoveRange(0, range_begin.ID());
+    RemoveRange(range_end.ID(), kFrameCount);
+    range_begin_ = range_begin;
+    range_end_ = range_end;
+}
+
+void BuddyMemoryManager::Retag(size_t num_frames, MemoryTag from, MemoryTag to)
+{
+    tagged_frames_[static_cast<size_t>(from)] -= num_frames;
+    tagged_frames_[static_cast<size_t>(to)] += num_frames;
+}
+
+MemoryStats BuddyMemoryManager::Stats() const
+{
+    size_t free_frames = 0;
+    int largest_order = -1;
+    for (int order = 0; order <= kMaxOrder; ++order)
+    {
+        free_frames += free_count_[order] << order;
+        if (free_count_[order] > 0)
+        {
+            largest_order = order;
+        }
+    }
+
+    size_t largest_free_frames = largest_order < 0 ? 0 : static_cast<size_t>(1) << largest_order;
+    if (free_count_[kMaxOrder] > 1)
+    {
+        // AllocateLargeは連続した最大次数のブロックをまとめて割り当てられる。空きブロックの並びを単位に数える
+        size_t longest_run = 0;
+        for (size_t first = NextMaxOrderBlock(0, true); first < (kFrameCount >> kMaxOrder);)
+        {
+            const size_t end = NextMaxOrderBlock(first, false);
+            longest_run = std::max(longest_run, end - first);
+            first = NextMaxOrderBlock(end, true);
+        }
+        largest_free_frames = longest_run << kMaxOrder;
+    }
+
+    return {range_end_.ID() - range_begin_.ID(), free_frames, largest_free_frames, tagged_frames_};
+}
+
+bool BuddyMemoryManager::IsFreeBlock(int order, size_t index) const
+{
+    const auto line = free_map_[MapOffset(order) + index / kBitsPerMapLine];
+    return (line & (static_cast<MapLineType>(1) << (index % kBitsPerMapLine))) != 0;
+}
+
+void BuddyMemoryManager::SetFreeBlock(int order, size_t index, bool free)
+{
+    const size_t line_index = index / kBitsPerMapLine;
+    auto &line = free_map_[MapOffset(order) + line_index];
+    const bool was_empty = line == 0;
+    const auto mask = static_cast<MapLineType>(1) << (index % kBitsPerMapLine);
+    if (free)
+    {
+        line |= mask;
+        ++free_count_[order];
+    }
+    else
+    {
+        line &= ~mask;
+        --free_count_[order];
+    }
+    if (was_empty != (line == 0))
+    {
+        UpdateSummary(order, line_index);
+    }
+}
+
+/**
+ * @brief 次数orderのビットマップのラインlineが0かどうかを要約ビットマップに反映する
+ *
+ * 要素が0かどうかが変わらなくなった段より上は変わらないので、そこで止める。
+ */
+void BuddyMemoryManager::UpdateSummary(int order, size_t line)
+{
+    bool not_empty = free_map_[MapOffset(order) + line] != 0;
+    for (int level = 1; level <= kSummaryLevels; ++level)
+    {
+        auto &summary = summary_map_[kSummaryOffsets[order * kSummaryLevels + level - 1] + line / kBitsPerMapLine];
+        const bool was_not_empty = summary != 0;
+        const auto mask = static_cast<MapLineType>(1) << (line % kBitsPerMapLine);
+        if (not_empty)
+        {
+            summary |= mask;
+        }
+        else
+        {
+            summary &= ~mask;
+        }
+        not_empty = summary != 0;
+        if (not_empty == was_not_empty)
+        {
+            return;
+        }
+        line /= kBitsPerMapLine;
+    }
+}
+
+/**
+ * @brief 次数orderのビットマップで空きブロックを含む最初のラインを、要約ビットマップを上から辿って探す
+ *
+ * @return size_t ライン番号。空きブロックが無ければkNoFreeBlock
+ */
+size_t BuddyMemoryManager::FirstFreeLine(int order) const
+{
+    size_t line = kNoFreeBlock;
+    for (size_t i = 0; i < SummaryLinesAt(order, kSummaryLevels); ++i)
+    {
+        if (summary_map_[kSummaryOffsets[order * kSummaryLevels + kSummaryLevels - 1] + i] != 0)
+        {
+            line = i;
+            break;
+        }
+    }
+    if (line == kNoFreeBlock)
+    {
+        return kNoFreeBlock;
+    }
+
+    for (int level = kSummaryLevels; level >= 1; --level)
+    {
+        const auto bits = summary_map_[kSummaryOffsets[order * kSummaryLevels + level - 1] + line];
+        line = line * kBitsPerMapLine + __builtin_ctzl(bits);
+    }
+    return line;
+}
+
+/**
+ * @brief index以降で最初の、空き（freeがtrue）または使用中（false）の最大次数のブロックを返す
+ *
+ * 最大次数のビットマップは数ラインしかないので、ライン単位で直接調べる。
+ *
+ * @return size_t ブロック番号。見つからなければ最大次数のブロック数
+ */
+size_t BuddyMemoryManager::NextMaxOrderBlock(size_t index, bool free) const
+{
+    const size_t num_blocks = kFrameCount >> kMaxOrder;
+    while (index < num_blocks)
+    {
+        auto bits = free_map_[MapOffset(kMaxOrder) + index / kBitsPerMapLine];
+        if (!free)
+        {
+            bits = ~bits;
+        }
+        bits &= ~static_cast<MapLineType>(0) << (index % kBitsPerMapLine);
+        if (bits != 0)
+        {
+            return index / kBitsPerMapLine * kBitsPerMapLine + __builtin_ctzl(bits);
+        }
+        index = (index / kBitsPerMapLine + 1) * kBitsPerMapLine;
+    }
+    return num_blocks;
+}
+
+/**
+ * @brief 次数orderの空きブロックのうち最もアドレスの小さいものを取り出す
+ *
+ * @return size_t ブロック番号。空きブロックが無ければkNoFreeBlock
+ */
+size_t BuddyMemoryManager::TakeFreeBlock(int order)
+{
+    const size_t line = FirstFreeLine(order);
+    if (line == kNoFreeBlock)
+    {
+        return kNoFreeBlock;
+    }
+    const size_t index = line * kBitsPerMapLine + __builtin_ctzl(free_map_[MapOffset(order) + line]);
+    SetFreeBlock(order, index, false);
+    return index;
+}
+
+/**
+ * @brief 最大次数のブロックより大きい要求を、連続した最大次数の空きブロックを並べて満たす
+ */
+WithError<FrameID> BuddyMemoryManager::AllocateLarge(size_t num_frames)
+{
+    const size_t max_block_frames = static_cast<size_t>(1) << kMaxOrder;
+    const size_t num_blocks = (num_frames + max_block_frames - 1) / max_block_frames;
+    if (free_count_[kMaxOrder] < num_blocks)
+    {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    // 空きブロックの並びを単位に調べる
+    for (size_t first = NextMaxOrderBlock(0, true); first < (kFrameCount >> kMaxOrder);)
+    {
+        const size_t end = NextMaxOrderBlock(first, false);
+        if (end - first >= num_blocks)
+        {
+            for (size_t i = first; i < first + num_blocks; ++i)
+            {
+                SetFreeBlock(kMaxOrder, i, false);
+            }
+            const size_t start = first * max_block_frames;
+            FreeRange(start + num_frames, start + num_blocks * max_block_frames);
+            return {FrameID{start}, MAKE_ERROR(Error::kSuccess)};
+        }
+        first = NextMaxOrderBlock(end, true);
+    }
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+}
+
+/**
+ * @brief 次数orderのブロックindexを空きにする。バディも空いていれば結合する
+ */
+void BuddyMemoryManager::FreeBlock(size_t index, int order)
+{
+    while (order < kMaxOrder && IsFreeBlock(order, index ^ 1))
+    {
+        SetFreeBlock(order, index ^ 1, false);
+        index >>= 1;
+        ++order;
+    }
+    SetFreeBlock(order, index, true);
+}
+
+/**
+ * @brief 使用中のフレーム[begin, end)を空きにする
+ *
+ * 範囲を先頭が揃った最大のブロックに分けてから1つずつ解放する。
+ * 管理範囲[range_begin_, range_end_)の外のフレームは空きブロックに加えない。
+ * BitmapMemoryManagerは範囲外のフレームを割り当てないので、
+ * UEFIのメモリマップがフレーム0を含む領域を解放させても同じ結果になるように揃えておく。
+ */
+void BuddyMemoryManager::FreeRange(size_t begin, size_t end)
+{
+    begin = std::max(begin, range_begin_.ID());
+    end = std::min(end, range_end_.ID());
+    while (begin < end)
+    {
+        int order = begin == 0 ? kMaxOrder : std::min(kMaxOrder, __builtin_ctzl(begin));
+        while (begin + (static_cast<size_t>(1) << order) > end)
+        {
+            --order;
+        }
+        FreeBlock(begin >> order, order);
+        begin += static_cast<size_t>(1) << order;
+    }
+}
+
+/**
+ * @brief フレーム[begin, end)を空きブロックから取り除く
+ *
+ * 大きい次数から順に、範囲に完全に含まれる空きブロックはまとめて取り除き、
+ * 範囲の端に一部だけ掛かる空きブロックは2つに分割して1つ下の次数で改めて調べる。
+ */
+void BuddyMemoryManager::RemoveRange(size_t begin, size_t end)
+{
+    if (begin >= end)
+    {
+        return;
+    }
+
+    for (int order = kMaxOrder; order >= 0; --order)
+    {
+        const size_t block_frames = static_cast<size_t>(1) << order;
+        const size_t first = begin >> order;
+        const size_t last = (end - 1) >> order;
+
+        // 端のブロックが範囲に一部だけ掛かっているなら分割する（次数0のブロックは必ず完全に含まれる）
+        for (const auto index : {first, last})
+        {
+            const bool covered = begin <= index * block_frames && (index + 1) * block_frames <= end;
+            if (!covered && IsFreeBlock(order, index))
+            {
+                SetFreeBlock(order, index, false);
+                SetFreeBlock(order - 1, index * 2, true);
+                SetFreeBlock(order - 1, index * 2 + 1, true);
+            }
+        }
+
+        // 範囲に完全に含まれるブロック[covered_first, covered_end)を取り除く
+        const size_t covered_first = (begin + block_frames - 1) >> order;
+        const size_t covered_end = end >> order;
+        for (size_t index = covered_first; index < covered_end;)
+        {
+            const auto bit = index % kBitsPerMapLine;
+            const auto count = std::min(kBitsPerMapLine - bit, covered_end - index);
+            const auto mask = (count == kBitsPerMapLine ? ~static_cast<MapLineType>(0)
+                                                        : ((static_cast<MapLineType>(1) << count) - 1))
+                              << bit;
+            auto &line = free_map_[MapOffset(order) + index / kBitsPerMapLine];
+            if (line & mask)
+            {
+                free_count_[order] -= __builtin_popcountl(line & mask);
+                line &= ~mask;
+                if (line == 0)
+                {
+                    UpdateSummary(order, index / kBitsPerMapLine);
+                }
+            }
+            index += count;
+        }
+    }
+}
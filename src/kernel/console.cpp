@@ -23,6 +23,29 @@ Console::Console(
 }
 
 void Console::PutString(const char *s)
+{
+    bool can_sleep;
+    {
+        SpinLockGuard guard{lock_};
+        can_sleep = guard.WasEnabled();
+        PutStringLocked(s);
+    }
+
+    if (layer_manager == nullptr)
+    {
+        return;
+    }
+    if (can_sleep)
+    {
+        layer_manager->Draw(layer_id_);
+    }
+    else
+    {
+        layer_manager->TryDraw(layer_id_);
+    }
+}
+
+void Console::PutStringLocked(const char *s)
 {
     while (*s)
     {
@@ -48,11 +71,6 @@ void Console::PutString(const char *s)
         }
         ++s;
     }
-
-    if (layer_manager)
-    {
-        layer_manager->Draw(layer_id_);
-    }
 }
 
 void Console::SetWriter(PixelWriter *writer)
@@ -4,6 +4,7 @@
 
 #include "graphics.hpp"
 #include "layer.hpp"
+#include "spinlock.hpp"
 #include "window.hpp"
 
 class Console
@@ -12,6 +13,11 @@ public:
     static const int kRows = 25, kColumns = 80;
 
     Console(const PixelColor &fg_color, const PixelColor &bg_color);
+    /**
+     * @brief 文字列を書いてレイヤを描画する
+     *
+     * どのCPUからも呼べる。割り込み禁止中はレイヤを描画できなければ（他のタスクが描画中なら）省き、次の描画で画面に出す。
+     */
     void PutString(const char *s);
     void SetWriter(PixelWriter *writer);
     void SetWindow(const std::shared_ptr<Window> &window);
@@ -19,6 +25,8 @@ public:
     unsigned int LayerID() const;
 
 private:
+    /** @brief lock_を取った状態で文字列を書く */
+    void PutStringLocked(const char *s);
     void NewLine();
     void Refresh();
 
@@ -28,6 +36,8 @@ private:
     char buffer_[kRows][kColumns + 1];
     int cursor_row_, cursor_column_;
     unsigned int layer_id_;
+    /** @brief buffer_とカーソル、ウインドウへの書き込みを守る */
+    SpinLock lock_;
 };
 
 extern Console *console;
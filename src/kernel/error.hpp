@@ -36,6 +36,9 @@ public:
         kNoPCIMSI,
         kUnknownPixelFormat,
         kNoSuchTask,
+        kInvalidAddress,
+        kAlreadyMapped,
+        kUnsupportedPageSize,
         kLastOfCode, // この列挙子は常に最後に配置する
     };
 
@@ -65,6 +68,9 @@ private:
         "kNoPCIMSI",
         "kUnknownPixelFormat",
         "kNoSuchTask",
+        "kInvalidAddress",
+        "kAlreadyMapped",
+        "kUnsupportedPageSize",
     }; // こちらに番兵はいない
     static_assert(Error::Code::kLastOfCode == code_names_.size());
 
@@ -0,0 +1,232 @@
+#include "fpu.hpp"
+
+#include <string.h>
+
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "segment.hpp"
+#include "smp.hpp"
+#include "task.hpp"
+#include "task_stack.hpp"
+
+// #NMのハンドラ（asmfunc.asmのIntHandlerDeviceNotAvailable）から読み書きする。FPUはCPUごとにあるので、CPUの番号で引く
+extern "C"
+{
+    /** @brief 今FPUに状態が載っているタスクの保存先。nullptrなら誰のものでもない */
+    uint8_t *fpu_owner_area[kMaxCPUs];
+    /** @brief 実行中のタスクの保存先 */
+    uint8_t *fpu_current_area[kMaxCPUs];
+    /** @brief trueならxsaveopt/xrstor、falseならfxsave/fxrstorで保存・復帰する */
+    bool fpu_xsaveopt_enabled = false;
+}
+
+namespace
+{
+    const uint64_t kCR0MP = 1u << 1;
+    const uint64_t kCR0EM = 1u << 2;
+    const uint64_t kCR0TS = 1u << 3;
+    const uint64_t kCR4OSXSAVE = 1u << 18;
+    /** @brief XCR0で有効にする状態（x87とSSE） */
+    const uint64_t kXCR0X87SSE = 0x3;
+
+    void SaveFPUState(uint8_t *area)
+    {
+        if (fpu_xsaveopt_enabled)
+        {
+            XSaveOpt(area);
+        }
+        else
+        {
+            FXSave(area);
+        }
+    }
+
+    void RestoreFPUState(uint8_t *area)
+    {
+        if (fpu_xsaveopt_enabled)
+        {
+            XRstor(area);
+        }
+        else
+        {
+            FXRstor(area);
+        }
+    }
+
+    /**
+     * @brief 切り替えのたびに保存・復帰する（遅延させない）場合の切り替え。比べるためだけに使う
+     */
+    void SwitchFPUContextEager(uint8_t *next_area)
+    {
+        const int cpu = CurrentCPU();
+        SetCR0(GetCR0() & ~kCR0TS);
+        if (fpu_owner_area[cpu] != next_area)
+        {
+            if (fpu_owner_area[cpu])
+            {
+                SaveFPUState(fpu_owner_area[cpu]);
+            }
+            RestoreFPUState(next_area);
+            fpu_owner_area[cpu] = next_area;
+        }
+        fpu_current_area[cpu] = next_area;
+    }
+
+    alignas(64) TaskContext bench_main_ctx, bench_partner_ctx;
+    uint8_t *bench_main_area;
+    void (*bench_switch_fpu)(uint8_t *);
+    bool bench_use_sse;
+
+    void TouchSSE()
+    {
+        __asm__ volatile("addps %%xmm0, %%xmm0" ::: "xmm0");
+    }
+
+    /**
+     * @brief 切り替えてきたらすぐに切り替え元へ戻るだけのコンテキスト
+     */
+    void BenchPartner()
+    {
+        while (true)
+        {
+            if (bench_use_sse)
+            {
+                TouchSSE();
+            }
+            bench_switch_fpu(bench_main_area);
+            SwitchContext(&bench_main_ctx, &bench_partner_ctx);
+        }
+    }
+
+    /**
+     * @brief 1回の切り替えにかかるTSCのサイクル数を返す
+     */
+    uint64_t MeasureSwitch(void (*switch_fpu)(uint8_t *), bool use_sse)
+    {
+        const int kRounds = 10000;
+        bench_switch_fpu = switch_fpu;
+        bench_use_sse = use_sse;
+
+        uint64_t start = 0;
+        // 最初の100往復はキャッシュを温めるために捨てる
+        for (int i = -100; i < kRounds; ++i)
+        {
+            if (i == 0)
+            {
+                start = ReadTSC();
+            }
+            if (use_sse)
+            {
+                TouchSSE();
+            }
+            switch_fpu(bench_partner_ctx.fpu_area.data());
+            SwitchContext(&bench_partner_ctx, &bench_main_ctx);
+        }
+        return (ReadTSC() - start) / (2 * kRounds);
+    }
+} // namespace
+
+void InitializeFPU()
+{
+    // EM=0でFPU命令を実行させ、MP=1でTSが立っていればWAIT命令でも#NMを起こす
+    SetCR0((GetCR0() & ~(kCR0EM | kCR0TS)) | kCR0MP);
+
+    uint32_t eax, ebx, ecx, edx;
+    CPUID(1, 0, &eax, &ebx, &ecx, &edx);
+    if ((ecx >> 26) & 1) // XSAVE
+    {
+        CPUID(0xd, 1, &eax, &ebx, &ecx, &edx);
+        if (eax & 1) // XSAVEOPT
+        {
+            SetCR4(GetCR4() | kCR4OSXSAVE);
+            SetXCR0(kXCR0X87SSE);
+            fpu_xsaveopt_enabled = true;
+        }
+    }
+    if (CurrentCPU() != 0)
+    {
+        return;
+    }
+    Log(kInfo, "FPU state is switched lazily with %s\n", fpu_xsaveopt_enabled ? "xsaveopt" : "fxsave");
+}
+
+void InitializeFPUOwner(uint8_t *area)
+{
+    const int cpu = CurrentCPU();
+    fpu_owner_area[cpu] = fpu_current_area[cpu] = area;
+}
+
+void SwitchFPUContext(uint8_t *next_area)
+{
+    const int cpu = CurrentCPU();
+    fpu_current_area[cpu] = next_area;
+    const auto cr0 = GetCR0();
+    const auto ts = fpu_owner_area[cpu] == next_area ? 0 : kCR0TS;
+    // CR0の書き込みは遅いので、変わるときだけ書く
+    if ((cr0 & kCR0TS) != ts)
+    {
+        SetCR0((cr0 & ~kCR0TS) | ts);
+    }
+}
+
+void ForgetFPUState(uint8_t *area)
+{
+    auto &owner = fpu_owner_area[CurrentCPU()];
+    if (owner == area)
+    {
+        owner = nullptr;
+    }
+}
+
+bool IsFPUStateLoaded(int cpu, const uint8_t *area)
+{
+    return fpu_owner_area[cpu] == area;
+}
+
+void ReleaseFPUState(uint8_t *area)
+{
+    const int cpu = CurrentCPU();
+    if (fpu_owner_area[cpu] != area)
+    {
+        return;
+    }
+    const auto cr0 = GetCR0();
+    SetCR0(cr0 & ~kCR0TS);
+    SaveFPUState(area);
+    SetCR0(cr0);
+    fpu_owner_area[cpu] = nullptr;
+}
+
+void MeasureFPUSwitchCost()
+{
+    const auto stack = AllocateTaskStack(Task::kDefaultStackBytes);
+    if (stack.error)
+    {
+        Log(kWarn, "failed to allocate a stack for the FPU benchmark: %s\n", stack.error.Name());
+        return;
+    }
+
+    InterruptGuard guard;
+    bench_main_area = fpu_current_area[CurrentCPU()];
+
+    memset(&bench_partner_ctx, 0, sizeof(bench_partner_ctx));
+    bench_partner_ctx.cr3 = GetCR3();
+    bench_partner_ctx.rflags = 0x2; // 測っている間は割り込み禁止
+    bench_partner_ctx.cs = kKernelCS;
+    bench_partner_ctx.ss = kKernelSS;
+    bench_partner_ctx.rsp = (stack.value.End() & ~0xflu) - 8;
+    bench_partner_ctx.rip = reinterpret_cast<uint64_t>(BenchPartner);
+    *reinterpret_cast<uint32_t *>(&bench_partner_ctx.fpu_area[24]) = 0x1f80;
+
+    const auto eager = MeasureSwitch(SwitchFPUContextEager, false);
+    const auto lazy = MeasureSwitch(SwitchFPUContext, false);
+    const auto lazy_sse = MeasureSwitch(SwitchFPUContext, true);
+
+    // FPUに呼び出し元の状態を載せ直しておく
+    SwitchFPUContextEager(bench_main_area);
+    FreeTaskStack(stack.value);
+
+    Log(kInfo, "task switch: %lu (eager), %lu (lazy), %lu (lazy, both use SSE) TSC cycles\n",
+        eager, lazy, lazy_sse);
+}
@@ -0,0 +1,82 @@
+/**
+ * @file fpu.hpp
+ * @brief タスクごとのFPU/SSEの状態を切り替えるプログラム
+ *
+ * タスクを切り替えるときにはFPUの状態を保存・復帰せず、CR0.TSを立てておくだけにする。
+ * 切り替え先のタスクが最初にFPU/SSE命令を使ったときに#NM（Device Not Available）が起き、
+ * そのハンドラが前の持ち主の状態を保存して、実行中のタスクの状態を復帰する。
+ * FPUを使わないタスクの間の切り替えでは512バイト以上の保存・復帰を丸ごと省ける。
+ * FPUはCPUごとにあるので、持ち主もCPUごとに覚える。状態が載ったままのタスクは、そのCPUでしか保存できないので他のCPUへ移せない。
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief FPUの状態を保存する領域の大きさ
+ *
+ * xsaveで保存するのはx87とSSEだけ（XCR0 = 3）なので、fxsaveと同じ512バイトにXSAVEヘッダの64バイトを足した大きさ。
+ * 領域は64バイト境界に置く。
+ */
+const size_t kFPUStateBytes = 576;
+
+/**
+ * @brief 実行中のCPUのFPUを使えるようにし、状態の保存にxsaveoptを使えるか調べる
+ *
+ * BSPでは最初のタスクを作る前に、APでは起動するときに呼ぶ。
+ */
+void InitializeFPU();
+
+/**
+ * @brief 実行中のCPUのFPUの状態がareaのものであるとする
+ *
+ * TaskManagerを作ったコンテキスト（APではアイドルタスクになるコンテキスト）の状態は既にFPUに載っているので、その保存先を登録する。
+ *
+ * @param area
+ */
+void InitializeFPUOwner(uint8_t *area);
+
+/**
+ * @brief 次に実行するタスクのFPUの状態の保存先を設定する。SwitchContextの直前に割り込み禁止で呼ぶ
+ *
+ * FPUに載っているのが別のタスクの状態ならCR0.TSを立て、実際の保存・復帰は#NMのハンドラに任せる。
+ *
+ * @param next_area
+ */
+void SwitchFPUContext(uint8_t *next_area);
+
+/**
+ * @brief 終えるタスクの状態が実行中のCPUのFPUに載っていれば、保存せずに捨てるようにする。割り込み禁止で呼ぶ
+ *
+ * 持ち主は載せたCPUの#NMのハンドラも読み書きするので、他のCPUの持ち主は外さない。
+ * タスクを最後に実行したCPUで、切り替えて離れるときに呼ぶ。
+ *
+ * @param area
+ */
+void ForgetFPUState(uint8_t *area);
+
+/**
+ * @brief areaの状態がCPU cpuのFPUに載ったままか
+ *
+ * @param cpu
+ * @param area
+ */
+bool IsFPUStateLoaded(int cpu, const uint8_t *area);
+
+/**
+ * @brief areaの状態が実行中のCPUのFPUに載っていれば保存して手放し、他のCPUへ移せるようにする。割り込み禁止で呼ぶ
+ *
+ * @param area
+ */
+void ReleaseFPUState(uint8_t *area);
+
+/**
+ * @brief FPUの状態を切り替えにかかる時間を測ってログに出す
+ *
+ * 2つのコンテキストの間で切り替えを繰り返し、毎回保存・復帰する場合と遅延させる場合の1回あたりのTSCのサイクル数を比べる。
+ * 遅延させる場合は、どちらもFPUを使わないときと、どちらも毎回SSE命令を使う（毎回#NMが起きる）ときを測る。
+ * 割り込みハンドラを登録した後に呼ぶ。
+ */
+void MeasureFPUSwitchCost();
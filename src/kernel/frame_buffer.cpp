@@ -54,13 +54,22 @@ Error FrameBuffer::Initialize(const FrameBufferConfig &config)
     {
         // config_.frame_bufferがnullptrでなくすでに何らかのポインタが設定されている場合は、そのポインタが指すメモリ領域を描画領域として使う[みかん本236p]
         // 実際にこのケースになるのはデスクトップのVRAMをmain文の先頭で確保している箇所ぐらい。[みかん本239p]
-        buffer_.resize(0);
+        buffer_.reset();
     }
     else
     {
         // 1ピクセルのバイト数ｘ横ｘ縦のメモリ領域を確保する。
-        buffer_.resize(bytes_per_pixel * config_.horizontal_resolution * config_.vertical_resolution);
-        config_.frame_buffer = buffer_.data();
+        // ウインドウの生成を遅くしないよう、ゼロクリア済みのフレームをもらう
+        const size_t bytes = bytes_per_pixel * config_.horizontal_resolution * config_.vertical_resolution;
+        const size_t num_frames = (bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+        const auto frame = AllocateZeroed(num_frames);
+        if (frame.error)
+        {
+            return frame.error;
+        }
+        buffer_ = std::unique_ptr<uint8_t[], FrameDeleter>{
+            reinterpret_cast<uint8_t *>(frame.value.Frame()), FrameDeleter{num_frames, MemoryTag::kUntagged}};
+        config_.frame_buffer = buffer_.get();
         config_.pixels_per_scan_line = config_.horizontal_resolution;
     }
 
@@ -11,6 +11,7 @@
 #include "frame_buffer_config.hpp"
 #include "graphics.hpp"
 #include "error.hpp"
+#include "memory_manager.hpp"
 
 /**
  * @brief フレームバッファ[みかん本234p]
@@ -56,7 +57,7 @@ private:
     /** @brief 描画領域の縦横サイズピクセルのデータ形式など描画領域に関する構成情報を保持する */
     FrameBufferConfig config_{};
     /** @brief ピクセルの配列描画領域の本体。ピクセルデータ形式は機種によって様々だからWindows::data_とはことなりuint8_tの配列で持つ */
-    std::vector<uint8_t> buffer_{};
+    std::unique_ptr<uint8_t[], FrameDeleter> buffer_{};
     /** @brief この描画領域と関連付けたPixelWriterのインスタンス writer_が指すインスタンスの所有権はFrameBufferが持つ。*/
     std::unique_ptr<FrameBufferWriter> writer_{};
 };
@@ -8,6 +8,10 @@
 #include "asmfunc.h"
 #include "segment.hpp"
 #include "timer.hpp"
+#include "logger.hpp"
+#include "paging.hpp"
+#include "task.hpp"
+#include "task_stack.hpp"
 
 std::array<InterruptDescriptor, 256> idt;
 
@@ -33,27 +37,79 @@ void NotifyEndOfInterrupt()
 
 namespace
 {
-    // メイン関数に割り込み発生を通知するためのキュー
-    std::deque<Message> *msg_queue;
+    // 割り込み発生を通知するタスクのID
+    uint64_t xhci_task_id;
 
     __attribute__((interrupt)) void IntHandlerXHCI(InterruptFrame *frame)
     {
-        // キューを介してメイン関数に割り込み発生を通知する
-        msg_queue->push_back(Message{Message::kInterruptXHCI});
+        // タスクのメッセージキューを介して割り込み発生を通知する（眠っていれば起こす）
+        task_manager->SendMessage(xhci_task_id, Message{Message::kInterruptXHCI});
         NotifyEndOfInterrupt();
+        task_manager->SwitchTaskIfPreempted();
     }
 
     __attribute__((interrupt)) void IntHandlerLAPICTimer(InterruptFrame *frame)
     {
-        // msg_queue->push_back(Message{Message::kInterruptLAPICTimer});
         LAPICTimerOnInterrupt();
     }
+
+    __attribute__((interrupt)) void IntHandlerReschedule(InterruptFrame *frame)
+    {
+        // 送った側が実行待ちキューに横取りの保留を記録してあるので、ここで切り替える
+        NotifyEndOfInterrupt();
+        task_manager->SwitchTaskIfPreempted();
+    }
+
+    __attribute__((interrupt)) void IntHandlerTLBFlush(InterruptFrame *frame)
+    {
+        AcknowledgeTLBFlush();
+        NotifyEndOfInterrupt();
+    }
+
+    __attribute__((interrupt)) void IntHandlerTimerRearm(InterruptFrame *frame)
+    {
+        timer_manager->Rearm();
+        NotifyEndOfInterrupt();
+    }
+
+    /**
+     * @brief 回復できないフォルトなので、割り込み禁止のまま止まる
+     */
+    [[noreturn]] void Halt()
+    {
+        while (true)
+        {
+            __asm__("hlt");
+        }
+    }
+
+    // フォルトのハンドラはISTで別のスタックに切り替えて実行するので、タスクのスタックがあふれていても動ける
+    __attribute__((interrupt)) void IntHandlerPageFault(InterruptFrame *frame, uint64_t error_code)
+    {
+        const auto addr = GetCR2();
+        // エラーコードのbit0が0ならページが存在しないことによるフォルト
+        if ((error_code & 1) == 0 && IsInTaskStackRegion(addr))
+        {
+            Log(kError, "#PF: task stack overflow (guard page %016lx), rip %016lx\n", addr, frame->rip);
+        }
+        else
+        {
+            Log(kError, "#PF: address %016lx, error %lx, rip %016lx\n", addr, error_code, frame->rip);
+        }
+        Halt();
+    }
+
+    __attribute__((interrupt)) void IntHandlerDoubleFault(InterruptFrame *frame, uint64_t error_code)
+    {
+        Log(kError, "#DF: rip %016lx, rsp %016lx, cr2 %016lx\n", frame->rip, frame->rsp, GetCR2());
+        Halt();
+    }
 }
 
-void InitializeInterrupt(std::deque<Message> *msg_queue)
+void InitializeInterrupt(uint64_t task_id)
 {
-    // 無名名前空間のmsg_queueにメイン関数で生成したキューのポインタをコピー
-    ::msg_queue = msg_queue;
+    // 割り込みを通知する先のタスクを覚えておく。タスクはInitializeTaskで作っておくこと
+    ::xhci_task_id = task_id;
 
     // idtentryの追加
     SetIDTEntry(
@@ -66,7 +122,39 @@ void InitializeInterrupt(std::deque<Message> *msg_queue)
         MakeIDTAttr(DescriptorType::kInterruptGate, 0),
         reinterpret_cast<uint64_t>(IntHandlerLAPICTimer),
         kKernelCS);
+    SetIDTEntry(
+        idt[InterruptVector::kRescheduleIPI],
+        MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+        reinterpret_cast<uint64_t>(IntHandlerReschedule),
+        kKernelCS);
+    SetIDTEntry(
+        idt[InterruptVector::kTLBFlushIPI],
+        MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+        reinterpret_cast<uint64_t>(IntHandlerTLBFlush),
+        kKernelCS);
+    SetIDTEntry(
+        idt[InterruptVector::kTimerRearmIPI],
+        MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+        reinterpret_cast<uint64_t>(IntHandlerTimerRearm),
+        kKernelCS);
+
+    // FPUの状態を遅延して切り替える（fpu.hpp）。タスクのスタックで動くのでISTは使わない
+    SetIDTEntry(
+        idt[InterruptVector::kDeviceNotAvailable],
+        MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+        reinterpret_cast<uint64_t>(IntHandlerDeviceNotAvailable),
+        kKernelCS);
+    SetIDTEntry(
+        idt[InterruptVector::kPageFault],
+        MakeIDTAttr(DescriptorType::kInterruptGate, 0, true, kISTForFault),
+        reinterpret_cast<uint64_t>(IntHandlerPageFault),
+        kKernelCS);
+    SetIDTEntry(
+        idt[InterruptVector::kDoubleFault],
+        MakeIDTAttr(DescriptorType::kInterruptGate, 0, true, kISTForFault),
+        reinterpret_cast<uint64_t>(IntHandlerDoubleFault),
+        kKernelCS);
 
-    //
+    // APは同じIDTをStartApplicationProcessorsの中で登録する
     LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
 }
@@ -8,7 +8,6 @@
 
 #include <array>
 #include <cstdint>
-#include <deque>
 
 #include "x86_descriptor.hpp"
 #include "message.hpp"
@@ -76,8 +75,18 @@ class InterruptVector
 public:
     enum Number
     {
+        // CPUの例外
+        kDeviceNotAvailable = 7,
+        kDoubleFault = 8,
+        kPageFault = 14,
+
         kXHCI = 0x40,
         kLAPICTimer = 0x41,
+
+        // CPU間の割り込み（smp.hpp）
+        kRescheduleIPI = 0x42, // 実行待ちキューに優先度の高いタスクを積んだので切り替えさせる。アイドル中なら起こす
+        kTLBFlushIPI = 0x43,   // 共有する写像を変えたのでTLBを捨てさせる
+        kTimerRearmIPI = 0x44, // タイマを追加したのでBSPのLAPICタイマを設定し直させる
     };
 };
 
@@ -92,4 +101,36 @@ struct InterruptFrame
 
 void NotifyEndOfInterrupt();
 
-void InitializeInterrupt(std::deque<Message> *msg_queue);
+/**
+ * @brief 生存期間中は割り込みを禁止し、元の割り込み許可状態に戻す
+ *
+ * 割り込みが既に禁止されている状態（割り込みハンドラの中など）で作っても問題ない。
+ */
+class InterruptGuard
+{
+public:
+    InterruptGuard()
+    {
+        __asm__ volatile("pushfq\n\tpop %0\n\tcli"
+                         : "=r"(rflags_)
+                         :
+                         : "memory");
+    }
+    ~InterruptGuard()
+    {
+        if (rflags_ & 0x200) // IF
+        {
+            __asm__ volatile("sti" ::
+                                 : "memory");
+        }
+    }
+    InterruptGuard(const InterruptGuard &) = delete;
+    /** @brief 作る前に割り込みが許可されていたか */
+    bool WasEnabled() const { return rflags_ & 0x200; }
+    InterruptGuard &operator=(const InterruptGuard &) = delete;
+
+private:
+    uint64_t rflags_;
+};
+
+void InitializeInterrupt(uint64_t task_id);
@@ -0,0 +1,316 @@
+#include "kernel_heap.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#include "logger.hpp"
+#include "memory_manager.hpp"
+
+struct _reent;
+
+namespace
+{
+    /** @brief 最小のサイズクラス（バイト）。空きリストのポインタが入り、16バイトに揃う大きさ */
+    const size_t kMinSlabObjectBytes = 16;
+    /** @brief サイズクラスの数。16, 32, ..., kMaxSlabObjectBytes */
+    const size_t kNumSizeClasses = __builtin_ctzl(kMaxSlabObjectBytes) - __builtin_ctzl(kMinSlabObjectBytes) + 1;
+    /** @brief フレーム単位で確保した領域を表すサイズクラス */
+    const uint32_t kLargeClass = kNumSizeClasses;
+    /** @brief ヘッダが壊れていないか確かめるための値 */
+    const uint32_t kHeapMagic = 0x4b484541; // "KHEA"
+
+    struct HeapHeader
+    {
+        uint32_t magic;
+        uint32_t size_class;
+        /** @brief フレーム単位で確保した場合の先頭フレームとフレーム数 */
+        size_t first_frame, num_frames;
+    };
+    static_assert(sizeof(HeapHeader) <= kHeapHeaderBytes);
+
+    /** @brief 空きオブジェクトの先頭に置いて空きリストをつなぐ */
+    struct FreeObject
+    {
+        FreeObject *next;
+    };
+
+    std::array<FreeObject *, kNumSizeClasses> free_lists{};
+
+    size_t SizeClassOf(size_t size)
+    {
+        if (size <= kMinSlabObjectBytes)
+        {
+            return 0;
+        }
+        // size以上の最小の2のべき乗を求める
+        const int bits = 64 - __builtin_clzl(size - 1);
+        return bits - __builtin_ctzl(kMinSlabObjectBytes);
+    }
+
+    size_t ObjectBytes(size_t size_class)
+    {
+        return kMinSlabObjectBytes << size_class;
+    }
+
+    /**
+     * @brief pが属する領域のヘッダを返す
+     *
+     * スラブのオブジェクトやフレーム単位の領域はフレームの先頭からkHeapHeaderBytes以上ずれているので、
+     * ページ境界に揃ったポインタはAllocateAlignedが返したものであり、ヘッダは直前のフレームの先頭にある。
+     */
+    HeapHeader *HeaderOf(const void *p)
+    {
+        const auto addr = reinterpret_cast<uintptr_t>(p);
+        if (addr % kBytesPerFrame == 0)
+        {
+            return reinterpret_cast<HeapHeader *>(addr - kBytesPerFrame);
+        }
+        return reinterpret_cast<HeapHeader *>(addr & ~(kBytesPerFrame - 1));
+    }
+
+    /**
+     * @brief 1フレームのスラブを確保し、size_classのオブジェクトに切り分けて空きリストに加える
+     */
+    bool RefillSizeClass(size_t size_class)
+    {
+        const auto frame = memory_manager->Allocate(1, MemoryTag::kHeap);
+        if (frame.error)
+        {
+            return false;
+        }
+
+        auto header = reinterpret_cast<HeapHeader *>(frame.value.Frame());
+        header->magic = kHeapMagic;
+        header->size_class = size_class;
+        header->first_frame = frame.value.ID();
+        header->num_frames = 1;
+
+        const auto object_bytes = ObjectBytes(size_class);
+        const auto slab = reinterpret_cast<uint8_t *>(header);
+        for (size_t offset = kHeapHeaderBytes; offset + object_bytes <= kBytesPerFrame; offset += object_bytes)
+        {
+            auto obj = reinterpret_cast<FreeObject *>(slab + offset);
+            obj->next = free_lists[size_class];
+            free_lists[size_class] = obj;
+        }
+        return true;
+    }
+
+    void *AllocateLarge(size_t size)
+    {
+        const size_t num_frames = (size + kHeapHeaderBytes + kBytesPerFrame - 1) / kBytesPerFrame;
+        const auto frame = memory_manager->Allocate(num_frames, MemoryTag::kHeap);
+        if (frame.error)
+        {
+            return nullptr;
+        }
+
+        auto header = reinterpret_cast<HeapHeader *>(frame.value.Frame());
+        header->magic = kHeapMagic;
+        header->size_class = kLargeClass;
+        header->first_frame = frame.value.ID();
+        header->num_frames = num_frames;
+        return reinterpret_cast<uint8_t *>(header) + kHeapHeaderBytes;
+    }
+
+    /**
+     * @brief alignmentの倍数のアドレスから始まる領域をフレーム単位で確保する（alignmentはページサイズ以上に扱う）
+     *
+     * 先頭フレームをヘッダ専用にし、その直後からalignmentに揃った位置を返す。
+     */
+    void *AllocatePageAligned(size_t alignment, size_t size)
+    {
+        alignment = std::max<size_t>(alignment, kBytesPerFrame);
+        const size_t data_frames = (size + kBytesPerFrame - 1) / kBytesPerFrame;
+        const size_t num_frames = 1 + data_frames + (alignment / kBytesPerFrame - 1);
+        const auto frame = memory_manager->Allocate(num_frames, MemoryTag::kHeap);
+        if (frame.error)
+        {
+            return nullptr;
+        }
+
+        const auto base = reinterpret_cast<uintptr_t>(frame.value.Frame());
+        const auto p = (base + kBytesPerFrame + alignment - 1) & ~(alignment - 1);
+        auto header = reinterpret_cast<HeapHeader *>(p - kBytesPerFrame);
+        header->magic = kHeapMagic;
+        header->size_class = kLargeClass;
+        header->first_frame = frame.value.ID();
+        header->num_frames = num_frames;
+        return reinterpret_cast<void *>(p);
+    }
+
+    void *KernelMalloc(size_t size)
+    {
+        if (memory_manager == nullptr)
+        {
+            // InitializeMemoryManager前はnewlibのsbrkと同様に確保できない
+            return nullptr;
+        }
+
+        SpinLockGuard guard{memory_manager_lock};
+        if (size > kMaxSlabObjectBytes)
+        {
+            return AllocateLarge(size);
+        }
+
+        const auto size_class = SizeClassOf(size);
+        if (free_lists[size_class] == nullptr && !RefillSizeClass(size_class))
+        {
+            return nullptr;
+        }
+        auto obj = free_lists[size_class];
+        free_lists[size_class] = obj->next;
+        return obj;
+    }
+
+    void KernelFree(void *p)
+    {
+        if (p == nullptr)
+        {
+            return;
+        }
+
+        SpinLockGuard guard{memory_manager_lock};
+        auto header = HeaderOf(p);
+        if (header->magic != kHeapMagic)
+        {
+            Log(kError, "free: invalid pointer %p\n", p);
+            return;
+        }
+
+        if (header->size_class == kLargeClass)
+        {
+            memory_manager->Free(FrameID{header->first_frame}, header->num_frames, MemoryTag::kHeap);
+            return;
+        }
+
+        auto obj = reinterpret_cast<FreeObject *>(p);
+        obj->next = free_lists[header->size_class];
+        free_lists[header->size_class] = obj;
+    }
+
+    void *KernelCalloc(size_t num, size_t size)
+    {
+        if (size != 0 && num > SIZE_MAX / size)
+        {
+            return nullptr;
+        }
+        void *p = KernelMalloc(num * size);
+        if (p)
+        {
+            memset(p, 0, num * size);
+        }
+        return p;
+    }
+
+    void *KernelRealloc(void *p, size_t size)
+    {
+        if (p == nullptr)
+        {
+            return KernelMalloc(size);
+        }
+        if (size == 0)
+        {
+            KernelFree(p);
+            return nullptr;
+        }
+
+        const auto usable = HeapUsableSize(p);
+        if (size <= usable)
+        {
+            return p;
+        }
+        void *new_p = KernelMalloc(size);
+        if (new_p)
+        {
+            memcpy(new_p, p, usable);
+            KernelFree(p);
+        }
+        return new_p;
+    }
+
+    void *NewOrHandle(size_t size)
+    {
+        void *p;
+        while ((p = KernelMalloc(size)) == nullptr)
+        {
+            std::get_new_handler()();
+        }
+        return p;
+    }
+
+    void *AlignedNewOrHandle(size_t size, std::align_val_t alignment)
+    {
+        void *p;
+        while ((p = AllocateAligned(static_cast<size_t>(alignment), size)) == nullptr)
+        {
+            std::get_new_handler()();
+        }
+        return p;
+    }
+} // namespace
+
+void *AllocateAligned(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        return nullptr;
+    }
+    if (alignment <= kHeapHeaderBytes)
+    {
+        // スラブのオブジェクトはフレーム先頭からkHeapHeaderBytes + n * ObjectBytes(クラス)、フレーム単位の領域は
+        // kHeapHeaderBytesの位置にあるので、alignment以上の大きさで確保すればalignmentに揃う
+        return KernelMalloc(std::max(size, alignment));
+    }
+    if (memory_manager == nullptr)
+    {
+        return nullptr;
+    }
+
+    SpinLockGuard guard{memory_manager_lock};
+    return AllocatePageAligned(alignment, size);
+}
+
+size_t HeapUsableSize(const void *p)
+{
+    const auto header = HeaderOf(p);
+    if (header->size_class == kLargeClass)
+    {
+        return (header->first_frame + header->num_frames) * kBytesPerFrame - reinterpret_cast<uintptr_t>(p);
+    }
+    return ObjectBytes(header->size_class);
+}
+
+extern "C"
+{
+    void *malloc(size_t size) { return KernelMalloc(size); }
+    void free(void *p) { KernelFree(p); }
+    void *calloc(size_t num, size_t size) { return KernelCalloc(num, size); }
+    void *realloc(void *p, size_t size) { return KernelRealloc(p, size); }
+    size_t malloc_usable_size(void *p) { return p ? HeapUsableSize(p) : 0; }
+    void *aligned_alloc(size_t alignment, size_t size) { return AllocateAligned(alignment, size); }
+    void *memalign(size_t alignment, size_t size) { return AllocateAligned(alignment, size); }
+
+    // newlib内部から呼ばれるリエントラント版。newlibのmallocがリンクされないよう全て差し替える
+    void *_malloc_r(_reent *, size_t size) { return KernelMalloc(size); }
+    void _free_r(_reent *, void *p) { KernelFree(p); }
+    void *_calloc_r(_reent *, size_t num, size_t size) { return KernelCalloc(num, size); }
+    void *_realloc_r(_reent *, void *p, size_t size) { return KernelRealloc(p, size); }
+}
+
+void *operator new(size_t size) { return NewOrHandle(size); }
+void *operator new[](size_t size) { return NewOrHandle(size); }
+void operator delete(void *p) noexcept { KernelFree(p); }
+void operator delete[](void *p) noexcept { KernelFree(p); }
+void operator delete(void *p, size_t) noexcept { KernelFree(p); }
+void operator delete[](void *p, size_t) noexcept { KernelFree(p); }
+
+void *operator new(size_t size, std::align_val_t alignment) { return AlignedNewOrHandle(size, alignment); }
+void *operator new[](size_t size, std::align_val_t alignment) { return AlignedNewOrHandle(size, alignment); }
+void operator delete(void *p, std::align_val_t) noexcept { KernelFree(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { KernelFree(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { KernelFree(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { KernelFree(p); }
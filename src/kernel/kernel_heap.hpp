@@ -0,0 +1,45 @@
+/**
+ * @file kernel_heap.hpp
+ * @brief カーネルの動的メモリ確保（malloc/free, operator new/delete）
+ *
+ * newlibのmalloc（sbrkで伸ばす1つのヒープ）の代わりに、サイズクラスごとのスラブで小さなオブジェクトを管理する。
+ * - kMaxSlabObjectBytes以下の要求は2のべき乗のサイズクラスに切り上げ、クラスごとの空きリストから取り出す。
+ *   空きリストが空のときはメモリマネージャから1フレーム確保してそのクラスのオブジェクトに切り分ける。
+ * - それより大きい要求はメモリマネージャからフレーム単位で直接確保する。
+ *
+ * 各フレームの先頭kHeapHeaderBytesにはヘッダがあり、解放時はポインタが属するフレームのヘッダから大きさを知る。
+ * kHeapHeaderBytesより大きいアラインメントの要求はフレーム単位で確保し、ヘッダはその直前のフレームに置く。
+ * 空きリストの操作はmemory_manager_lockを取って（割り込みも禁止して）行うので、割り込みハンドラの中や他のCPUからも呼び出せる。
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+
+/** @brief 各フレームの先頭に置くヘッダの大きさ（バイト） */
+const size_t kHeapHeaderBytes = 64;
+
+/** @brief スラブから確保する最大のサイズ（バイト）。これより大きい要求はフレーム単位で確保する */
+const size_t kMaxSlabObjectBytes = 1024;
+
+/**
+ * @brief mallocなどで確保した領域の実際に使える大きさ（バイト）を返す
+ *
+ * @param p mallocなどが返したポインタ
+ * @return size_t 
+ */
+size_t HeapUsableSize(const void *p);
+
+/**
+ * @brief 先頭アドレスがalignmentの倍数になる領域を確保する
+ *
+ * posix_memalignやaligned_alloc、アラインメント指定付きのoperator newが使う。
+ * kHeapHeaderBytes以下のアラインメントはmallocと同じ領域で満たし、それより大きいものはメモリマネージャからフレーム単位で直接確保する。
+ * 解放はfreeで行う。
+ *
+ * @param alignment 2のべき乗
+ * @param size 
+ * @return void* 確保できなかった場合やalignmentが不正な場合はnullptr
+ */
+void *AllocateAligned(size_t alignment, size_t size);
@@ -1,6 +1,8 @@
 #include "keyboard.hpp"
 #include <memory>
 #include "usb/classdriver/keyboard.hpp"
+#include "message.hpp"
+#include "task.hpp"
 
 namespace
 {
@@ -56,9 +58,9 @@ namespace
 
 } // namespace
 
-void InitializeKeyboard(std::deque<Message> &msg_queue)
+void InitializeKeyboard(uint64_t task_id)
 {
-    usb::HIDKeyboardDriver::default_observer = [&msg_queue](uint8_t modifier, uint8_t keycode)
+    usb::HIDKeyboardDriver::default_observer = [task_id](uint8_t modifier, uint8_t keycode)
     {
         const bool shift = (modifier & (kLShiftBitMask | kRShiftBitMask)) != 0;
         char ascii = keycode_map[keycode];
@@ -70,6 +72,6 @@ void InitializeKeyboard(std::deque<Message> &msg_queue)
         msg.arg.keyboard.modifier = modifier;
         msg.arg.keyboard.keycode = keycode;
         msg.arg.keyboard.ascii = ascii;
-        msg_queue.push_back(msg);
+        task_manager->SendMessage(task_id, msg);
     };
 }
\ No newline at end of file
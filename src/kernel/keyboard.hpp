@@ -6,7 +6,11 @@
 
 #pragma once
 
-#include <deque>
-#include "message.hpp"
+#include <cstdint>
 
-void InitializeKeyboard(std::deque<Message> &msg_queue);
+/**
+ * @brief キー入力をkKeyPushメッセージとしてtask_idのタスクに送るよう設定する
+ *
+ * @param task_id
+ */
+void InitializeKeyboard(uint64_t task_id);
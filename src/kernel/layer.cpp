@@ -2,6 +2,7 @@
 #include "layer.hpp"
 #include "console.hpp"
 #include "logger.hpp"
+#include "asmfunc.h"
 
 Layer::Layer(unsigned int id) : id_{id} {}
 
@@ -41,8 +42,14 @@ void Layer::DrawTo(FrameBuffer &screen, const Rectangle<int> &area) const
     }
 }
 
+LayerManager::LayerManager()
+{
+    RegisterLockStats(mutex_.Stats(), "layer");
+}
+
 void LayerManager::SetWriter(FrameBuffer *screen)
 {
+    MutexGuard guard{mutex_};
     screen_ = screen;
     FrameBufferConfig back_config = screen->Config();
     back_config.frame_buffer = nullptr;
@@ -51,12 +58,36 @@ void LayerManager::SetWriter(FrameBuffer *screen)
 
 Layer &LayerManager::NewLayer()
 {
+    MutexGuard guard{mutex_};
     latest_id_++; // latest_idの初期値は0でそれから単調増加なのでnewされるLayerのidは必ず1以上
     // emplace_backは追加した要素の参照を返すが、std::unique_ptr<Layer>&は共有できないので、Layer&型に変換している
     return *layers_.emplace_back(new Layer{latest_id_});
 }
 
 void LayerManager::Draw(const Rectangle<int> &area) const
+{
+    MutexGuard guard{mutex_};
+    DrawLocked(area);
+}
+
+void LayerManager::Draw(unsigned int id) const
+{
+    MutexGuard guard{mutex_};
+    DrawLocked(id);
+}
+
+bool LayerManager::TryDraw(unsigned int id) const
+{
+    if (!mutex_.TryLock())
+    {
+        return false;
+    }
+    DrawLocked(id);
+    mutex_.Unlock();
+    return true;
+}
+
+void LayerManager::DrawLocked(const Rectangle<int> &area) const
 {
     for (auto layer : layer_stack_)
     {
@@ -65,7 +96,7 @@ void LayerManager::Draw(const Rectangle<int> &area) const
     screen_->Copy(area.pos, back_buffer_, area);
 }
 
-void LayerManager::Draw(unsigned int id) const
+void LayerManager::DrawLocked(unsigned int id) const
 {
     bool draw = false;
     Rectangle<int> window_area;
@@ -86,32 +117,44 @@ void LayerManager::Draw(unsigned int id) const
     screen_->Copy(window_area.pos, back_buffer_, window_area);
 }
 
+uint64_t LayerManager::MeasureScreenCopy() const
+{
+    MutexGuard guard{mutex_};
+    const Rectangle<int> area{{0, 0}, ScreenSize()};
+    const auto start = ReadTSC();
+    screen_->Copy(area.pos, back_buffer_, area);
+    return ReadTSC() - start;
+}
+
 void LayerManager::Move(unsigned int id, Vector2D<int> new_pos)
 {
+    MutexGuard guard{mutex_};
     // FindLayerはidが見つからないときにNullptrを返す。IDの有効性の確認は呼び出し側の責任 みかん本218p
     auto layer = FindLayer(id);
     const auto window_size = layer->GetWindow()->Size();
     const auto old_pos = layer->GetPosition();
     layer->Move(new_pos);
-    Draw({old_pos, window_size});
-    Draw(id);
+    DrawLocked({old_pos, window_size});
+    DrawLocked(id);
 }
 
 void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_diff)
 {
+    MutexGuard guard{mutex_};
     auto layer = FindLayer(id);
     const auto window_size = layer->GetWindow()->Size();
     const auto old_pos = layer->GetPosition();
     layer->MoveRelative(pos_diff);
-    Draw({old_pos, window_size});
-    Draw(id);
+    DrawLocked({old_pos, window_size});
+    DrawLocked(id);
 }
 
 void LayerManager::UpDown(unsigned int id, int new_height)
 {
+    MutexGuard guard{mutex_};
     if (new_height < 0)
     {
-        Hide(id);
+        HideLocked(id);
         return;
     }
 
@@ -140,6 +183,12 @@ void LayerManager::UpDown(unsigned int id, int new_height)
 }
 
 void LayerManager::Hide(unsigned int id)
+{
+    MutexGuard guard{mutex_};
+    HideLocked(id);
+}
+
+void LayerManager::HideLocked(unsigned int id)
 {
     auto layer = FindLayer(id);
     auto pos = std::find(layer_stack_.begin(), layer_stack_.end(), layer);
@@ -152,6 +201,7 @@ void LayerManager::Hide(unsigned int id)
 
 Layer *LayerManager::FindLayerByPosition(Vector2D<int> pos, unsigned int exclude_id) const
 {
+    MutexGuard guard{mutex_};
     auto pred = [pos, exclude_id](Layer *layer)
     {
         if (layer->ID() == exclude_id)
@@ -10,6 +10,7 @@
 #include <vector>
 
 #include "graphics.hpp"
+#include "sync.hpp"
 #include "window.hpp"
 
 /**
@@ -64,11 +65,15 @@ private:
 
 /**
  * @brief LayerManagerは複数のレイヤを管理する。
- * 
+ *
+ * 複数のタスクから描画するので、公開しているメンバ関数はmutex_を取ってから処理する。
+ * 描画には時間がかかるので、待つタスクは眠らせる。割り込み禁止中はTryDrawを使う。
+ * NewLayerが返したLayerは、UpDownで表示する前に設定しておく。
  */
 class LayerManager
 {
 public:
+    LayerManager();
     /**
      * @brief Drawメソッドなどで描画する際の描画先を設定する
      * 
@@ -96,6 +101,13 @@ public:
      */
     void Draw(unsigned int id) const;
 
+    /**
+     * @brief 取れればmutex_を取ってDraw(id)する。眠らないので、割り込み禁止中でも呼べる
+     *
+     * @return true 描画した
+     */
+    bool TryDraw(unsigned int id) const;
+
     /**
      * @brief レイヤの位置情報を指定された絶対座標へと更新する。再描画する
      * 
@@ -127,10 +139,20 @@ public:
      */
     void Hide(unsigned int id);
 
+    /**
+     * @brief バックバッファの内容を画面全体へ転送し、かかったTSCのサイクル数を返す
+     *
+     * フレームバッファの写像の設定による転送速度の違いを測るために使う。
+     *
+     * @return uint64_t
+     */
+    uint64_t MeasureScreenCopy() const;
+
     /** @brief 指定された座標にウィンドウを持つ最も上に表示されているレイヤーを探す。 */
     Layer *FindLayerByPosition(Vector2D<int> pos, unsigned int exclude_id) const;
 
 private:
+    mutable Mutex mutex_;
     FrameBuffer *screen_{nullptr};
     /** @brief バックバッファ[みかん本10.6章] */
     mutable FrameBuffer back_buffer_{};
@@ -145,6 +167,12 @@ private:
      * @return Layer* 
      */
     Layer *FindLayer(unsigned int id);
+    /** @brief mutex_を取った状態でDraw(area)する */
+    void DrawLocked(const Rectangle<int> &area) const;
+    /** @brief mutex_を取った状態でDraw(id)する */
+    void DrawLocked(unsigned int id) const;
+    /** @brief mutex_を取った状態でHideする */
+    void HideLocked(unsigned int id);
 };
 
 extern LayerManager *layer_manager;
@@ -7,6 +7,8 @@
 #include <new>
 #include <cerrno>
 
+#include "kernel_heap.hpp"
+
 int printk(const char *format, ...);
 
 // add at day06c modi at day09b
@@ -20,7 +22,18 @@ std::new_handler std::get_new_handler() noexcept
 }
 
 // add at day06c
-extern "C" int posix_memalign(void **, size_t, size_t)
+extern "C" int posix_memalign(void **memptr, size_t alignment, size_t size)
 {
-    return ENOMEM;
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void *) != 0)
+    {
+        return EINVAL;
+    }
+
+    void *p = AllocateAligned(alignment, size);
+    if (p == nullptr)
+    {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
 }
@@ -10,7 +10,6 @@
 #include <array>
 #include <numeric>
 #include <vector>
-#include <deque>
 #include <limits>
 
 #include "frame_buffer_config.hpp"
@@ -34,6 +33,10 @@
 #include "acpi.hpp"
 #include "keyboard.hpp"
 #include "task.hpp"
+#include "fpu.hpp"
+#include "smp.hpp"
+#include "sync.hpp"
+#include "work_queue.hpp"
 
 /**
  * @brief カーネル内部からメッセージを出す関数[ref](みかん本の132p)
@@ -159,16 +162,178 @@ void TaskB(uint64_t task_id, int64_t data)
     }
 }
 
-void TaskIdle(uint64_t task_id, int64_t data)
+const int kStatsRows = 8;
+std::shared_ptr<Window> stats_window;
+unsigned int stats_window_layer_id;
+void InitializeStatsWindow()
 {
-    printk("TaskIdle: task_id=%lu, data=%lx\n", task_id, data);
+    stats_window = std::make_shared<Window>(8 * 55 + 16, 24 + 16 * (kStatsRows + 1) + 4, screen_config.pixel_format);
+    DrawWindow(*stats_window->Writer(), "Task Stats");
+
+    stats_window_layer_id = layer_manager->NewLayer().SetWindow(stats_window).SetDraggable(true).Move({500, 300}).ID();
+
+    layer_manager->UpDown(stats_window_layer_id, std::numeric_limits<int>::max());
+}
+
+/**
+ * @brief 1秒ごとに各タスクのCPU使用率、切り替え回数、実行待ち時間をstats_windowに表示する
+ *
+ * CPU使用率は前回表示してからのruntimeの増分を経過時間で割ったもの。waitは実行待ち時間の中央値と99パーセンタイル
+ * （ヒストグラムの段の上限なので2のべき乗）と最大値で、単位はマイクロ秒。
+ */
+void TaskStatsWindow(uint64_t task_id, int64_t data)
+{
+    const int kStatsTimer = 2;
+    // タスクは終わったり作り直されたりするので、前回の値はIDで引く
+    std::vector<TaskStatsEntry> prev_entries;
+    auto prev_runtime = [&prev_entries](uint64_t id) -> uint64_t
+    {
+        for (const auto &e : prev_entries)
+        {
+            if (e.id == id)
+            {
+                return e.stats.runtime;
+            }
+        }
+        return 0;
+    };
+    uint64_t prev_tsc = ReadTSC();
+    auto to_us = [](uint64_t tsc)
+    {
+        return tsc * 1000000 / tsc_freq;
+    };
+
+    char str[128];
     while (true)
     {
-        __asm__("hlt");
+        timer_manager->AddTimer(Timer{timer_manager->CurrentTick() + kTimerFreq, kStatsTimer, task_id});
+        const auto msg = task_manager->CurrentTask().ReceiveMessage();
+        if (msg.type != Message::kTimerTimeout)
+        {
+            continue;
+        }
+
+        const auto now = ReadTSC();
+        auto entries = task_manager->CollectStats();
+
+        FillRectangle(*stats_window->Writer(), {4, 24}, {stats_window->Width() - 8, 16 * (kStatsRows + 1)},
+                      {0xc6, 0xc6, 0xc6});
+        WriteString(*stats_window->Writer(), {8, 24}, "id cpu pr  cpu%  switch   vol/pre  wait50 wait99    max", {0, 0, 0});
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            if (i >= kStatsRows)
+            {
+                break;
+            }
+            const auto &e = entries[i];
+            const auto permille = (e.stats.runtime - prev_runtime(e.id)) * 1000 / (now - prev_tsc);
+            sprintf(str, "%2lu %3d %2d %3lu.%lu %7lu %4lu/%-4lu %7lu %6lu %6lu",
+                    e.id, e.cpu, e.priority, permille / 10, permille % 10, e.stats.switches,
+                    e.stats.voluntary % 10000, e.stats.preempted % 10000,
+                    to_us(e.stats.WaitPercentile(500)), to_us(e.stats.WaitPercentile(990)),
+                    to_us(e.stats.wait_max));
+            WriteString(*stats_window->Writer(), {8, 24 + 16 * (static_cast<int>(i) + 1)}, str, {0, 0, 0});
+        }
+        prev_entries = std::move(entries);
+        prev_tsc = now;
+        layer_manager->Draw(stats_window_layer_id);
+    }
+}
+
+/**
+ * @brief タスク専用の後半の写像が、他のタスクやCPUの移動で混ざらないことを確かめ続ける
+ *
+ * kPrivateSpaceBaseの1ページに、自分用の2つのフレームを1tickごとに交互に写像し直し、書いておいた値が読めるか調べる。
+ * 眠る間に他のCPUへ移ることがあるので、別のCPUで写像を変えた後に元のCPUへ戻ったときに
+ * PCIDのTLBに残った古い写像を使っていないかも分かる。同じアドレスを使うタスクを複数動かして、互いに見えないことも確かめる。
+ */
+void TaskPrivateSpaceCheck(uint64_t task_id, int64_t data)
+{
+    const int kCheckTimer = 3;
+    auto &task = task_manager->CurrentTask();
+    if (task.PML4() == KernelPML4())
+    {
+        Log(kWarn, "task %lu: no private address space to check\n", task_id);
+        return;
+    }
+    const auto frames = AllocateFrames(2, MemoryTag::kUntagged);
+    if (frames.error)
+    {
+        Log(kWarn, "task %lu: failed to allocate frames: %s\n", task_id, frames.error.Name());
+        return;
     }
+
+    // フレームには恒等写像（共有する前半）から、タスクと写像した回数の偶奇が分かる値を書いておく
+    uint64_t *const values[2] = {
+        reinterpret_cast<uint64_t *>(frames.value.Frame()),
+        reinterpret_cast<uint64_t *>(frames.value.Frame() + kBytesPerFrame)};
+    *values[0] = task_id << 1;
+    *values[1] = (task_id << 1) | 1;
+    auto check = [&task, task_id](uint64_t expected)
+    {
+        const uint64_t value = *reinterpret_cast<volatile uint64_t *>(kPrivateSpaceBase);
+        if (value != expected)
+        {
+            Log(kError, "task %lu: private page reads %lx on CPU %d (expected %lx)\n",
+                task_id, value, task.CPU(), expected);
+        }
+    };
+
+    for (uint64_t round = 0;; ++round)
+    {
+        const auto frame = values[round % 2];
+        if (auto err = MapRange(task.PML4(), kPrivateSpaceBase, reinterpret_cast<uint64_t>(frame), kBytesPerFrame))
+        {
+            Log(kError, "task %lu: failed to map a private page: %s\n", task_id, err.Name());
+            FreeFrames(frames.value, 2, MemoryTag::kUntagged);
+            return;
+        }
+        // 写像を実行中のCPUのTLBに載せてから眠る。起きたときは別のCPUに移っているかもしれない
+        check(*frame);
+        timer_manager->AddTimer(Timer{timer_manager->CurrentTick() + 1, kCheckTimer, task_id});
+        while (task.ReceiveMessage().type != Message::kTimerTimeout)
+        {
+        }
+        check(*frame);
+    }
+}
+
+void TaskIdle(uint64_t task_id, int64_t data)
+{
+    printk("TaskIdle: task_id=%lu, data=%lx\n", task_id, data);
+    // 他のCPUのタスクを盗み、ゼロクリア済みフレームを作り溜め、それも済んだら休む
+    task_manager->Idle();
 }
 
-std::deque<Message> *main_queue;
+/**
+ * @brief フレームバッファをWrite Combiningで写像し直し、前後で画面全体の転送にかかる時間を比べる
+ *
+ * @param config
+ */
+void InitializeFrameBufferWriteCombining(const FrameBufferConfig &config)
+{
+    const int kRounds = 8;
+    auto measure = []
+    {
+        uint64_t total = 0;
+        for (int i = 0; i < kRounds; ++i)
+        {
+            total += layer_manager->MeasureScreenCopy();
+        }
+        return total / kRounds;
+    };
+
+    const auto before = measure();
+    // 1ピクセルは4バイト
+    const uint64_t bytes = 4ull * config.pixels_per_scan_line * config.vertical_resolution;
+    if (auto err = SetWriteCombining(reinterpret_cast<uint64_t>(config.frame_buffer), bytes))
+    {
+        Log(kWarn, "failed to map frame buffer as write-combining: %s\n", err.Name());
+        return;
+    }
+    const auto after = measure();
+    Log(kInfo, "full-screen copy: %lu -> %lu TSC cycles (write-combining)\n", before, after);
+}
 
 // 新しいスタック領域（UEFI管理ではなく、OS管理の領域、[ref](みかん本の186p)）
 alignas(16) uint8_t kernel_main_stack[1024 * 1024];
@@ -192,10 +357,21 @@ extern "C" void KernelMainNewStack(
     SetLogLevel(kInfo);
 
     InitializeSegmentation();
-    InitializePaging();
+    // ページテーブルはメモリマネージャから確保するので、メモリマネージャを先に初期化する
     InitializeMemoryManager(memory_map);
-    ::main_queue = new std::deque<Message>(32);
-    InitializeInterrupt(main_queue);
+    InitializePaging(memory_map, frame_buffer_config_ref);
+    InitializeTSS();
+    ReclaimBootServicesMemory(memory_map);
+
+    InitializeFPU();
+    // 割り込みやタイマはメッセージをタスクのキューに送るので、それらより先にタスクを用意する
+    InitializeTask();
+    // 入力を処理するメイン関数のタスクは、TaskBのように計算し続けるタスクより優先する。
+    // メッセージが無い間は眠るので、優先度の低いタスクも実行できる
+    Task &main_task = task_manager->MainTask();
+    main_task.SetPriority(Task::kDefaultPriority + 1);
+    InitializeInterrupt(main_task.ID());
+    MeasureFPUSwitchCost();
 
     InitializePCI();
     usb::xhci::Initialize();
@@ -204,25 +380,29 @@ extern "C" void KernelMainNewStack(
     InitializeMainWindow();
     InitializeTextWindow();
     InitializeTaskBWindow();
+    InitializeStatsWindow();
     InitializeMouse();
     layer_manager->Draw({{0, 0}, ScreenSize()});
+    InitializeFrameBufferWriteCombining(frame_buffer_config_ref);
 
     acpi::Initialize(acpi_table);
-    InitializeLAPICTimer(*main_queue);
+    InitializeLAPICTimer();
+    StartApplicationProcessors();
+    InitializeWorkQueue();
 
-    InitializeKeyboard(*main_queue);
+    InitializeKeyboard(main_task.ID());
 
     const int kTextboxCursorTimer = 1;
     const int kTimer05sec = static_cast<int>(kTimerFreq * 0.5);
-    __asm__("cli");
-    timer_manager->AddTimer(Timer{kTimer05sec, kTextboxCursorTimer});
-    __asm__("sti");
+    timer_manager->AddTimer(Timer{kTimer05sec, kTextboxCursorTimer, main_task.ID()});
     bool textbox_cursor_visible = false;
 
-    InitializeTask();
     const uint64_t taskb_id = task_manager->NewTask().InitContext(TaskB, 42).Wakeup().ID();
-    task_manager->NewTask().InitContext(TaskIdle, 0xdeadbeef).Wakeup();
-    task_manager->NewTask().InitContext(TaskIdle, 0xcafebabe).Wakeup();
+    task_manager->NewTask().InitContext(TaskStatsWindow, 0).Wakeup();
+    task_manager->NewTask().InitContext(TaskIdle, 0xdeadbeef).SetPriority(0).Wakeup();
+    task_manager->NewTask().InitContext(TaskIdle, 0xcafebabe).SetPriority(0).Wakeup();
+    task_manager->NewTask().InitContext(TaskPrivateSpaceCheck, 0).Wakeup();
+    task_manager->NewTask().InitContext(TaskPrivateSpaceCheck, 0).Wakeup();
 
     char str[128];
 
@@ -231,37 +411,15 @@ extern "C" void KernelMainNewStack(
     // キューに溜まったイベントを処理し続ける
     while (1)
     {
-        __asm__("cli");
         const auto tick = timer_manager->CurrentTick();
-        __asm__("sti");
 
         sprintf(str, "%010lu", tick);
         FillRectangle(*main_window->Writer(), {24, 28}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
         WriteString(*main_window->Writer(), {24, 28}, str, {0, 0, 0});
         layer_manager->Draw(main_window_layer_id);
 
-        // cli(Clear Interrupt Flag)命令はCPUの割り込みフラグ（IF, Interrupt Flag）を0にする命令。
-        // IFはCPU内のRFLAGSレジスタにあるフラグ。
-        // IFが0のときCPUは外部割り込みを受け取らなくなる。
-        // -> IntHandlerXHCI()は実行されなく鳴る。
-        __asm__("cli");
-        if (main_queue->size() == 0)
-        {
-            // FIを1にしたあとすぐにhltに入る。
-            // sti命令と直後の1命令の間では割り込みが起きない仕様を利用するため、
-            // インラインアセンブラで複数命令を並べて実行している。[ref](みかん本180p脚注)
-            __asm__("sti\n\thlt");
-            // __asm__("sti");
-            // __asm__("sti");
-            // SwitchContext(&task_b_ctx, &task_a_ctx);
-            continue;
-        }
-
-        Message msg = main_queue->front();
-        main_queue->pop_front();
-        // sti(Set Interrupt Flag)命令はFIを1にする命令
-        // FIが1のときCPUは外部割り込むを受け入れるようになる。
-        __asm__("sti");
+        // メッセージが届くまで眠る。メッセージを送った割り込みハンドラやタスクが起こす
+        Message msg = main_task.ReceiveMessage();
 
         switch (msg.type)
         {
@@ -271,9 +429,7 @@ extern "C" void KernelMainNewStack(
         case Message::kTimerTimeout:
             if (msg.arg.timer.value == kTextboxCursorTimer)
             {
-                __asm__("cli");
-                timer_manager->AddTimer(Timer{msg.arg.timer.timeout + kTimer05sec, kTextboxCursorTimer});
-                __asm__("sti");
+                timer_manager->AddTimer(Timer{msg.arg.timer.timeout + kTimer05sec, kTextboxCursorTimer, main_task.ID()});
                 textbox_cursor_visible = !textbox_cursor_visible;
                 DrawTextCursor(textbox_cursor_visible);
                 layer_manager->Draw(text_window_layer_id);
@@ -290,6 +446,25 @@ extern "C" void KernelMainNewStack(
             {
                 printk("Wakeup TaskB: %s\n", task_manager->Wakeup(taskb_id).Name());
             }
+            else if (msg.arg.keyboard.ascii == 'm')
+            {
+                // 統計のログはコンソールへの描画に時間がかかるので、イベントループを止めないようワーカに任せる
+                if (auto err = work_queue->Submit([](void *arg)
+                                                  { DumpMemoryStats(kInfo); },
+                                                  nullptr))
+                {
+                    Log(kWarn, "failed to submit DumpMemoryStats: %s\n", err.Name());
+                }
+            }
+            else if (msg.arg.keyboard.ascii == 'l')
+            {
+                if (auto err = work_queue->Submit([](void *arg)
+                                                  { DumpLockStats(kInfo); },
+                                                  nullptr))
+                {
+                    Log(kWarn, "failed to submit DumpLockStats: %s\n", err.Name());
+                }
+            }
             break;
         default:
             Log(kError, "Unknown message type: %d\n", msg.type);
@@ -1,50 +1,116 @@
 #include "memory_manager.hpp"
+
+#include <sys/types.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "asmfunc.h"
 #include "logger.hpp"
 
-BitmapMemoryManager::BitmapMemoryManager()
-    : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}}
+namespace
 {
-}
+    /**
+     * @brief 要約ビットマップbitmapのindexビット目をvalueにする
+     */
+    template <size_t N>
+    void SetSummaryBit(std::array<BitmapMemoryManager::MapLineType, N> &bitmap, size_t index, bool value)
+    {
+        const auto mask = static_cast<BitmapMemoryManager::MapLineType>(1) << (index % BitmapMemoryManager::kBitsPerMapLine);
+        if (value)
+        {
+            bitmap[index / BitmapMemoryManager::kBitsPerMapLine] |= mask;
+        }
+        else
+        {
+            bitmap[index / BitmapMemoryManager::kBitsPerMapLine] &= ~mask;
+        }
+    }
 
-/**
- * @brief FirstFitアルゴリズムでメモリを割り当てる[ref](みかん本203p)
- * 
- * @param num_frames 
- * @return WithError<FrameID> 
- */
-WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames)
-{
-    size_t start_frame_id = range_begin_.ID();
-    while (true)
+    /**
+     * @brief ビットマップbitmapの[begin, end)ビット目をまとめてvalueにする
+     *
+     * 先頭と末尾の要素はビットマスクで書き換え、間の要素はmemsetで一度に埋める。
+     */
+    template <size_t N>
+    void FillBits(std::array<BitmapMemoryManager::MapLineType, N> &bitmap, size_t begin, size_t end, bool value)
     {
-        size_t i = 0;
-        for (; i < num_frames; i++)
+        using MapLineType = BitmapMemoryManager::MapLineType;
+        const auto kBits = BitmapMemoryManager::kBitsPerMapLine;
+        if (begin >= end)
         {
-            if (start_frame_id + 1 >= range_end_.ID())
-            {
-                return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
-            }
+            return;
+        }
 
-            if (GetBit(FrameID{start_frame_id + i}))
-            {
-                // GetBitが真=指定位置（start_frame_id+i）にあるフレームは割り当て済み
-                break;
-            }
+        const auto first_line = begin / kBits;
+        const auto last_line = (end - 1) / kBits;
+        auto head_mask = ~static_cast<MapLineType>(0) << (begin % kBits);
+        const auto tail_mask = ~static_cast<MapLineType>(0) >> (kBits - 1 - (end - 1) % kBits);
+        if (first_line == last_line)
+        {
+            head_mask &= tail_mask;
         }
 
-        if (i == num_frames)
+        auto apply = [value](MapLineType &line, MapLineType mask)
+        {
+            line = value ? (line | mask) : (line & ~mask);
+        };
+        apply(bitmap[first_line], head_mask);
+        if (first_line != last_line)
         {
-            // 上のforループが最後まで回るとここに入る。breakで終わらない場合＝連続した空き領域があった場合
-            // num_frames分の空きが見つかった
-            MarkAllocated(FrameID{start_frame_id}, num_frames);
-            return {
-                FrameID{start_frame_id},
-                MAKE_ERROR(Error::kSuccess)};
+            apply(bitmap[last_line], tail_mask);
+            memset(&bitmap[first_line + 1], value ? 0xff : 0, (last_line - first_line - 1) * sizeof(MapLineType));
         }
+    }
+} // namespace
+
+BitmapMemoryManager::BitmapMemoryManager()
+    : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}}, alloc_hint_{FrameID{0}},
+      free_frames_{kFrameCount}, tagged_frames_{}
+{
+    // alloc_map_は全て0（空き）なので、要約ビットマップは全て1になる
+    line_free_map_.fill(~static_cast<MapLineType>(0));
+    line_empty_map_.fill(~static_cast<MapLineType>(0));
+    group_free_map_.fill(~static_cast<MapLineType>(0));
+    group_empty_map_.fill(~static_cast<MapLineType>(0));
+}
+
+/**
+ * @brief NextFitアルゴリズムでメモリを割り当てる[ref](みかん本203p)
+ *
+ * 探索は前回割り当てた領域の直後（alloc_hint_）から始め、range_end_に達したらrange_begin_に戻って続ける。
+ * 毎回range_begin_から探すFirstFitだと、メモリの前方が埋まるにつれて割当が遅くなるため。
+ *
+ * @param num_frames
+ * @return WithError<FrameID>
+ */
+WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames, MemoryTag tag)
+{
+    const size_t hint = alloc_hint_.ID();
+    auto start_frame = FindFreeFrames(hint, range_end_.ID(), num_frames);
+    if (start_frame.ID() == kNullFrame.ID())
+    {
+        // ヒントより前方を探す。ヒントを跨ぐ空き領域も見つけられるよう終点はnum_frames - 1だけ延ばす
+        start_frame = FindFreeFrames(
+            range_begin_.ID(),
+            std::min(hint + num_frames - 1, range_end_.ID()),
+            num_frames);
+    }
 
-        //次のフレームから再検索
-        start_frame_id += i + 1;
+    if (start_frame.ID() == kNullFrame.ID())
+    {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    MarkAllocated(start_frame, num_frames);
+    tagged_frames_[static_cast<size_t>(tag)] += num_frames;
+    alloc_hint_ = FrameID{start_frame.ID() + num_frames};
+    if (alloc_hint_.ID() >= range_end_.ID())
+    {
+        alloc_hint_ = range_begin_;
     }
+    return {start_frame, MAKE_ERROR(Error::kSuccess)};
 }
 
 /**
@@ -57,85 +123,487 @@ WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames)
  * @param num_frames 
  * @return Error 
  */
-Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames)
+Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames, MemoryTag tag)
 {
-    for (size_t i = 0; i < num_frames; i++)
-    {
-        SetBit(FrameID{start_frame.ID() + i}, false);
-    }
+    SetBits(start_frame.ID(), start_frame.ID() + num_frames, false);
+    tagged_frames_[static_cast<size_t>(tag)] -= num_frames;
     return MAKE_ERROR(Error::kSuccess);
 }
 
 void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames)
 {
-    for (size_t i = 0; i < num_frames; i++)
+    SetBits(start_frame.ID(), start_frame.ID() + num_frames, true);
+}
+
+Error BitmapMemoryManager::AllocateAt(FrameID start_frame, size_t num_frames, MemoryTag tag)
+{
+    if (start_frame.ID() < range_begin_.ID() ||
+        start_frame.ID() + num_frames > range_end_.ID() ||
+        CountFreeFrames(start_frame.ID(), num_frames) < num_frames)
     {
-        SetBit(FrameID{start_frame.ID() + i}, true);
+        return MAKE_ERROR(Error::kAlreadyAllocated);
     }
+    MarkAllocated(start_frame, num_frames);
+    tagged_frames_[static_cast<size_t>(tag)] += num_frames;
+    return MAKE_ERROR(Error::kSuccess);
 }
 
 void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end)
 {
     range_begin_ = range_begin;
     range_end_ = range_end;
+    alloc_hint_ = range_begin;
+    free_frames_ = CountFreeInRange(range_begin.ID(), range_end.ID());
+}
+
+void BitmapMemoryManager::Retag(size_t num_frames, MemoryTag from, MemoryTag to)
+{
+    tagged_frames_[static_cast<size_t>(from)] -= num_frames;
+    tagged_frames_[static_cast<size_t>(to)] += num_frames;
+}
+
+MemoryStats BitmapMemoryManager::Stats() const
+{
+    return {range_end_.ID() - range_begin_.ID(), free_frames_, LargestFreeRun(), tagged_frames_};
+}
+
+/**
+ * @brief [begin, end)の範囲に収まるnum_frames個の連続した空きフレームを探す
+ *
+ * ビットマップを1ビットずつではなくMapLineType単位（kBitsPerMapLineフレーム）で調べる。
+ * 空きフレームの位置はcount-trailing-zerosで求め、空きのないラインは要約ビットマップを使って読み飛ばす。
+ *
+ * 2ライン分以上の要求は必ず全フレームが空きのラインを含むので、そのようなラインを要約ビットマップから探し、
+ * その直前のラインの末尾の空きフレームから数えたものだけを候補にする。
+ *
+ * @return FrameID 見つかった領域の先頭フレーム。見つからなければkNullFrame
+ */
+FrameID BitmapMemoryManager::FindFreeFrames(size_t begin, size_t end, size_t num_frames) const
+{
+    size_t frame = begin;
+    while (frame + num_frames <= end)
+    {
+        size_t start;
+        if (num_frames >= 2 * kBitsPerMapLine)
+        {
+            const auto empty_line = NextEmptyLine((frame + kBitsPerMapLine - 1) / kBitsPerMapLine);
+            if (empty_line >= kLineCount)
+            {
+                return kNullFrame;
+            }
+            // empty_lineの直前のラインの上位側にある空きフレームの数
+            const auto prev_line = empty_line == 0 ? ~static_cast<MapLineType>(0) : alloc_map_[empty_line - 1];
+            const size_t tail_free = prev_line == 0 ? kBitsPerMapLine : __builtin_clzl(prev_line);
+            start = std::max(frame, empty_line * kBitsPerMapLine - tail_free);
+        }
+        else
+        {
+            const auto line_index = frame / kBitsPerMapLine;
+            const auto bit_index = frame % kBitsPerMapLine;
+
+            // frame以降の空きフレームに対応するビットだけを1にしたもの
+            const MapLineType free_bits = ~alloc_map_[line_index] & (~static_cast<MapLineType>(0) << bit_index);
+            if (free_bits == 0)
+            {
+                // このラインには空きがないので次に空きを含むラインの先頭から探す
+                frame = NextFreeLine(line_index + 1) * kBitsPerMapLine;
+                continue;
+            }
+            start = line_index * kBitsPerMapLine + __builtin_ctzl(free_bits);
+        }
+
+        const size_t run = CountFreeFrames(start, num_frames);
+        if (run >= num_frames)
+        {
+            return start + num_frames <= end ? FrameID{start} : kNullFrame;
+        }
+
+        // start + runのフレームは使用中なのでその次から再検索
+        frame = start + run + 1;
+    }
+    return kNullFrame;
 }
 
-bool BitmapMemoryManager::GetBit(FrameID frame) const
+/**
+ * @brief start_frameから連続する空きフレームの数を数える
+ *
+ * limit個以上あると分かった時点で数えるのをやめる。戻り値はlimitを超えることがある。
+ * 全フレームが空きのラインは要約ビットマップを使ってまとめて数える。
+ */
+size_t BitmapMemoryManager::CountFreeFrames(size_t start_frame, size_t limit) const
 {
-    // kBitsPerMapLineを横幅と考え、line_indexは行数、bit_indexは列数の2次元行列と思うとイメージしやすい？
-    auto line_index = frame.ID() / kBitsPerMapLine;
-    auto bit_index = frame.ID() % kBitsPerMapLine;
+    size_t count = 0;
+    auto line_index = start_frame / kBitsPerMapLine;
+    auto bit_index = start_frame % kBitsPerMapLine;
+    while (count < limit && line_index < kLineCount)
+    {
+        if (bit_index == 0)
+        {
+            const auto group = line_index / kBitsPerMapLine;
+            const auto line_in_group = line_index % kBitsPerMapLine;
+            if (line_in_group == 0)
+            {
+                // 全フレームが空きのグループが続く分をまとめて数える
+                const auto empty_groups = group_empty_map_[group / kBitsPerMapLine] >> (group % kBitsPerMapLine);
+                const size_t n = empty_groups == ~static_cast<MapLineType>(0) >> (group % kBitsPerMapLine)
+                                     ? kBitsPerMapLine - group % kBitsPerMapLine
+                                     : __builtin_ctzl(~empty_groups);
+                if (n > 0)
+                {
+                    count += n * kBitsPerMapLine * kBitsPerMapLine;
+                    line_index += n * kBitsPerMapLine;
+                    continue;
+                }
+            }
 
-    return (alloc_map_[line_index] & (static_cast<MapLineType>(1) << bit_index)) != 0;
+            // 全フレームが空きのラインが続く分をまとめて数える
+            const auto empty_lines = line_empty_map_[group] >> line_in_group;
+            const size_t n = empty_lines == ~static_cast<MapLineType>(0) >> line_in_group
+                                 ? kBitsPerMapLine - line_in_group
+                                 : __builtin_ctzl(~empty_lines);
+            if (n > 0)
+            {
+                count += n * kBitsPerMapLine;
+                line_index += n;
+                continue;
+            }
+        }
+
+        // 最下位ビットがstart_frame（2ライン目以降はラインの先頭）に対応するよう右シフトする
+        const MapLineType used_bits = alloc_map_[line_index] >> bit_index;
+        if (used_bits != 0)
+        {
+            return count + __builtin_ctzl(used_bits);
+        }
+        count += kBitsPerMapLine - bit_index;
+        bit_index = 0;
+        ++line_index;
+    }
+    return count;
+}
+
+/**
+ * @brief line_index以降で空きフレームを含む最初のラインを返す。無ければkLineCount
+ */
+size_t BitmapMemoryManager::NextFreeLine(size_t line_index) const
+{
+    if (line_index >= kLineCount)
+    {
+        return kLineCount;
+    }
+
+    auto group = line_index / kBitsPerMapLine;
+    const MapLineType lines = line_free_map_[group] & (~static_cast<MapLineType>(0) << (line_index % kBitsPerMapLine));
+    if (lines != 0)
+    {
+        return group * kBitsPerMapLine + __builtin_ctzl(lines);
+    }
+
+    // 同じグループに無ければ2段目の要約から空きを含むグループを探す
+    for (++group; group < kGroupCount; group = (group / kBitsPerMapLine + 1) * kBitsPerMapLine)
+    {
+        const MapLineType groups = group_free_map_[group / kBitsPerMapLine] & (~static_cast<MapLineType>(0) << (group % kBitsPerMapLine));
+        if (groups != 0)
+        {
+            group = group / kBitsPerMapLine * kBitsPerMapLine + __builtin_ctzl(groups);
+            return group * kBitsPerMapLine + __builtin_ctzl(line_free_map_[group]);
+        }
+    }
+    return kLineCount;
 }
 
-void BitmapMemoryManager::SetBit(FrameID frame, bool allocated)
+/**
+ * @brief line_index以降で全フレームが空きの最初のラインを返す。無ければkLineCount
+ *
+ * 空きを全く含まないグループは2段目の要約を使って読み飛ばす。
+ */
+size_t BitmapMemoryManager::NextEmptyLine(size_t line_index) const
 {
-    auto line_index = frame.ID() / kBitsPerMapLine;
-    auto bit_index = frame.ID() % kBitsPerMapLine;
+    if (line_index >= kLineCount)
+    {
+        return kLineCount;
+    }
 
-    if (allocated)
+    auto group = line_index / kBitsPerMapLine;
+    MapLineType lines = line_empty_map_[group] & (~static_cast<MapLineType>(0) << (line_index % kBitsPerMapLine));
+    while (lines == 0)
     {
-        alloc_map_[line_index] |= (static_cast<MapLineType>(1) << bit_index);
+        if (++group >= kGroupCount)
+        {
+            return kLineCount;
+        }
+        if ((group_free_map_[group / kBitsPerMapLine] >> (group % kBitsPerMapLine)) == 0)
+        {
+            // 2段目の要素内でこれ以降に空きを含むグループが無いので次の要素へ
+            group = (group / kBitsPerMapLine + 1) * kBitsPerMapLine - 1;
+            continue;
+        }
+        lines = line_empty_map_[group];
     }
-    else
+    return group * kBitsPerMapLine + __builtin_ctzl(lines);
+}
+
+/**
+ * @brief フレーム[begin, end)に含まれる空きフレームの数を数える
+ *
+ * 全フレームが空きのグループと、空きを含まないグループは要約ビットマップを見るだけで済ませる。
+ */
+size_t BitmapMemoryManager::CountFreeInRange(size_t begin, size_t end) const
+{
+    const size_t kFramesPerGroup = kBitsPerMapLine * kBitsPerMapLine;
+    size_t count = 0;
+    for (size_t frame = begin; frame < end;)
     {
-        alloc_map_[line_index] &= ~(static_cast<MapLineType>(1) << bit_index);
+        if (frame % kFramesPerGroup == 0 && end - frame >= kFramesPerGroup)
+        {
+            const auto group = frame / kFramesPerGroup;
+            const auto group_bit = static_cast<MapLineType>(1) << (group % kBitsPerMapLine);
+            if (group_empty_map_[group / kBitsPerMapLine] & group_bit)
+            {
+                count += kFramesPerGroup;
+                frame += kFramesPerGroup;
+                continue;
+            }
+            if ((group_free_map_[group / kBitsPerMapLine] & group_bit) == 0)
+            {
+                frame += kFramesPerGroup;
+                continue;
+            }
+        }
+
+        const auto bit_index = frame % kBitsPerMapLine;
+        const auto n = std::min(kBitsPerMapLine - bit_index, end - frame);
+        const auto mask = (n == kBitsPerMapLine ? ~static_cast<MapLineType>(0)
+                                                : (static_cast<MapLineType>(1) << n) - 1)
+                          << bit_index;
+        count += __builtin_popcountl(~alloc_map_[frame / kBitsPerMapLine] & mask);
+        frame += n;
+    }
+    return count;
+}
+
+/**
+ * @brief 管理範囲内で最大の連続した空き領域のフレーム数を返す
+ *
+ * 空き領域の先頭をFindFreeFramesで探し、CountFreeFramesで長さを数えることを繰り返す。
+ * 残りの範囲がそれまでの最大値より短くなったら打ち切る。
+ */
+size_t BitmapMemoryManager::LargestFreeRun() const
+{
+    const size_t end = range_end_.ID();
+    size_t largest = 0;
+    size_t frame = range_begin_.ID();
+    while (frame + largest < end)
+    {
+        const auto start = FindFreeFrames(frame, end, 1);
+        if (start.ID() == kNullFrame.ID())
+        {
+            break;
+        }
+        const auto run = std::min(CountFreeFrames(start.ID(), end - start.ID()), end - start.ID());
+        largest = std::max(largest, run);
+        frame = start.ID() + run + 1;
+    }
+    return largest;
+}
+
+/**
+ * @brief フレーム[begin, end)の使用状態をまとめて設定し、要約ビットマップも更新する
+ *
+ * 1フレームずつ書き換えるのではなく、ラインの途中から始まる先頭と途中で終わる末尾だけビット演算し、
+ * 間のラインは要約ビットマップも含めてmemsetで埋める。
+ */
+void BitmapMemoryManager::SetBits(size_t begin, size_t end, bool allocated)
+{
+    if (begin >= end)
+    {
+        return;
+    }
+
+    // 空きフレーム数は管理範囲内だけを数える。MarkAllocatedは使用中のフレームを含む範囲にも使われるので実際に変わった数を求める
+    const auto count_begin = std::max(begin, range_begin_.ID());
+    const auto count_end = std::min(end, range_end_.ID());
+    if (count_begin < count_end)
+    {
+        const auto free_before = CountFreeInRange(count_begin, count_end);
+        if (allocated)
+        {
+            free_frames_ -= free_before;
+        }
+        else
+        {
+            free_frames_ += (count_end - count_begin) - free_before;
+        }
+    }
+
+    FillBits(alloc_map_, begin, end, allocated);
+
+    // 全フレームが書き換わったラインは要約ビットも一律に決まる
+    const auto first_line = begin / kBitsPerMapLine;
+    const auto last_line = (end - 1) / kBitsPerMapLine;
+    FillBits(line_free_map_, first_line, last_line + 1, !allocated);
+    FillBits(line_empty_map_, first_line, last_line + 1, !allocated);
+
+    // 先頭と末尾のラインは一部だけ書き換わった可能性があるので個別に求め直す
+    for (const auto line_index : {first_line, last_line})
+    {
+        SetSummaryBit(line_free_map_, line_index, alloc_map_[line_index] != ~static_cast<MapLineType>(0));
+        SetSummaryBit(line_empty_map_, line_index, alloc_map_[line_index] == 0);
+    }
+
+    for (auto group = first_line / kBitsPerMapLine; group <= last_line / kBitsPerMapLine; ++group)
+    {
+        SetSummaryBit(group_free_map_, group, line_free_map_[group] != 0);
+        SetSummaryBit(group_empty_map_, group, line_empty_map_[group] == ~static_cast<MapLineType>(0));
     }
 }
 
 extern "C" caddr_t program_break, program_break_end;
 
+MemoryManager *memory_manager;
+SpinLock memory_manager_lock;
+
+WithError<FrameID> AllocateFrames(size_t num_frames, MemoryTag tag)
+{
+    SpinLockGuard guard{memory_manager_lock};
+    return memory_manager->Allocate(num_frames, tag);
+}
+
+Error FreeFrames(FrameID start_frame, size_t num_frames, MemoryTag tag)
+{
+    SpinLockGuard guard{memory_manager_lock};
+    return memory_manager->Free(start_frame, num_frames, tag);
+}
+
 namespace
 {
-    char memory_manager_buf[sizeof(BitmapMemoryManager)];
-    BitmapMemoryManager *memory_manager;
+    char memory_manager_buf[sizeof(MemoryManager)];
+
+    /**
+     * @brief ヒープを伸ばしたり縮めたりする単位（フレーム数）。4MiB
+     *
+     */
+    const size_t kHeapChunkFrames = 1024;
+    const size_t kHeapChunkBytes = kHeapChunkFrames * kBytesPerFrame;
+
+    /**
+     * @brief 現在program_breakがある連続領域の先頭
+     *
+     * 直後のフレームが使用中でヒープを伸ばせなかった場合は別の場所に新しい領域を作るので、
+     * ヒープ全体は連続しているとは限らない。
+     */
+    caddr_t heap_segment_begin;
+
+    size_t HeapChunksFor(size_t bytes)
+    {
+        return (bytes + kHeapChunkBytes - 1) / kHeapChunkBytes;
+    }
+
+    /**
+     * @brief program_breakをincrバイト進められるようにヒープを伸ばす。memory_manager_lockを取って呼ぶ
+     *
+     * まず現在の領域の直後のフレームを確保して連続したまま伸ばす。
+     * それができなければ（まだ領域が無い場合も）新しい領域を確保してprogram_breakをその先頭に移す。
+     * newlibのmallocは不連続な領域を返すsbrkにも対応しているが、前の領域より低いアドレスは扱えないので、
+     * そのような領域しか確保できなかった場合は失敗とする。
+     *
+     * @return int 成功なら0、メモリが足りなければ-1
+     */
+    int GrowProgramBreak(size_t incr)
+    {
+        if (program_break_end)
+        {
+            const size_t lacking = program_break + incr - program_break_end;
+            const size_t extend_frames = HeapChunksFor(lacking) * kHeapChunkFrames;
+            if (!memory_manager->AllocateAt(FrameID{reinterpret_cast<uintptr_t>(program_break_end) / kBytesPerFrame}, extend_frames, MemoryTag::kHeap))
+            {
+                program_break_end += extend_frames * kBytesPerFrame;
+                return 0;
+            }
+        }
+
+        const size_t segment_frames = HeapChunksFor(incr) * kHeapChunkFrames;
+        const auto segment = memory_manager->Allocate(segment_frames, MemoryTag::kHeap);
+        if (segment.error)
+        {
+            return -1;
+        }
+        const auto segment_begin = reinterpret_cast<caddr_t>(segment.value.Frame());
+        if (segment_begin < program_break_end)
+        {
+            memory_manager->Free(segment.value, segment_frames, MemoryTag::kHeap);
+            return -1;
+        }
+
+        if (program_break_end)
+        {
+            // 古い領域のうちprogram_breakより後ろのフレームはもう使われないので返却する
+            const auto used_end = reinterpret_cast<uintptr_t>(program_break + kBytesPerFrame - 1) / kBytesPerFrame;
+            const auto old_end = reinterpret_cast<uintptr_t>(program_break_end) / kBytesPerFrame;
+            memory_manager->Free(FrameID{used_end}, old_end - used_end, MemoryTag::kHeap);
+        }
+
+        heap_segment_begin = segment_begin;
+        program_break = segment_begin;
+        program_break_end = segment_begin + segment_frames * kBytesPerFrame;
+        return 0;
+    }
 
     /**
-     * @brief newlib_support.cのprogram_breakとprogram_break_endを初期化する（みかん本208p）
-     * 
-     * @param memory_manager 
-     * @return Error 
+     * @brief program_breakより後ろに丸ごと空いたチャンクがあればメモリマネージャに返却する。memory_manager_lockを取って呼ぶ
+     *
      */
-    Error InitializeHeap(BitmapMemoryManager &memory_manager)
+    void ShrinkProgramBreak()
     {
-        const int kHeapFrames = 64 * 512;
-        const auto heap_start = memory_manager.Allocate(kHeapFrames);
-        if (heap_start.error)
+        const auto keep_end = heap_segment_begin + HeapChunksFor(program_break - heap_segment_begin) * kHeapChunkBytes;
+        if (keep_end < program_break_end)
         {
-            return heap_start.error;
+            memory_manager->Free(
+                FrameID{reinterpret_cast<uintptr_t>(keep_end) / kBytesPerFrame},
+                (program_break_end - keep_end) / kBytesPerFrame,
+                MemoryTag::kHeap);
+            program_break_end = keep_end;
         }
+    }
+}
 
-        program_break = reinterpret_cast<caddr_t>(heap_start.value.ID() * kBytesPerFrame);
-        program_break_end = program_break + kHeapFrames * kBytesPerFrame;
-        return MAKE_ERROR(Error::kSuccess);
+/**
+ * @brief program_breakをincrバイト動かし、動かす前の値を返す。sbrkから呼ばれる
+ *
+ * mallocはkernel_heap.cppで置き換えてあるのでsbrkを使うのはnewlibの一部だけで、ヒープは最初に呼ばれたときに確保する。
+ * program_breakとprogram_break_endはmemory_manager_lockで守り、他のCPUからの呼び出しやフレームの確保と競合しないようにする。
+ * 伸ばした結果program_breakが別の領域に移ることがある（戻り値は移った先の先頭になる）。
+ * 負のincrで縮めた場合は丸ごと空いたフレームをメモリマネージャに返却する。
+ *
+ * @return caddr_t メモリが足りないか、InitializeMemoryManagerの前なら(caddr_t)-1
+ */
+extern "C" caddr_t MoveProgramBreak(int incr)
+{
+    SpinLockGuard guard{memory_manager_lock};
+    if (memory_manager == nullptr || (program_break == nullptr && incr <= 0))
+    {
+        return reinterpret_cast<caddr_t>(-1);
+    }
+    if (program_break + incr > program_break_end && GrowProgramBreak(incr) != 0)
+    {
+        return reinterpret_cast<caddr_t>(-1);
+    }
+
+    const caddr_t prev_break = program_break;
+    program_break += incr;
+    if (incr < 0)
+    {
+        ShrinkProgramBreak();
     }
+    return prev_break;
 }
 
 void InitializeMemoryManager(const MemoryMap &memory_map)
 {
+    const auto start_tsc = ReadTSC();
     Log(kInfo, "setup memory manager\n");
-    ::memory_manager = new (memory_manager_buf) BitmapMemoryManager;
+    ::memory_manager = new (memory_manager_buf) MemoryManager;
+    RegisterLockStats(memory_manager_lock.Stats(), "memory");
 
     Log(kInfo, "memory_map: %p\n", &memory_map);
     const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
@@ -158,6 +626,14 @@ void InitializeMemoryManager(const MemoryMap &memory_map)
         if (IsAvailable(static_cast<MemoryType>(desc->type)))
         {
             available_end = physical_end;
+            if (IsBootServicesMemory(static_cast<MemoryType>(desc->type)))
+            {
+                // UEFIのページテーブルが置かれている可能性があるので、InitializePagingで
+                // CR3を切り替えるまでは使用中にしておき、ReclaimBootServicesMemoryで解放する
+                memory_manager->AllocateAt(
+                    FrameID{desc->physical_start / kBytesPerFrame},
+                    desc->number_of_pages * kUEFIPageSize / kBytesPerFrame);
+            }
             Log(kInfo, "type = %u, phys = %08lx - %08lx, pages = %lu, attr  = %08lx\n",
                 desc->type,
                 desc->physical_start,
@@ -182,10 +658,181 @@ void InitializeMemoryManager(const MemoryMap &memory_map)
     // 使用中のメモリをマーキングした後、物理メモリの大きさをメモリマネージャに設定する。これ以降メモリマネージャが利用可能。
     memory_manager->SetMemoryRange(FrameID{1}, FrameID{available_end / kBytesPerFrame});
 
-    if (auto err = InitializeHeap(*memory_manager))
+    // この時点ではTSCの周波数が分からないのでサイクル数のまま記録する
+    Log(kInfo, "memory manager initialized in %lu TSC cycles\n", ReadTSC() - start_tsc);
+}
+
+namespace
+{
+    /**
+     * @brief statsの内容を優先度levelでログに出す
+     */
+    void LogMemoryStats(const MemoryStats &stats, LogLevel level)
     {
-        Log(kError, "failed to allocate pages: %s at %s:%d\n",
-            err.Name(), err.File(), err.Line());
-        exit(1);
+        static const char *const tag_names[kMemoryTagCount] = {
+            "untagged",
+            "heap",
+            "usb dma",
+            "page table",
+            "task stack",
+            "zeroed pool",
+        };
+        size_t tagged_total = 0;
+        for (const auto frames : stats.tagged_frames)
+        {
+            tagged_total += frames;
+        }
+
+        Log(level, "memory: total %llu KiB, free %llu KiB, largest free %llu KiB, fragmentation %u.%u%%\n",
+            stats.total_frames * kBytesPerFrame / 1024,
+            stats.free_frames * kBytesPerFrame / 1024,
+            stats.largest_free_frames * kBytesPerFrame / 1024,
+            stats.FragmentationPermille() / 10, stats.FragmentationPermille() % 10);
+        // MarkAllocatedで予約した（UEFIやカーネル自身が使っている）フレームはタグを持たない
+        Log(level, "  reserved: %llu KiB\n",
+            (stats.total_frames - stats.free_frames - tagged_total) * kBytesPerFrame / 1024);
+        for (size_t i = 0; i < kMemoryTagCount; ++i)
+        {
+            Log(level, "  %s: %llu KiB\n", tag_names[i], stats.tagged_frames[i] * kBytesPerFrame / 1024);
+        }
+    }
+} // namespace
+
+void ReclaimBootServicesMemory(const MemoryMap &memory_map)
+{
+    size_t num_frames = 0;
+    const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+    for (uintptr_t iter = memory_map_base;
+         iter < memory_map_base + memory_map.map_size;
+         iter += memory_map.descriptor_size)
+    {
+        auto desc = reinterpret_cast<const MemoryDescriptor *>(iter);
+        if (IsBootServicesMemory(static_cast<MemoryType>(desc->type)))
+        {
+            const auto frames = desc->number_of_pages * kUEFIPageSize / kBytesPerFrame;
+            memory_manager->Free(FrameID{desc->physical_start / kBytesPerFrame}, frames);
+            num_frames += frames;
+        }
     }
+
+    Log(kInfo, "reclaimed %llu KiB of boot services memory\n", num_frames * kBytesPerFrame / 1024);
+    // 起動中で他のCPUはまだ動いていないので、ロックは取らない
+    LogMemoryStats(memory_manager->Stats(), kInfo);
+}
+
+void DumpMemoryStats(LogLevel level)
+{
+    MemoryStats stats;
+    {
+        SpinLockGuard guard{memory_manager_lock};
+        stats = memory_manager->Stats();
+    }
+    LogMemoryStats(stats, level);
+}
+
+namespace
+{
+    /** @brief ゼロクリア済みのフレームの連続した領域 */
+    struct ZeroedRun
+    {
+        size_t first_frame, num_frames;
+    };
+
+    /** @brief プールに補充する1領域のフレーム数。64KiB。ウインドウ1枚分の描画領域が収まる程度 */
+    const size_t kZeroedRunFrames = 16;
+    /** @brief プールが持つ領域の最大数 */
+    const size_t kZeroedPoolCapacity = 32;
+
+    std::array<ZeroedRun, kZeroedPoolCapacity> zeroed_runs;
+    size_t num_zeroed_runs = 0;
+
+    /**
+     * @brief プールからnum_frames個以上の領域を探して先頭num_frames個を取り出す。呼び出し元でmemory_manager_lockを取っておく
+     *
+     * @return FrameID 見つからなければkNullFrame
+     */
+    FrameID TakeZeroedFrames(size_t num_frames)
+    {
+        for (size_t i = 0; i < num_zeroed_runs; ++i)
+        {
+            auto &run = zeroed_runs[i];
+            if (run.num_frames < num_frames)
+            {
+                continue;
+            }
+
+            const FrameID frame{run.first_frame};
+            run.first_frame += num_frames;
+            run.num_frames -= num_frames;
+            if (run.num_frames == 0)
+            {
+                run = zeroed_runs[--num_zeroed_runs];
+            }
+            return frame;
+        }
+        return kNullFrame;
+    }
+} // namespace
+
+WithError<FrameID> AllocateZeroed(size_t num_frames, MemoryTag tag)
+{
+    WithError<FrameID> frame{kNullFrame, MAKE_ERROR(Error::kSuccess)};
+    {
+        SpinLockGuard guard{memory_manager_lock};
+        frame.value = TakeZeroedFrames(num_frames);
+        if (frame.value.ID() != kNullFrame.ID())
+        {
+            memory_manager->Retag(num_frames, MemoryTag::kZeroedPool, tag);
+            return frame;
+        }
+        frame = memory_manager->Allocate(num_frames, tag);
+    }
+    if (frame.error)
+    {
+        return frame;
+    }
+
+    memset(frame.value.Frame(), 0, num_frames * kBytesPerFrame);
+    return frame;
+}
+
+bool RefillZeroedFramePool()
+{
+    if (memory_manager == nullptr)
+    {
+        return false;
+    }
+
+    FrameID frame{kNullFrame};
+    {
+        SpinLockGuard guard{memory_manager_lock};
+        if (num_zeroed_runs >= kZeroedPoolCapacity)
+        {
+            return false;
+        }
+        const auto run = memory_manager->Allocate(kZeroedRunFrames, MemoryTag::kZeroedPool);
+        if (run.error)
+        {
+            return false;
+        }
+        frame = run.value;
+    }
+
+    // クリア中は割り込みを許可しておき、他のタスクへの切り替えを遅らせない
+    memset(frame.Frame(), 0, kZeroedRunFrames * kBytesPerFrame);
+
+    SpinLockGuard guard{memory_manager_lock};
+    if (num_zeroed_runs >= kZeroedPoolCapacity)
+    {
+        // クリアしている間に別のタスクがプールを満たした
+        memory_manager->Free(frame, kZeroedRunFrames, MemoryTag::kZeroedPool);
+        return false;
+    }
+    zeroed_runs[num_zeroed_runs++] = {frame.ID(), kZeroedRunFrames};
+    return true;
+}
+
+void FrameDeleter::operator()(void *p) const
+{
+    FreeFrames(FrameID{reinterpret_cast<uintptr_t>(p) / kBytesPerFrame}, num_frames, tag);
 }
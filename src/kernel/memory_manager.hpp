@@ -10,7 +10,9 @@
 #include <limits>
 
 #include "error.hpp"
+#include "logger.hpp"
 #include "memory_map.hpp"
+#include "spinlock.hpp"
 
 namespace
 {
@@ -53,6 +55,53 @@ private:
 
 static const FrameID kNullFrame{std::numeric_limits<size_t>::max()};
 
+/**
+ * @brief フレームを確保した用途。統計情報の内訳に使う
+ *
+ * 確保時と解放時に同じタグを渡す。タグ無しで確保したものはkUntaggedに数える。
+ *
+ */
+enum class MemoryTag
+{
+    kUntagged,
+    kHeap,
+    kUSBDMA,
+    kPageTable,
+    kTaskStack,
+    /** @brief AllocateZeroed用にゼロクリアして取ってあるフレーム */
+    kZeroedPool,
+};
+
+static const size_t kMemoryTagCount{static_cast<size_t>(MemoryTag::kZeroedPool) + 1};
+
+/**
+ * @brief メモリマネージャの統計情報
+ *
+ */
+struct MemoryStats
+{
+    /** @brief 管理対象のフレーム数（SetMemoryRangeで設定した範囲） */
+    size_t total_frames;
+    /** @brief 空きフレーム数 */
+    size_t free_frames;
+    /** @brief 1回のAllocateで確保できる最大のフレーム数 */
+    size_t largest_free_frames;
+    /** @brief 用途ごとの使用中フレーム数。MarkAllocatedで予約したフレームは含まない */
+    std::array<size_t, kMemoryTagCount> tagged_frames;
+
+    /**
+     * @brief 断片化指数（千分率）
+     *
+     * 空きフレームのうち最大の空き領域に含まれないものの割合。
+     * 0なら空きフレームは1つの領域にまとまっており、1000に近いほど細かく分かれている。
+     *
+     */
+    unsigned int FragmentationPermille() const
+    {
+        return free_frames == 0 ? 0 : 1000 - largest_free_frames * 1000 / free_frames;
+    }
+};
+
 /**
  * @brief ビットマップ配列を用いてフレーム単位でメモリ管理するクラス
  * 
@@ -60,6 +109,11 @@ static const FrameID kNullFrame{std::numeric_limits<size_t>::max()};
  * 配列allocate_mapの各ビットがフレームに対応し、0なら空き、1なら使用中
  * alloc_map[n]のmビット目が対応する物理アドレスは以下の式でも止まる。
  *   kFrameBytes * (n * kBitPerMapLine + m);
+ *
+ * 大きな空き領域を速く見つけるため、alloc_map_の上に2段の要約ビットマップを持つ。
+ * - 1段目: alloc_map_の1ライン（kBitsPerMapLineフレーム）につき1ビット
+ * - 2段目: 1段目の1要素（kBitsPerMapLineライン）につき1ビット
+ * それぞれ「空きフレームを含む」と「全フレームが空き」の2種類がある。
  * 
  */
 class BitmapMemoryManager
@@ -89,6 +143,18 @@ public:
      */
     static const size_t kBitsPerMapLine{8 * sizeof(MapLineType)};
 
+    /**
+     * @brief ビットマップ配列の要素数
+     * 
+     */
+    static const size_t kLineCount{kFrameCount / kBitsPerMapLine};
+
+    /**
+     * @brief 1段目の要約ビットマップの要素数（＝2段目の要約ビットマップのビット数）
+     * 
+     */
+    static const size_t kGroupCount{kLineCount / kBitsPerMapLine};
+
     /**
      * @brief Construct a new Bitmap Memory Manager object
      * 
@@ -97,14 +163,27 @@ public:
 
     /**
      * @brief 要求したフレーム数の領域を確保して先頭のフレームIDを返す
+     *
+     * 前回確保した領域の直後から探索するNextFit方式。
      * 
      * @param num_frames 
      * @return WithError<FrameID> 
      */
-    WithError<FrameID> Allocate(size_t num_frames);
-    Error Free(FrameID static_frame, size_t num_frames);
+    WithError<FrameID> Allocate(size_t num_frames, MemoryTag tag = MemoryTag::kUntagged);
+    Error Free(FrameID static_frame, size_t num_frames, MemoryTag tag = MemoryTag::kUntagged);
     void MarkAllocated(FrameID start_frame, size_t num_frames);
 
+    /**
+     * @brief start_frameから始まるnum_frames個のフレームを確保する
+     *
+     * 1つでも使用中（またはメモリ範囲外）のフレームが含まれていればkAlreadyAllocatedを返し、何もしない。
+     * 
+     * @param start_frame 
+     * @param num_frames 
+     * @return Error 
+     */
+    Error AllocateAt(FrameID start_frame, size_t num_frames, MemoryTag tag = MemoryTag::kUntagged);
+
     /**
      * @brief Set the Memory Range object
      * この呼出以降Allocateによるメモリ割り当ては設定された範囲内でのみ行われる。
@@ -114,8 +193,37 @@ public:
      */
     void SetMemoryRange(FrameID range_begin, FrameID rane_end);
 
+    /**
+     * @brief 使用中のnum_frames個のフレームの用途をfromからtoに付け替える（統計情報だけが変わる）
+     * 
+     * @param num_frames 
+     * @param from 
+     * @param to 
+     */
+    void Retag(size_t num_frames, MemoryTag from, MemoryTag to);
+
+    /**
+     * @brief 統計情報を返す
+     *
+     * 空きフレーム数とタグごとのフレーム数は割当・解放のたびに更新してあるので読むだけ。
+     * 最大の空き領域はビットマップを空き領域単位で走査して求める。
+     * 
+     * @return MemoryStats 
+     */
+    MemoryStats Stats() const;
+
 private:
-    std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
+    std::array<MapLineType, kLineCount> alloc_map_;
+
+    /** @brief 1段目の要約: ラインnが空きフレームを含むならnビット目が1 */
+    std::array<MapLineType, kGroupCount> line_free_map_;
+    /** @brief 1段目の要約: ラインnの全フレームが空きならnビット目が1 */
+    std::array<MapLineType, kGroupCount> line_empty_map_;
+    /** @brief 2段目の要約: line_free_map_[g]が0でないならgビット目が1 */
+    std::array<MapLineType, kGroupCount / kBitsPerMapLine> group_free_map_;
+    /** @brief 2段目の要約: line_empty_map_[g]の全ビットが1ならgビット目が1 */
+    std::array<MapLineType, kGroupCount / kBitsPerMapLine> group_empty_map_;
+
     /**
      * @brief このメモリマネージャで扱うメモリ範囲の始点
      * 
@@ -126,9 +234,295 @@ private:
      * 
      */
     FrameID range_end_;
+    /**
+     * @brief 次のAllocateで探索を始めるフレーム（前回割り当てた領域の直後）
+     *
+     */
+    FrameID alloc_hint_;
+    /** @brief 管理範囲内の空きフレーム数 */
+    size_t free_frames_;
+    /** @brief 用途ごとの使用中フレーム数 */
+    std::array<size_t, kMemoryTagCount> tagged_frames_;
 
-    bool GetBit(FrameID frame) const;
-    void SetBit(FrameID frame, bool allocated);
+    FrameID FindFreeFrames(size_t begin, size_t end, size_t num_frames) const;
+    size_t CountFreeFrames(size_t start_frame, size_t limit) const;
+    size_t NextFreeLine(size_t line_index) const;
+    size_t NextEmptyLine(size_t line_index) const;
+    size_t CountFreeInRange(size_t begin, size_t end) const;
+    size_t LargestFreeRun() const;
+    void SetBits(size_t begin, size_t end, bool allocated);
 };
 
+/**
+ * @brief バディアロケータでフレーム単位のメモリ管理をするクラス
+ *
+ * 2のべき乗個（2^order個）のフレームからなり、先頭が同じ大きさに揃ったブロックを単位に管理する。
+ * 割当時は要求を満たす最小の次数のブロックを大きなブロックから分割して作り、
+ * 解放時は隣のブロック（バディ）も空いていれば結合して1つ上の次数に戻す。
+ * そのため割当・解放はO(log n)で済み、2MiBや1GiBに揃った大きなブロックが断片化しにくい。
+ *
+ * 次数ごとに空きブロックのビットマップを持つ。
+ * 次数orderのビットマップのiビット目が1なら、フレーム[i * 2^order, (i + 1) * 2^order)が1つの空きブロック。
+ * 空きブロックの情報をフレーム自体には書き込まないので、ページングの設定に依存しない。
+ *
+ * 空きブロックを速く見つけるため、次数ごとのビットマップの上にkSummaryLevels段の要約ビットマップを持つ。
+ * 1段目のnビット目はビットマップのラインnが0でない（空きブロックを含む）ことを表し、
+ * k + 1段目のnビット目はk段目の要素nが0でないことを表す。最上段は高々2要素なので、上から辿れば定数回で見つかる。
+ *
+ * Allocate/Free/MarkAllocated/SetMemoryRangeの使い方はBitmapMemoryManagerと同じ。
+ * Freeには確保時と同じフレーム数を渡す。2のべき乗に切り上げた余りは確保時に返却済み。
+ * SetMemoryRangeの範囲外のフレームをFreeしても空きにはならない。
+ *
+ */
+class BuddyMemoryManager
+{
+public:
+    /**
+     * @brief このメモリ管理クラスで扱える最大の物理メモリ量（バイト）
+     * 
+     */
+    static const auto kMaxPhysicalMemoryBytes{128_GiB};
+
+    /**
+     * @brief kMaxPhysicalMemoryBytesまでの物理メモリを扱うために必要なフレーム数
+     * 
+     */
+    static const auto kFrameCount{kMaxPhysicalMemoryBytes / kBytesPerFrame};
+
+    /**
+     * @brief ブロックの最大次数。2^18フレーム = 1GiB
+     * 
+     */
+    static const int kMaxOrder{18};
+
+    /**
+     * @brief ビットマップ配列の要素型
+     * 
+     */
+    using MapLineType = unsigned long;
+
+    /**
+     * @brief ビットマップ配列の一つの要素のビット数==ブロック数
+     * 
+     */
+    static const size_t kBitsPerMapLine{8 * sizeof(MapLineType)};
+
+    /**
+     * @brief Construct a new Buddy Memory Manager object
+     *
+     * 初期状態では全フレームが空き。
+     * 
+     */
+    BuddyMemoryManager();
+
+    /**
+     * @brief 要求したフレーム数の領域を確保して先頭のフレームIDを返す
+     *
+     * 先頭は要求したフレーム数以上の最小の2のべき乗に揃う。
+     * 
+     * @param num_frames 
+     * @return WithError<FrameID> 
+     */
+    WithError<FrameID> Allocate(size_t num_frames, MemoryTag tag = MemoryTag::kUntagged);
+    Error Free(FrameID start_frame, size_t num_frames, MemoryTag tag = MemoryTag::kUntagged);
+    void MarkAllocated(FrameID start_frame, size_t num_frames);
+
+    /**
+     * @brief start_frameから始まるnum_frames個のフレームを確保する
+     *
+     * 1つでも使用中（またはメモリ範囲外）のフレームが含まれていればkAlreadyAllocatedを返し、何もしない。
+     * 
+     * @param start_frame 
+     * @param num_frames 
+     * @return Error 
+     */
+    Error AllocateAt(FrameID start_frame, size_t num_frames, MemoryTag tag = MemoryTag::kUntagged);
+
+    /**
+     * @brief Set the Memory Range object
+     * この呼出以降Allocateによるメモリ割り当ては設定された範囲内でのみ行われる。
+     * 
+     * @param range_begin 
+     * @param range_end 
+     */
+    void SetMemoryRange(FrameID range_begin, FrameID range_end);
+
+    /**
+     * @brief 使用中のnum_frames個のフレームの用途をfromからtoに付け替える（統計情報だけが変わる）
+     * 
+     * @param num_frames 
+     * @param from 
+     * @param to 
+     */
+    void Retag(size_t num_frames, MemoryTag from, MemoryTag to);
+
+    /**
+     * @brief 統計情報を返す
+     *
+     * 割当は2のべき乗に揃ったブロック単位なので、最大の空き領域は最大の空きブロックの大きさとする
+     * （最大次数のブロックが連続していればその合計）。
+     * 
+     * @return MemoryStats 
+     */
+    MemoryStats Stats() const;
+
+private:
+    /** @brief 次数orderのビットマップのライン数 */
+    static constexpr size_t LinesAt(int order)
+    {
+        return (kFrameCount >> order) / kBitsPerMapLine;
+    }
+
+    /** @brief free_map_の中で次数orderのビットマップが始まる位置 */
+    static constexpr size_t MapOffset(int order)
+    {
+        return order == 0 ? 0 : MapOffset(order - 1) + LinesAt(order - 1);
+    }
+
+    /** @brief 全次数のビットマップのライン数の合計（次数が1つ上がるごとに半分になる等比数列の和） */
+    static const size_t kMapLineCount{2 * (kFrameCount / kBitsPerMapLine) - (kFrameCount >> kMaxOrder) / kBitsPerMapLine};
+
+    /** @brief 要約ビットマップの段数 */
+    static const int kSummaryLevels{3};
+
+    /** @brief 次数orderの要約ビットマップのlevel段目の要素数。0段目はビットマップ自体 */
+    static constexpr size_t SummaryLinesAt(int order, int level)
+    {
+        return level == 0 ? LinesAt(order)
+                          : (SummaryLinesAt(order, level - 1) + kBitsPerMapLine - 1) / kBitsPerMapLine;
+    }
+
+    /** @brief summary_map_の中で次数orderの要約ビットマップのlevel段目（1以上）が始まる位置 */
+    static constexpr size_t SummaryOffset(int order, int level)
+    {
+        return level > 1    ? SummaryOffset(order, level - 1) + SummaryLinesAt(order, level - 1)
+               : order == 0 ? 0
+                            : SummaryOffset(order - 1, kSummaryLevels) + SummaryLinesAt(order - 1, kSummaryLevels);
+    }
+
+    /**
+     * @brief 全次数の要約ビットマップの要素数の上限
+     *
+     * 段が1つ上がるごとに1/kBitsPerMapLineになる等比数列の和に、各段の切り上げの分を足したもの。
+     */
+    static const size_t kSummaryLineCount{kMapLineCount / (kBitsPerMapLine - 1) + kSummaryLevels * (kMaxOrder + 1)};
+
+    /** @brief SummaryOffsetの表。要素[order * kSummaryLevels + level - 1] */
+    static const std::array<size_t, (kMaxOrder + 1) * kSummaryLevels> kSummaryOffsets;
+
+    /** @brief 全次数のビットマップを次数の小さい順に連結したもの */
+    std::array<MapLineType, kMapLineCount> free_map_;
+    /** @brief 全次数の要約ビットマップを次数の小さい順、段の低い順に連結したもの */
+    std::array<MapLineType, kSummaryLineCount> summary_map_;
+    /** @brief 次数ごとの空きブロック数 */
+    std::array<size_t, kMaxOrder + 1> free_count_;
+
+    FrameID range_begin_;
+    FrameID range_end_;
+    /** @brief 用途ごとの使用中フレーム数 */
+    std::array<size_t, kMemoryTagCount> tagged_frames_;
+
+    bool IsFreeBlock(int order, size_t index) const;
+    void SetFreeBlock(int order, size_t index, bool free);
+    void UpdateSummary(int order, size_t line);
+    size_t FirstFreeLine(int order) const;
+    size_t NextMaxOrderBlock(size_t index, bool free) const;
+    size_t TakeFreeBlock(int order);
+    WithError<FrameID> AllocateLarge(size_t num_frames);
+    void FreeBlock(size_t index, int order);
+    void FreeRange(size_t begin, size_t end);
+    void RemoveRange(size_t begin, size_t end);
+};
+
+/**
+ * @brief カーネルが使う物理メモリ管理クラス
+ *
+ * コンパイル時にMEMORY_MANAGER_BUDDYを定義するとBuddyMemoryManagerになる（MakefileのMEMORY_MANAGER変数）
+ *
+ */
+#ifdef MEMORY_MANAGER_BUDDY
+using MemoryManager = BuddyMemoryManager;
+#else
+using MemoryManager = BitmapMemoryManager;
+#endif
+
+extern MemoryManager *memory_manager;
+
+/**
+ * @brief memory_managerとカーネルヒープ（kernel_heap.cpp）を守るロック
+ *
+ * memory_managerのメンバ関数は自分ではロックしないので、直接呼ぶ場合はSpinLockGuardで取っておく。
+ * ヒープはフレームを確保しながら空きリストを書き換えるので、同じロックで守る。
+ */
+extern SpinLock memory_manager_lock;
+
+/**
+ * @brief memory_manager_lockを取ってmemory_manager->Allocateを呼ぶ
+ */
+WithError<FrameID> AllocateFrames(size_t num_frames, MemoryTag tag);
+
+/**
+ * @brief memory_manager_lockを取ってmemory_manager->Freeを呼ぶ
+ */
+Error FreeFrames(FrameID start_frame, size_t num_frames, MemoryTag tag);
+
+/**
+ * @brief memory_managerを作り、UEFIのメモリマップから空きフレームを登録する
+ *
+ * UEFIのブートサービス用の領域はこの時点では使用中のまま残す。
+ * 
+ * @param memory_map 
+ */
 void InitializeMemoryManager(const MemoryMap &memory_map);
+
+/**
+ * @brief UEFIのブートサービス用の領域を解放して使えるようにする
+ *
+ * UEFIが用意したページテーブルを使わなくなった後（InitializePagingの後）に呼ぶ。
+ * 
+ * @param memory_map 
+ */
+void ReclaimBootServicesMemory(const MemoryMap &memory_map);
+
+/**
+ * @brief memory_managerの統計情報を優先度levelでログに出す
+ * 
+ * @param level 
+ */
+void DumpMemoryStats(LogLevel level);
+
+/**
+ * @brief 全バイトが0のnum_frames個の連続したフレームを確保する
+ *
+ * アイドル時にゼロクリアしておいたフレームのプールから優先して取り出すので、その場合はクリアの時間がかからない。
+ * プールに十分な大きさの領域が無ければmemory_managerから確保してその場でクリアする。
+ * 割り込みハンドラ以外のどのタスクから呼んでもよい。解放はFreeFramesで行う。
+ * 
+ * @param num_frames 
+ * @param tag 
+ * @return WithError<FrameID> 
+ */
+WithError<FrameID> AllocateZeroed(size_t num_frames, MemoryTag tag = MemoryTag::kUntagged);
+
+/**
+ * @brief ゼロクリアしたフレームのプールを1領域分補充する
+ *
+ * 1回の呼び出しでクリアするのは一定量だけで、クリア中は割り込みを禁止しない。
+ * CPUが暇なときにアイドルタスクから繰り返し呼ぶ。
+ * 
+ * @return true 補充した
+ * @return false プールが満杯か、メモリが足りず補充できなかった
+ */
+bool RefillZeroedFramePool();
+
+/**
+ * @brief フレーム単位で確保した領域をstd::unique_ptrで持つための削除子
+ *
+ */
+struct FrameDeleter
+{
+    size_t num_frames;
+    MemoryTag tag;
+
+    void operator()(void *p) const;
+};
@@ -68,6 +68,19 @@ inline bool IsAvailable(MemoryType memory_type)
            memory_type == MemoryType::kEfiConventionalMemory;
 }
 
+/**
+ * @brief UEFIのブートサービスが使っていた領域か判定する
+ * ExitBootServicesの後は空き領域だが、UEFIが用意したページテーブルなどが置かれている
+ * 
+ * @param memory_type 
+ * @return true ：ブートサービスの領域
+ */
+inline bool IsBootServicesMemory(MemoryType memory_type)
+{
+    return memory_type == MemoryType::kEfiBootServicesCode ||
+           memory_type == MemoryType::kEfiBootServicesData;
+}
+
 const int kUEFIPageSize = 4096;
 
 #endif
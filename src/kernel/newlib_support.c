@@ -9,26 +9,27 @@ void _exit(void)
 
 caddr_t program_break, program_break_end;
 
+// memory_manager.cppで定義。memory_manager_lockを取ってprogram_breakを動かし、足りないフレームをメモリマネージャとやり取りする
+caddr_t MoveProgramBreak(int incr);
+
 /**
  * @brief mallocが依存する関数。プログラムブレークを設定する関数。
  * プログラムブレーク: Unixシステムの各プロセスが使えるメモリ領域の末尾を示すアドレス。
  * [ref](みかん本の206p)
+ *
+ * 動かし方はMoveProgramBreak（memory_manager.cpp）を参照。
  * 
  * @param incr バイト
  * @return caddr_t 
  */
 caddr_t sbrk(int incr)
 {
-    if (program_break == 0 || program_break + incr >= program_break_end)
+    caddr_t prev_break = MoveProgramBreak(incr);
+    if (prev_break == (caddr_t)-1)
     {
-        // program_breakが初期化されていない場合
-        // Program breakをIncrバイトだけを動かした際にメモリが足りない場合
+        // メモリマネージャの初期化前か、Program breakをIncrバイトだけを動かした際にメモリが足りない場合
         errno = ENOMEM;
-        return (caddr_t)-1;
     }
-
-    caddr_t prev_break = program_break;
-    program_break += incr;
     return prev_break;
 }
 
@@ -1,8 +1,16 @@
 #include "paging.hpp"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cstdlib>
 
 #include "asmfunc.h"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
 
 namespace
 {
@@ -10,12 +18,682 @@ namespace
     const uint64_t kPageSize2M = 512 * kPageSize4K;
     const uint64_t kPageSize1G = 512 * kPageSize2M;
 
-    alignas(kPageSize4K) std::array<uint64_t, 512> pml4_table;
-    alignas(kPageSize4K) std::array<uint64_t, 512> pdp_table;
-    alignas(kPageSize4K) std::array<std::array<uint64_t, 512>, kPageDirectoryCount> page_directory;
+    /** @brief 要素のうち物理アドレスを表すビット */
+    const uint64_t kAddressMask = 0x000ffffffffff000;
+    /** @brief 大きなページを指す要素のPATビット */
+    const uint64_t kLargePagePAT = 1ull << 12;
+
+    /**
+     * @brief まとめてinvlpgする最大のページ数。これを超えたらCR3を設定し直してTLB全体を捨てる
+     *
+     * invlpgは1回あたり数百サイクルかかるので、多くのページを書き換えた後は全体を捨てた方が速い。
+     */
+    const size_t kTLBFlushThreshold = 32;
+
+    alignas(kPageSize4K) std::array<PageMapEntry, 512> pml4_table;
+
+    /** @brief IA32_PAT MSRのアドレス */
+    const uint32_t kIA32PAT = 0x277;
+    /** @brief PATのメモリタイプの値 */
+    const uint64_t kPATWriteCombining = 0x01;
+    /** @brief Write Combiningに使うPATのエントリ。WriteCombiningAttributeと対応する */
+    const int kPATWriteCombiningIndex = 4;
+
+    /** @brief PATを使えるか。InitializePATで設定する */
+    bool pat_supported = false;
+
+    /** @brief 1GiBページを使えるか。SetupIdentityPageTableで設定する */
+    bool use_1gib_pages = false;
+
+    /**
+     * @brief ページテーブルの書き換えと、TLBの無効化を待っているページの記録を守る
+     *
+     * 写像を変えたCPUがロックを持ったままFlushPendingで自分のTLBを無効化する。
+     */
+    SpinLock paging_lock;
+
+    /** @brief TLBの無効化を待っているページ */
+    std::array<uint64_t, kTLBFlushThreshold> pending_invalidations;
+    size_t num_pending_invalidations = 0;
+    bool pending_full_flush = false;
+    /** @brief 全てのPCIDのTLBを捨てる必要があるか */
+    bool pending_all_contexts_flush = false;
+    /** @brief 共有する前半の写像を変えたので、他のCPUのTLBも捨てさせる必要があるか */
+    bool pending_remote_flush = false;
+
+    /** @brief 他のCPUにTLBの無効化を頼んだ回数。頼むCPUはpaging_lockを持って増やす */
+    std::atomic<uint64_t> tlb_flush_generation{0};
+    /** @brief CPUごとに、tlb_flush_generationのどの値までの無効化を済ませたか */
+    std::array<std::atomic<uint64_t>, kMaxCPUs> tlb_flush_acks{};
+
+    const uint64_t kCR4PGE = 1ull << 7;
+    const uint64_t kCR4PCIDE = 1ull << 17;
+    /** @brief CR3に書き込むときに立てると、そのPCIDのTLBを捨てずに残す */
+    const uint64_t kCR3NoFlush = 1ull << 63;
+    const size_t kNumPCIDs = 4096;
+
+    /** @brief PCIDを使えるか。InitializePCIDで設定する */
+    bool pcid_enabled = false;
+
+    /**
+     * @brief CPUごと、PCIDごとに、TLBに残っている要素がどのアドレス空間のものか
+     *
+     * PCIDはPML4テーブルのフレーム番号から決めるので、複数のアドレス空間が同じPCIDになることがある。
+     * 持ち主と違うアドレス空間に切り替えるときと、後半の写像を変えた後に（変えたCPU以外で）切り替えるときはTLBを捨てる。
+     * PCID 0はカーネルのPML4テーブルに割り当てる。TLBはCPUごとにあるので、持ち主もCPUごとに覚える。
+     */
+    std::array<std::array<PageMapEntry *, kNumPCIDs>, kMaxCPUs> pcid_owners{};
+
+    /**
+     * @brief CPUが1GiBページに対応しているか（CPUID.80000001H:EDXのbit26 pdpe1gb）
+     */
+    bool Supports1GiBPages()
+    {
+        uint32_t eax, ebx, ecx, edx;
+        CPUID(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+        if (eax < 0x80000001)
+        {
+            return false;
+        }
+        CPUID(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        return (edx >> 26) & 1;
+    }
+
+    /**
+     * @brief CPUがPATに対応しているか（CPUID.01H:EDXのbit16）
+     */
+    bool SupportsPAT()
+    {
+        uint32_t eax, ebx, ecx, edx;
+        CPUID(1, 0, &eax, &ebx, &ecx, &edx);
+        return (edx >> 16) & 1;
+    }
+
+    /**
+     * @brief 実行中のCPUのPATのエントリ4をWrite Combiningにする。全てのCPUで同じ設定にしておく
+     */
+    void ProgramPAT()
+    {
+        const int shift = 8 * kPATWriteCombiningIndex;
+        auto pat = ReadMSR(kIA32PAT);
+        pat = (pat & ~(0xffull << shift)) | (kPATWriteCombining << shift);
+        WriteMSR(kIA32PAT, pat);
+    }
+
+    /**
+     * @brief PATのエントリ4をWrite Combiningにする
+     *
+     * 電源投入時のPATはエントリ0から順にWB, WT, UC-, UC, WB, WT, UC-, UCで、エントリ0〜3は
+     * patビットを立てない既存の写像が使っている。patビットを立てた写像はまだ無いので、エントリ4を書き換えてよい。
+     */
+    void InitializePAT()
+    {
+        pat_supported = SupportsPAT();
+        if (!pat_supported)
+        {
+            Log(kWarn, "PAT is not supported\n");
+            return;
+        }
+        ProgramPAT();
+    }
+
+    /**
+     * @brief CPUが対応していればCR4.PCIDEを立ててPCIDを有効にする（CPUID.01H:ECXのbit17）
+     *
+     * CR3のPCID（下位12ビット）が0でないと有効にできないので、カーネルのPML4テーブルをCR3に設定した直後に呼ぶ。
+     */
+    void InitializePCID()
+    {
+        uint32_t eax, ebx, ecx, edx;
+        CPUID(1, 0, &eax, &ebx, &ecx, &edx);
+        if (((ecx >> 17) & 1) == 0)
+        {
+            Log(kInfo, "PCID is not supported\n");
+            return;
+        }
+
+        SetCR4(GetCR4() | kCR4PCIDE);
+        pcid_owners[0][0] = pml4_table.data();
+        pcid_enabled = true;
+    }
+
+    uint64_t PCIDOf(PageMapEntry *pml4)
+    {
+        if (pml4 == pml4_table.data())
+        {
+            return 0;
+        }
+        return 1 + reinterpret_cast<uint64_t>(pml4) / kPageSize4K % (kNumPCIDs - 1);
+    }
+
+    /**
+     * @brief 次にexcept_cpu以外のどのCPUでpml4へ切り替えるときも、そのPCIDのTLBを捨てさせる
+     *
+     * @param except_cpu TLBを別に無効化するCPU。-1なら全てのCPUで捨てさせる
+     */
+    void ForgetPCID(PageMapEntry *pml4, int except_cpu = -1)
+    {
+        const auto pcid = PCIDOf(pml4);
+        for (int cpu = 0; cpu < kMaxCPUs; ++cpu)
+        {
+            auto &owner = pcid_owners[cpu][pcid];
+            if (cpu != except_cpu && owner == pml4)
+            {
+                owner = nullptr;
+            }
+        }
+    }
+
+    /**
+     * @brief フレームバッファの終端のアドレスを返す
+     */
+    uint64_t FrameBufferEnd(const FrameBufferConfig &config)
+    {
+        // 1ピクセルは4バイト（frame_buffer.cppのBytesPerPixel）
+        return reinterpret_cast<uint64_t>(config.frame_buffer) +
+               4ull * config.pixels_per_scan_line * config.vertical_resolution;
+    }
+
+    /** @brief level段目のテーブルの1要素が表す範囲の大きさ */
+    uint64_t BytesAt(int level)
+    {
+        return kPageSize4K << (9 * (level - 1));
+    }
+
+    int LevelOf(PageSize size)
+    {
+        switch (size)
+        {
+        case PageSize::k4KiB:
+            return 1;
+        case PageSize::k2MiB:
+            return 2;
+        case PageSize::k1GiB:
+            return 3;
+        }
+        return 1;
+    }
+
+    /**
+     * @brief pml4のvirtを含むページの写像を変えたので、TLBを後で無効化するよう記録する
+     */
+    void InvalidateLater(PageMapEntry *pml4, uint64_t virt)
+    {
+        const bool shared = virt < kPrivateSpaceBase;
+        if (shared)
+        {
+            // 共有する前半の写像は他のCPUのTLBにも残っている
+            pending_remote_flush = true;
+        }
+        if (shared && pcid_enabled)
+        {
+            // 共有する前半の写像は他のPCIDのTLBにも残っている
+            pending_all_contexts_flush = true;
+            return;
+        }
+        if (!shared && pcid_enabled)
+        {
+            // タスクは他のCPUへ移るので、以前実行したCPUにもこのPCIDのTLBが残っている。
+            // そのCPUへ戻ったときにTLBを捨てさせ、現在のアドレス空間なら実行中のCPUの分はinvlpgで無効化する
+            const bool current = (GetCR3() & kAddressMask) == reinterpret_cast<uint64_t>(pml4);
+            ForgetPCID(pml4, current ? CurrentCPU() : -1);
+            if (!current)
+            {
+                return;
+            }
+        }
+        else if (!shared && (GetCR3() & kAddressMask) != reinterpret_cast<uint64_t>(pml4))
+        {
+            // 現在でないアドレス空間のTLBは、PCIDが無ければ切り替え時にCR3の書き込みで捨てられる
+            return;
+        }
+        if (num_pending_invalidations < kTLBFlushThreshold)
+        {
+            pending_invalidations[num_pending_invalidations++] = virt;
+        }
+        else
+        {
+            pending_full_flush = true;
+        }
+    }
+
+    PageMapEntry *NewPageMap()
+    {
+        const auto frame = AllocateZeroed(1, MemoryTag::kPageTable);
+        if (frame.error)
+        {
+            return nullptr;
+        }
+        return reinterpret_cast<PageMapEntry *>(frame.value.Frame());
+    }
+
+    void FreePageMap(PageMapEntry *table)
+    {
+        FreeFrames(FrameID{reinterpret_cast<uint64_t>(table) / kBytesPerFrame}, 1, MemoryTag::kPageTable);
+    }
+
+    bool IsEmptyPageMap(const PageMapEntry *table)
+    {
+        return std::all_of(table, table + 512, [](const PageMapEntry &entry)
+                           { return entry.data == 0; });
+    }
+
+    /** @brief テーブルを指す要素を設定する。実際の権限は末端の要素で決めるので途中の要素は書き込み可にしておく */
+    void SetTable(PageMapEntry &entry, PageMapEntry *table, bool user)
+    {
+        entry.data = 0;
+        entry.SetPointer(table);
+        entry.bits.present = 1;
+        entry.bits.writable = 1;
+        entry.bits.user = user;
+    }
+
+    /** @brief level段目の要素をphysのページを指す末端の要素にする */
+    void SetLeaf(PageMapEntry &entry, int level, uint64_t phys, const PageAttribute &attr)
+    {
+        entry.data = phys & kAddressMask;
+        entry.bits.present = 1;
+        entry.bits.writable = attr.writable;
+        entry.bits.user = attr.user;
+        entry.bits.write_through = attr.write_through;
+        entry.bits.cache_disable = attr.cache_disable;
+        if (level > 1)
+        {
+            entry.bits.huge_page = 1;
+            if (attr.pat)
+            {
+                entry.data |= kLargePagePAT;
+            }
+        }
+        else
+        {
+            entry.bits.huge_page = attr.pat; // ページテーブルの要素ではbit7がPAT
+        }
+    }
+
+    PageAttribute AttributeOf(const PageMapEntry &entry, int level)
+    {
+        PageAttribute attr;
+        attr.writable = entry.bits.writable;
+        attr.user = entry.bits.user;
+        attr.write_through = entry.bits.write_through;
+        attr.cache_disable = entry.bits.cache_disable;
+        attr.pat = level > 1 ? (entry.data & kLargePagePAT) != 0 : entry.bits.huge_page;
+        return attr;
+    }
+
+    /**
+     * @brief level段目の大きなページを指す要素を、同じ範囲を1段小さいページで写像するテーブルに置き換える
+     *
+     * @param virt 大きなページの先頭の仮想アドレス
+     */
+    Error SplitLargePage(PageMapEntry *pml4, PageMapEntry &entry, int level, uint64_t virt)
+    {
+        auto table = NewPageMap();
+        if (table == nullptr)
+        {
+            return MAKE_ERROR(Error::kNoEnoughMemory);
+        }
+
+        const auto attr = AttributeOf(entry, level);
+        const auto base = entry.data & kAddressMask & ~(BytesAt(level) - 1);
+        for (int i = 0; i < 512; ++i)
+        {
+            SetLeaf(table[i], level - 1, base + i * BytesAt(level - 1), attr);
+        }
+        SetTable(entry, table, attr.user);
+        // 写像先は変わらないが、ページの大きさが変わったので古いTLBの要素を捨てる
+        InvalidateLater(pml4, virt);
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    /**
+     * @brief InvalidateLaterで溜めたTLBの無効化を実行する。paging_lockを取って呼ぶ
+     *
+     * 共有する前半の写像を変えた場合は、他のCPUにもTLB全体を捨てさせ、全てのCPUが応えるまで待つ。
+     * 待たずに戻ると、他のCPUがTLBやページング構造のキャッシュに残した古い写像で、返却したフレームを触りうる。
+     */
+    void FlushPending()
+    {
+        if (pending_all_contexts_flush)
+        {
+            // CR4.PGEを書き換えると、全てのPCIDのTLBとページング構造のキャッシュが捨てられる
+            const auto cr4 = GetCR4();
+            SetCR4(cr4 ^ kCR4PGE);
+            SetCR4(cr4);
+        }
+        else if (pending_full_flush)
+        {
+            SetCR3(GetCR3());
+        }
+        else
+        {
+            for (size_t i = 0; i < num_pending_invalidations; ++i)
+            {
+                InvalidateTLB(pending_invalidations[i]);
+            }
+        }
+        if (pending_remote_flush && NumCPUs() > 1)
+        {
+            // 前回頼んだ分は全てのCPUが応え終わっているので、自分は今の無効化で今回の分まで済んだことになる
+            const auto generation = tlb_flush_generation.fetch_add(1, std::memory_order_acq_rel) + 1;
+            tlb_flush_acks[CurrentCPU()].store(generation, std::memory_order_release);
+            SendIPIToOthers(InterruptVector::kTLBFlushIPI);
+            // 起動に失敗したAPは数から外れるので、待つたびにCPUの数を読み直す
+            for (int cpu = 0; cpu < NumCPUs(); ++cpu)
+            {
+                while (cpu < NumCPUs() && tlb_flush_acks[cpu].load(std::memory_order_acquire) < generation)
+                {
+                    __asm__ volatile("pause");
+                }
+            }
+        }
+        num_pending_invalidations = 0;
+        pending_full_flush = false;
+        pending_all_contexts_flush = false;
+        pending_remote_flush = false;
+    }
+
+    Error MapPageAt(PageMapEntry *pml4, uint64_t virt, uint64_t phys, int target_level, const PageAttribute &attr)
+    {
+        const LinearAddress4Level addr{virt};
+        PageMapEntry *table = pml4;
+        for (int level = 4; level > target_level; --level)
+        {
+            auto &entry = table[addr.Part(level)];
+            if (!entry.bits.present)
+            {
+                auto child = NewPageMap();
+                if (child == nullptr)
+                {
+                    return MAKE_ERROR(Error::kNoEnoughMemory);
+                }
+                SetTable(entry, child, attr.user);
+            }
+            else if (entry.bits.huge_page)
+            {
+                if (auto err = SplitLargePage(pml4, entry, level, virt & ~(BytesAt(level) - 1)))
+                {
+                    return err;
+                }
+            }
+            else if (attr.user)
+            {
+                entry.bits.user = 1;
+            }
+            table = entry.Pointer();
+        }
+
+        auto &entry = table[addr.Part(target_level)];
+        if (entry.bits.present)
+        {
+            if (target_level > 1 && !entry.bits.huge_page)
+            {
+                // 既により小さなページに分かれている
+                return MAKE_ERROR(Error::kAlreadyMapped);
+            }
+            InvalidateLater(pml4, virt);
+        }
+        SetLeaf(entry, target_level, phys, attr);
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    /**
+     * @brief level段目のテーブルtableのうち、仮想アドレス[first, last]に掛かる要素の写像を取り除く
+     *
+     * 範囲の終端がアドレス空間の最後でも桁あふれしないよう、終端は範囲に含まれる最後のアドレスで受け取る。
+     */
+    Error UnmapRangeAt(PageMapEntry *pml4, PageMapEntry *table, int level, uint64_t first, uint64_t last)
+    {
+        const auto entry_bytes = BytesAt(level);
+        const int first_index = LinearAddress4Level{first}.Part(level);
+        const int last_index = LinearAddress4Level{last}.Part(level);
+        for (int i = first_index; i <= last_index; ++i)
+        {
+            auto &entry = table[i];
+            const uint64_t entry_first = (first & ~(entry_bytes - 1)) + (i - first_index) * entry_bytes;
+            const uint64_t entry_last = entry_first + (entry_bytes - 1);
+            if (!entry.bits.present)
+            {
+                continue;
+            }
+
+            const auto clip_first = std::max(first, entry_first);
+            const auto clip_last = std::min(last, entry_last);
+            if (level == 1 || entry.bits.huge_page)
+            {
+                if (clip_first == entry_first && clip_last == entry_last)
+                {
+                    entry.data = 0;
+                    InvalidateLater(pml4, entry_first);
+                    continue;
+                }
+                // 範囲の端に一部だけ掛かる大きなページは分割して、掛かる部分だけ取り除く
+                if (auto err = SplitLargePage(pml4, entry, level, entry_first))
+                {
+                    return err;
+                }
+            }
+
+            auto child = entry.Pointer();
+            if (auto err = UnmapRangeAt(pml4, child, level - 1, clip_first, clip_last))
+            {
+                return err;
+            }
+
+            // 空になったページディレクトリとページテーブルは返却する。PDPテーブルは複数のPML4テーブルで共有しうるので残す
+            if (level <= 3 && IsEmptyPageMap(child))
+            {
+                entry.data = 0;
+                InvalidateLater(pml4, entry_first);
+                // 返却したフレームが再利用される前に、CPUがキャッシュしているテーブルの情報を捨てておく
+                FlushPending();
+                FreePageMap(child);
+            }
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+}
+
+PageMapEntry *KernelPML4()
+{
+    return pml4_table.data();
+}
+
+Error MapPage(PageMapEntry *pml4, uint64_t virt, uint64_t phys, PageSize size, PageAttribute attr)
+{
+    const int level = LevelOf(size);
+    if (level == 3 && !use_1gib_pages)
+    {
+        return MAKE_ERROR(Error::kUnsupportedPageSize);
+    }
+    if (virt % BytesAt(level) != 0 || phys % BytesAt(level) != 0)
+    {
+        return MAKE_ERROR(Error::kInvalidAddress);
+    }
+
+    SpinLockGuard guard{paging_lock};
+    return MapPageAt(pml4, virt, phys, level, attr);
+}
+
+Error MapRange(PageMapEntry *pml4, uint64_t virt, uint64_t phys, uint64_t bytes, PageAttribute attr)
+{
+    if (virt % kPageSize4K != 0 || phys % kPageSize4K != 0 || bytes % kPageSize4K != 0)
+    {
+        return MAKE_ERROR(Error::kInvalidAddress);
+    }
+
+    SpinLockGuard guard{paging_lock};
+    for (uint64_t offset = 0; offset < bytes;)
+    {
+        // 揃い方と残りの大きさが許す最大のページを使う
+        int level = use_1gib_pages ? 3 : 2;
+        while (level > 1 &&
+               ((virt + offset) % BytesAt(level) != 0 ||
+                (phys + offset) % BytesAt(level) != 0 ||
+                bytes - offset < BytesAt(level)))
+        {
+            --level;
+        }
+
+        auto err = MapPageAt(pml4, virt + offset, phys + offset, level, attr);
+        // 既に小さなページに分かれている場所は、その大きさに合わせて写像し直す
+        while (err.Cause() == Error::kAlreadyMapped && level > 1)
+        {
+            --level;
+            err = MapPageAt(pml4, virt + offset, phys + offset, level, attr);
+        }
+        if (err)
+        {
+            FlushPending();
+            return err;
+        }
+        offset += BytesAt(level);
+    }
+    FlushPending();
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error UnmapRange(PageMapEntry *pml4, uint64_t virt, uint64_t bytes)
+{
+    if (virt % kPageSize4K != 0 || bytes % kPageSize4K != 0)
+    {
+        return MAKE_ERROR(Error::kInvalidAddress);
+    }
+    if (bytes == 0)
+    {
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    SpinLockGuard guard{paging_lock};
+    auto err = UnmapRangeAt(pml4, pml4, 4, virt, virt + (bytes - 1));
+    FlushPending();
+    return err;
 }
 
-void SetupIdentityPageTable()
+void FlushTLB()
+{
+    SpinLockGuard guard{paging_lock};
+    FlushPending();
+}
+
+void AcknowledgeTLBFlush()
+{
+    InterruptGuard guard;
+    // 起動中でTSSを登録する前のAPはCPU 0の分として応えてしまうので、InitializePagingOnAPまで待たせる
+    if (!HasCPUNumber())
+    {
+        return;
+    }
+    auto &ack = tlb_flush_acks[CurrentCPU()];
+    // 捨てる前に読んだ値までは、これから捨てるTLBで済む
+    const auto generation = tlb_flush_generation.load(std::memory_order_acquire);
+    if (ack.load(std::memory_order_relaxed) == generation)
+    {
+        return;
+    }
+    const auto cr4 = GetCR4();
+    SetCR4(cr4 ^ kCR4PGE);
+    SetCR4(cr4);
+    ack.store(generation, std::memory_order_release);
+}
+
+PageMapEntry *NewAddressSpace()
+{
+    auto pml4 = NewPageMap();
+    if (pml4 == nullptr)
+    {
+        return nullptr;
+    }
+    SpinLockGuard guard{paging_lock};
+    std::copy_n(pml4_table.begin(), 256, pml4);
+    return pml4;
+}
+
+Error ReserveSharedRegion(uint64_t virt, uint64_t bytes)
+{
+    if (bytes == 0 || virt + bytes > 256 * BytesAt(4))
+    {
+        return MAKE_ERROR(Error::kInvalidAddress);
+    }
+
+    SpinLockGuard guard{paging_lock};
+    const int first = LinearAddress4Level{virt}.Part(4);
+    const int last = LinearAddress4Level{virt + bytes - 1}.Part(4);
+    for (int i = first; i <= last; ++i)
+    {
+        auto &entry = pml4_table[i];
+        if (entry.bits.present)
+        {
+            continue;
+        }
+        auto table = NewPageMap();
+        if (table == nullptr)
+        {
+            return MAKE_ERROR(Error::kNoEnoughMemory);
+        }
+        SetTable(entry, table, false);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void FreeAddressSpace(PageMapEntry *pml4)
+{
+    if (pml4 == KernelPML4() || (GetCR3() & kAddressMask) == reinterpret_cast<uint64_t>(pml4))
+    {
+        Log(kError, "cannot free the current or kernel address space %p\n", pml4);
+        return;
+    }
+
+    SpinLockGuard guard{paging_lock};
+    UnmapRangeAt(pml4, pml4, 4, kPrivateSpaceBase, ~0ull);
+    FlushPending();
+    // UnmapRangeAtはPDPテーブルを残すので、後半のものはここで返却する
+    for (int i = 256; i < 512; ++i)
+    {
+        if (pml4[i].bits.present)
+        {
+            FreePageMap(pml4[i].Pointer());
+        }
+    }
+    // 同じフレームが次のPML4テーブルになっても古いTLBを使わないようにする
+    ForgetPCID(pml4);
+    FreePageMap(pml4);
+}
+
+uint64_t CR3ForSwitch(PageMapEntry *pml4)
+{
+    const auto current = GetCR3();
+    if ((current & kAddressMask) == reinterpret_cast<uint64_t>(pml4))
+    {
+        return current;
+    }
+    if (!pcid_enabled)
+    {
+        return reinterpret_cast<uint64_t>(pml4);
+    }
+
+    InterruptGuard guard;
+    const auto pcid = PCIDOf(pml4);
+    auto &owner = pcid_owners[CurrentCPU()][pcid];
+    const bool tlb_valid = owner == pml4;
+    owner = pml4;
+    return reinterpret_cast<uint64_t>(pml4) | pcid | (tlb_valid ? kCR3NoFlush : 0);
+}
+
+Error SetWriteCombining(uint64_t addr, uint64_t bytes)
+{
+    if (!pat_supported)
+    {
+        return MAKE_ERROR(Error::kNotImplemented);
+    }
+
+    const auto first = addr & ~(kPageSize4K - 1);
+    const auto end = (addr + bytes + kPageSize4K - 1) & ~(kPageSize4K - 1);
+    return MapRange(KernelPML4(), first, first, end - first, WriteCombiningAttribute());
+}
+
+void SetupIdentityPageTable(uint64_t end)
 {
     /**
      * @brief [ref](みかん本196p)
@@ -24,28 +702,56 @@ void SetupIdentityPageTable()
      * - ページディレクトリポインタテーブル PDP table
      * - ページディレクトリ
      * - ページテーブル                                ：下位
-     * 
+     *
+     * PML4テーブル以外はMapRangeがmemory_managerから確保する。
      */
-
-    // PML4テーブルの先頭に、PDPテーブルの先頭アドレスを設定
-    pml4_table[0] = reinterpret_cast<uint64_t>(&pdp_table[0]) | 0x003;
-    for (int i_pdpt = 0; i_pdpt < page_directory.size(); i_pdpt++)
+    use_1gib_pages = Supports1GiBPages();
+    end = (end + kPageSize1G - 1) / kPageSize1G * kPageSize1G;
+    if (auto err = MapRange(KernelPML4(), 0, 0, end))
     {
-        // 各テーブルにページディレクトリの先頭アドレス
-        pdp_table[i_pdpt] = reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) | 0x003;
-        for (int i_pd = 0; i_pd < 512; i_pd++)
-        {
-            // ページディレクトリの各要素を設定
-            // | 0x083のビット和により、各要素のbit7を1にできて、2MiBページになる（？みかん本の197p）
-            page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x083;
-        }
+        Log(kError, "failed to set up identity mapping: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+        exit(1);
     }
+
     // PML4テーブルの物理アドレスをCR3レジスタに設定。
-    SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]));
+    SetCR3(reinterpret_cast<uint64_t>(KernelPML4()));
     // これ以降CPUは設定sチア新しい海藻ページング構造を使ってアドレス変換をする。（これ以前はUEFIが用意したものを利用している）
+
+    Log(kInfo, "identity mapped %lu GiB with %s pages\n", end / kPageSize1G, use_1gib_pages ? "1GiB" : "2MiB");
 }
 
-void InitializePaging()
+void InitializePaging(const MemoryMap &memory_map, const FrameBufferConfig &frame_buffer_config)
 {
-    SetupIdentityPageTable();
+    // Local APICのレジスタ（0xfee00000）などがあるので最低でも4GiBまでは写像する
+    uint64_t end = 4 * kPageSize1G;
+    const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
+    for (uintptr_t iter = memory_map_base;
+         iter < memory_map_base + memory_map.map_size;
+         iter += memory_map.descriptor_size)
+    {
+        auto desc = reinterpret_cast<const MemoryDescriptor *>(iter);
+        end = std::max(end, desc->physical_start + desc->number_of_pages * kUEFIPageSize);
+    }
+    end = std::max(end, FrameBufferEnd(frame_buffer_config));
+    SetupIdentityPageTable(end);
+    InitializePCID();
+    InitializePAT();
+    RegisterLockStats(paging_lock.Stats(), "paging");
+    spin_wait_hook = AcknowledgeTLBFlush;
+}
+
+void InitializePagingOnAP()
+{
+    // トランポリンはPCIDを0にしてCR3を設定してあるので、すぐにPCIDを有効にできる
+    if (pcid_enabled)
+    {
+        SetCR4(GetCR4() | kCR4PCIDE);
+        pcid_owners[CurrentCPU()][0] = pml4_table.data();
+    }
+    if (pat_supported)
+    {
+        ProgramPAT();
+    }
+    // 起動を待つ間に頼まれていた無効化は、CR3の設定で済んでいる
+    AcknowledgeTLBFlush();
 }
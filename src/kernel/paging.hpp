@@ -1,28 +1,291 @@
 /**
  * @file paging.hpp
  * @brief メモリページング用のプログラムを集めたファイル
- * 
+ *
  */
 
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+#include "frame_buffer_config.hpp"
+#include "memory_map.hpp"
+
+/**
+ * @brief 階層ページング構造の各テーブルの要素
+ *
+ * PML4テーブル、PDPテーブル、ページディレクトリ、ページテーブルの要素は共通の形をしている。
+ * huge_pageが1の要素はテーブルではなく大きなページ（PDPテーブルなら1GiB、ページディレクトリなら2MiB）を直接指す。
+ *
+ */
+union PageMapEntry
+{
+    uint64_t data;
+
+    struct
+    {
+        uint64_t present : 1;
+        uint64_t writable : 1;
+        uint64_t user : 1;
+        uint64_t write_through : 1;
+        uint64_t cache_disable : 1;
+        uint64_t accessed : 1;
+        uint64_t dirty : 1;
+        uint64_t huge_page : 1; // ページテーブルの要素ではPATビット
+        uint64_t global : 1;
+        uint64_t : 3;
+
+        uint64_t addr : 40; // 大きなページではbit12（addrの最下位ビット）がPATビット
+        uint64_t : 12;
+    } __attribute__((packed)) bits;
+
+    PageMapEntry *Pointer() const
+    {
+        return reinterpret_cast<PageMapEntry *>(bits.addr << 12);
+    }
+
+    void SetPointer(PageMapEntry *p)
+    {
+        bits.addr = reinterpret_cast<uint64_t>(p) >> 12;
+    }
+};
+
+/**
+ * @brief 4階層ページングでの仮想アドレスの分解
+ *
+ * Part(level)はlevel段目のテーブル（4: PML4、3: PDP、2: ページディレクトリ、1: ページテーブル）の添字を返す。
+ *
+ */
+union LinearAddress4Level
+{
+    uint64_t value;
+
+    struct
+    {
+        uint64_t offset : 12;
+        uint64_t page : 9;
+        uint64_t dir : 9;
+        uint64_t pdp : 9;
+        uint64_t pml4 : 9;
+        uint64_t : 16;
+    } __attribute__((packed)) parts;
+
+    int Part(int page_map_level) const
+    {
+        switch (page_map_level)
+        {
+        case 0:
+            return parts.offset;
+        case 1:
+            return parts.page;
+        case 2:
+            return parts.dir;
+        case 3:
+            return parts.pdp;
+        case 4:
+            return parts.pml4;
+        default:
+            return 0;
+        }
+    }
+};
+
+/**
+ * @brief ページの大きさ
+ *
+ */
+enum class PageSize
+{
+    k4KiB,
+    k2MiB,
+    k1GiB,
+};
+
+/**
+ * @brief ページの属性
+ *
+ * キャッシュの種類はPATの番号（pat << 2 | cache_disable << 1 | write_through）で決まる。
+ *
+ */
+struct PageAttribute
+{
+    bool writable = true;
+    bool user = false;
+    bool write_through = false;
+    bool cache_disable = false;
+    bool pat = false;
+};
+
+/**
+ * @brief Write Combiningの属性を返す
+ *
+ * InitializePagingがPATのエントリ4（pat = 1, cache_disable = 0, write_through = 0）をWrite Combiningに設定する。
+ *
+ * @return PageAttribute
+ */
+inline PageAttribute WriteCombiningAttribute()
+{
+    PageAttribute attr;
+    attr.pat = true;
+    return attr;
+}
+
+/**
+ * @brief アドレス空間ごとに別々の領域の先頭
+ *
+ * PML4テーブルの前半（0〜255番目の要素、恒等写像を含む）は全てのアドレス空間でカーネルのPDPテーブルを共有し、
+ * 後半（256〜511番目の要素）はアドレス空間ごとに別々にする。
+ */
+const uint64_t kPrivateSpaceBase = 0xffff800000000000;
+
+/**
+ * @brief カーネルのPML4テーブル。恒等写像を持つ
+ *
+ * @return PageMapEntry*
+ */
+PageMapEntry *KernelPML4();
+
+/**
+ * @brief 新しいアドレス空間（PML4テーブル）を作る
+ *
+ * 共有する前半はカーネルのPML4テーブルの要素をコピーするので、その後カーネル側で写像を変えると
+ * 全てのアドレス空間に反映される。ただし前半で新しくPML4テーブルの要素を使う写像は、アドレス空間を作る前に済ませておくこと。
+ *
+ * @return PageMapEntry* 確保できなければnullptr
+ */
+PageMapEntry *NewAddressSpace();
+
+/**
+ * @brief 共有する前半のうち[virt, virt + bytes)を覆うPML4テーブルの要素にPDPテーブルを用意しておく
+ *
+ * 後から作るアドレス空間だけでなく、既に作ったアドレス空間からもその範囲の写像が見えるよう、
+ * 最初のNewAddressSpaceより前に呼ぶ。
+ *
+ * @param virt
+ * @param bytes
+ * @return Error 範囲が前半に収まらなければkInvalidAddress
+ */
+Error ReserveSharedRegion(uint64_t virt, uint64_t bytes);
+
+/**
+ * @brief NewAddressSpaceで作ったアドレス空間の後半の写像を取り除き、ページテーブルを全て返却する
+ *
+ * 現在のアドレス空間は解放できない。
+ *
+ * @param pml4
+ */
+void FreeAddressSpace(PageMapEntry *pml4);
+
+/**
+ * @brief アドレス空間pml4に切り替えるときにCR3レジスタへ書き込む値を返す
+ *
+ * PCIDが使える場合はアドレス空間ごとにPCIDを割り当て、実行中のCPUでそのPCIDのTLBが有効ならbit63を立てて残させる。
+ * 現在のアドレス空間ならCR3の値をそのまま返すので、SwitchContextはCR3を書き込まない。
+ *
+ * @param pml4
+ * @return uint64_t
+ */
+uint64_t CR3ForSwitch(PageMapEntry *pml4);
+
+/**
+ * @brief 仮想アドレスvirtから始まる1ページを物理アドレスphysに写像する
+ *
+ * 途中のテーブルが無ければmemory_managerから確保し、より大きなページの中を写像する場合はそのページを分割する。
+ * 既に写像されているページは置き換える（同じ大きさのページに限る）。
+ * TLBの無効化はFlushTLBを呼ぶまで溜めておくので、続けて複数のページを書き換えてからまとめて無効化できる。
+ *
+ * @param pml4
+ * @param virt ページの大きさに揃っていること
+ * @param phys ページの大きさに揃っていること
+ * @param size
+ * @param attr
+ * @return Error 揃っていなければkInvalidAddress、その位置がより小さなページに分かれていればkAlreadyMapped
+ */
+Error MapPage(PageMapEntry *pml4, uint64_t virt, uint64_t phys, PageSize size, PageAttribute attr = {});
+
+/**
+ * @brief 仮想アドレス[virt, virt + bytes)を物理アドレスphysからの範囲に写像し、TLBを無効化する
+ *
+ * アドレスの揃い方が許す限り大きなページを使う。1GiBページはCPUが対応している場合だけ使う。
+ *
+ * @param pml4
+ * @param virt 4KiBに揃っていること
+ * @param phys 4KiBに揃っていること
+ * @param bytes 4KiBの倍数
+ * @param attr
+ * @return Error
+ */
+Error MapRange(PageMapEntry *pml4, uint64_t virt, uint64_t phys, uint64_t bytes, PageAttribute attr = {});
+
+/**
+ * @brief 仮想アドレス[virt, virt + bytes)の写像を取り除き、TLBを無効化する
+ *
+ * 範囲の端に一部だけ掛かる大きなページは分割してから取り除く。
+ * 空になったページディレクトリとページテーブルはmemory_managerに返却する。
+ *
+ * @param pml4
+ * @param virt 4KiBに揃っていること
+ * @param bytes 4KiBの倍数
+ * @return Error
+ */
+Error UnmapRange(PageMapEntry *pml4, uint64_t virt, uint64_t bytes);
 
 /**
- * @brief 静的に確保するページディレクトリの個数
- * 
- * この関数はSetupIdentityPageMapで使用される。
- * 1つのページディレクトリには512個の2MiBページを設定できるので、
- * kPageDirectoryCount x 1GiBの仮想アドレスがマッピングされることになる。
- * 
+ * @brief MapPageで溜めたTLBの無効化を実行する
+ *
+ * 溜まったページが少なければinvlpgで1ページずつ、多ければCR3を設定し直してTLB全体を捨てる。
+ * 共有する前半の写像を置き換えたり取り除いたりした場合は、他のCPUにもIPIでTLB全体を捨てさせ、
+ * 全てのCPUが捨て終わるまで待ってから戻る。そのため戻った後は、取り除いた写像の先のフレームを返却してよい。
+ *
  */
-const size_t kPageDirectoryCount = 64;
+void FlushTLB();
+
+/**
+ * @brief 他のCPUから頼まれたTLBの無効化がまだなら、実行中のCPUのTLBを全てのPCIDの分も含めて捨てて応える
+ *
+ * TLBの無効化のIPIの割り込みハンドラから呼ぶ。割り込みを禁止してSpinLockを回って待つ間も
+ * spin_wait_hookから呼ぶので、頼んだCPUがロックを持ったまま待っていても互いに待ち合って止まらない。
+ */
+void AcknowledgeTLBFlush();
 
 /**
  * @brief 仮想アドレスと物理アドレスが一致するようにページテーブルを設定する。
  * 最終的にCR3レジスタが正しく設定されたページテーブルを指すようにする。
- * 
+ *
+ * CPUが1GiBページに対応していれば（CPUIDのpdpe1gb）1GiBページ、そうでなければ2MiBページで写像する。
+ *
+ * @param end 写像する範囲の終端。1GiBの倍数に切り上げる
  */
-void SetupIdentityPageTable();
+void SetupIdentityPageTable(uint64_t end);
 
-void InitializePaging();
+/**
+ * @brief 恒等写像のうち物理アドレス[addr, addr + bytes)を含むページをWrite Combiningで写像し直す
+ *
+ * フレームバッファのように書き込むだけの領域に使う。書き込みがまとめてバースト転送されるようになる。
+ *
+ * @param addr
+ * @param bytes
+ * @return Error CPUがPATに対応していなければkNotImplemented
+ */
+Error SetWriteCombining(uint64_t addr, uint64_t bytes);
+
+/**
+ * @brief ページングを初期化する
+ *
+ * メモリマップの最も高いアドレス、4GiB（Local APICなどのMMIO領域がある）、フレームバッファの終端の
+ * いずれも含む範囲を恒等写像する。ページテーブルはmemory_managerから確保するので、InitializeMemoryManagerの後に呼ぶ。
+ * PATのエントリ4もWrite Combiningに設定し、CPUが対応していればPCIDを有効にする。
+ *
+ * @param memory_map
+ * @param frame_buffer_config
+ */
+void InitializePaging(const MemoryMap &memory_map, const FrameBufferConfig &frame_buffer_config);
+
+/**
+ * @brief APでもBSPと同じようにPCIDとPATを設定する
+ *
+ * CR3にはカーネルのPML4テーブルを設定してから呼ぶ。
+ */
+void InitializePagingOnAP();
@@ -1,10 +1,32 @@
 #include "segment.hpp"
 #include "asmfunc.h"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "smp.hpp"
+
+#include <cstdlib>
 
 namespace // 無名名前空間で定義された変数はこのファイル外から見えない
 {
     // グローバルディスクリプタテーブルの実体定義[ref](みかん本188p)
-    std::array<SegmentDescriptor, 3> gdt;
+    // ヌル、コード、データの後ろに、CPUごとのTSSディスクリプタを2要素ずつ並べる
+    std::array<SegmentDescriptor, 3 + 2 * kMaxCPUs> gdt;
+    /** @brief CPUごとの64bitモードのTSS（104バイト）。RSP0〜2、IST1〜7などを持つ */
+    std::array<std::array<uint32_t, 26>, kMaxCPUs> tss;
+
+    /** @brief フォルト処理用スタックのフレーム数 */
+    const size_t kFaultStackFrames = 8;
+
+    /**
+     * @brief TSSの中の64bitの値を設定する。64bitの値は4バイト境界にしか揃っていないので32bitずつ書く
+     *
+     * @param index tssの添字（RSP0は1、IST1は9）
+     */
+    void SetTSS(int cpu, int index, uint64_t value)
+    {
+        tss[cpu][index] = value & 0xffffffff;
+        tss[cpu][index + 1] = value >> 32;
+    }
 }
 
 void SetCodeSegment(
@@ -49,6 +71,26 @@ void SetDataSegment(
     desc.bits.default_operation_size = 1; //32bit stack segment
 }
 
+/**
+ * @brief TSSなどのシステムセグメントのディスクリプタを設定する。64bitモードでは2つ分の大きさがあり、後半はベースアドレスの上位32bit
+ */
+void SetSystemSegment(
+    SegmentDescriptor &desc,
+    DescriptorType type,
+    unsigned int descriptor_privilege_level,
+    uint32_t base,
+    uint32_t limit)
+{
+    SetCodeSegment(
+        desc, type,
+        descriptor_privilege_level,
+        base, limit);
+
+    desc.bits.system_segment = 0;
+    desc.bits.long_mode = 0;
+    desc.bits.granularity = 0; // limitはバイト単位
+}
+
 /**
  * @brief GDTを再構築する関数
  * 
@@ -70,4 +112,31 @@ void InitializeSegmentation()
 
     SetDSAll(kKernelDS);
     SetCSSS(kKernelCS, kKernelSS);
-}
\ No newline at end of file
+}
+
+void InitializeSegmentationOnAP()
+{
+    LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
+    SetDSAll(kKernelDS);
+    SetCSSS(kKernelCS, kKernelSS);
+}
+
+void InitializeTSS(int cpu)
+{
+    const auto stack = AllocateFrames(kFaultStackFrames, MemoryTag::kTaskStack);
+    if (stack.error)
+    {
+        Log(kError, "failed to allocate the fault stack: %s\n", stack.error.Name());
+        exit(1);
+    }
+    const auto stack_end = reinterpret_cast<uint64_t>(stack.value.Frame()) + kFaultStackFrames * kBytesPerFrame;
+    SetTSS(cpu, 9 + 2 * (kISTForFault - 1), stack_end); // IST1はオフセット0x24（tss[9]）から並ぶ
+
+    const auto selector = TSSSelector(cpu);
+    const auto tss_addr = reinterpret_cast<uint64_t>(&tss[cpu][0]);
+    SetSystemSegment(gdt[selector >> 3], DescriptorType::kTSSAvailable, 0, tss_addr & 0xffffffff, sizeof(tss[cpu]) - 1);
+    gdt[(selector >> 3) + 1].data = tss_addr >> 32;
+
+    // gdtは最初から全てのCPUの分の大きさで登録済みなので、要素を書き換えるだけでよい
+    LoadTR(selector);
+}
@@ -50,9 +50,42 @@ void SetDataSegment(
     uint32_t base,
     uint32_t limit);
 
+void SetSystemSegment(
+    SegmentDescriptor &desc,
+    DescriptorType type,
+    unsigned int descriptor_privilege_level,
+    uint32_t base,
+    uint32_t limit);
+
 const uint16_t kKernelCS = 1 << 3; // Code Segmentレジスタ(CS)はgdt[1]を指す
 const uint16_t kKernelSS = 2 << 3; // Stack Segmentレジスタ(SS)はgdt[2]を指す
 const uint16_t kKernelDS = 0;      // Data Segmentレジスタ(DS)はgdt[0]を指す？
+const uint16_t kTSS = 3 << 3;      // CPU 0のTSSディスクリプタはgdt[3]とgdt[4]の2つ分を使い、CPUごとに2つずつ後ろに並べる
+
+/** @brief 番号cpuのCPUのTSSディスクリプタのセレクタ */
+constexpr uint16_t TSSSelector(int cpu)
+{
+    return kTSS + 16 * cpu;
+}
+
+/** @brief ページフォルトとダブルフォルトのハンドラが使うIST（Interrupt Stack Table）の番号 */
+const int kISTForFault = 1;
 
 void SetupSegments();
 void InitializeSegmentation();
+/**
+ * @brief BSPが作ったGDTをAPに登録し、セグメントレジスタを設定する
+ */
+void InitializeSegmentationOnAP();
+
+/**
+ * @brief 番号cpuのCPUのTSSを設定してTRレジスタに登録する
+ *
+ * ISTの1番目にフォルト処理用のスタックを用意する。タスクのスタックがあふれてガードページに触れると、
+ * 例外を通知するためのスタックも使えないので、別のスタックに切り替えてから例外ハンドラを実行させる。
+ * スタックはmemory_managerから確保するのでInitializeMemoryManagerの後に呼ぶ。
+ * TRレジスタからCPUの番号を求める（CurrentCPU）ので、CPUごとに最初に呼ぶ。
+ *
+ * @param cpu 実行中のCPUの番号
+ */
+void InitializeTSS(int cpu = 0);
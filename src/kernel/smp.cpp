@@ -0,0 +1,251 @@
+#include "smp.hpp"
+
+#include <atomic>
+#include <string.h>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "fpu.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "task.hpp"
+#include "task_stack.hpp"
+#include "timer.hpp"
+
+namespace
+{
+    // Local APICのレジスタ
+    /** @brief Local APIC ID（31:24bit） */
+    volatile uint32_t &lapic_id = *reinterpret_cast<uint32_t *>(0xfee00020);
+    /** @brief Spurious Interrupt Vectorレジスタ。bit8でLocal APICを有効にする */
+    volatile uint32_t &spurious_vector = *reinterpret_cast<uint32_t *>(0xfee000f0);
+    /** @brief Interrupt Command Registerの下位32bit。書き込むとIPIを送る */
+    volatile uint32_t &icr_low = *reinterpret_cast<uint32_t *>(0xfee00300);
+    /** @brief Interrupt Command Registerの上位32bit。31:24bitが宛先のLocal APIC ID */
+    volatile uint32_t &icr_high = *reinterpret_cast<uint32_t *>(0xfee00310);
+
+    const uint32_t kSVREnable = 1u << 8;
+    const uint32_t kICRDeliveryINIT = 0b101 << 8;
+    const uint32_t kICRDeliveryStartup = 0b110 << 8;
+    const uint32_t kICRDeliveryPending = 1u << 12;
+    const uint32_t kICRLevelAssert = 1u << 14;
+    const uint32_t kICRAllExcludingSelf = 0b11 << 18;
+
+    const uint64_t kCR0TS = 1u << 3;
+    const uint64_t kCR4PCIDE = 1ull << 17;
+    const uint32_t kMSREFER = 0xc0000080;
+    const uint64_t kEFERLMA = 1u << 10;
+
+    /** @brief CPUの番号からLocal APIC IDを引く表 */
+    uint8_t apic_ids[kMaxCPUs];
+    std::atomic<int> num_cpus{1};
+
+    /** @brief トランポリンのap_trampoline_paramsの並び（asmfunc.asm） */
+    struct APTrampolineParams
+    {
+        uint64_t cr3, cr4, efer, cr0, stack, entry, cpu;
+        /**
+         * @brief 起動するAP宛ての印（kTrampolineTokenValid | Local APIC ID）
+         *
+         * APはトランポリンで自分宛てなら0に書き換えてからstack、entry、cpuを読む。0や他のAP宛てならそこで止まる。
+         */
+        uint64_t token;
+    };
+    static_assert(sizeof(APTrampolineParams) == 8 * 8, "keep in sync with ap_trampoline_params");
+
+    const uint64_t kTrampolineTokenValid = 1u << 8;
+
+    /** @brief APが自分のスタックとしてアイドルタスクに登録する */
+    TaskStack ap_stacks[kMaxCPUs];
+    /**
+     * @brief 起動を待っているCPUの番号。待っていなければ-1
+     *
+     * APは初期化を終えたら、BSPは待つのを諦めたら-1に戻す。先に戻した側の結果になる。
+     */
+    std::atomic<int> starting_cpu{-1};
+
+    /**
+     * @brief ICRの送信待ちが消えるまで待ってからIPIを送る
+     */
+    void WriteICR(uint8_t apic_id, uint32_t low)
+    {
+        InterruptGuard guard;
+        while (icr_low & kICRDeliveryPending)
+        {
+            __asm__ volatile("pause");
+        }
+        icr_high = static_cast<uint32_t>(apic_id) << 24;
+        icr_low = low;
+    }
+
+    /**
+     * @brief トランポリンからロングモードで呼ばれるAPの入り口
+     *
+     * BSPと同じページテーブルを使い、BSPのInitialize*のうちCPUごとに必要なものだけを行う。
+     */
+    [[noreturn]] void APMain(uint64_t cpu)
+    {
+        InitializeSegmentationOnAP();
+        InitializeTSS(cpu);
+        LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+        InitializePagingOnAP();
+        InitializeFPU();
+        spurious_vector = spurious_vector | kSVREnable | 0xff;
+        InitializeLAPICTimerOnAP();
+
+        task_manager->StartCPU(cpu, ap_stacks[cpu]);
+        int expected = static_cast<int>(cpu);
+        if (!starting_cpu.compare_exchange_strong(expected, -1))
+        {
+            // BSPが待つのを諦めた後に初期化を終えた。CPUの数に入っていないので、何もせずに止まる
+            while (true)
+            {
+                __asm__("cli\n\thlt");
+            }
+        }
+        __asm__("sti");
+        task_manager->Idle();
+    }
+
+    /**
+     * @brief トランポリンを置く1MiB未満のフレームを確保する。SIPIのベクタ番号にするページ番号を返す
+     */
+    WithError<uint8_t> AllocateTrampolineFrame()
+    {
+        SpinLockGuard guard{memory_manager_lock};
+        // 0番と0xa0以降（VGAやBIOSの領域）は避ける
+        for (size_t i = 1; i < 0xa0; ++i)
+        {
+            if (!memory_manager->AllocateAt(FrameID{i}, 1))
+            {
+                return {static_cast<uint8_t>(i), MAKE_ERROR(Error::kSuccess)};
+            }
+        }
+        return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    /**
+     * @brief INIT-SIPI-SIPIでAPを1つ起動し、初期化を終えるまで待つ
+     *
+     * @return 100ms以内に初期化を終えればtrue。falseなら、後から初期化を終えてもAPMainで止まる
+     */
+    bool StartAP(int cpu, uint8_t apic_id, uint8_t page)
+    {
+        starting_cpu.store(cpu);
+        WriteICR(apic_id, kICRDeliveryINIT | kICRLevelAssert);
+        acpi::WaitMilliseconds(10);
+        for (int i = 0; i < 2; ++i)
+        {
+            WriteICR(apic_id, kICRDeliveryStartup | page);
+            acpi::WaitMilliseconds(1);
+        }
+        for (int i = 0; i < 100 && starting_cpu.load() == cpu; ++i)
+        {
+            acpi::WaitMilliseconds(1);
+        }
+        // 待つのを諦める。同時にAPが初期化を終えていれば、APが先に-1に戻している
+        int expected = cpu;
+        return !starting_cpu.compare_exchange_strong(expected, -1);
+    }
+} // namespace
+
+int NumCPUs()
+{
+    return num_cpus.load(std::memory_order_relaxed);
+}
+
+void SendIPI(int cpu, uint8_t vector)
+{
+    WriteICR(apic_ids[cpu], vector);
+}
+
+void SendIPIToOthers(uint8_t vector)
+{
+    WriteICR(0, kICRAllExcludingSelf | vector);
+}
+
+uint8_t LocalAPICID()
+{
+    return lapic_id >> 24;
+}
+
+void StartApplicationProcessors()
+{
+    apic_ids[0] = LocalAPICID();
+    if (acpi::madt == nullptr)
+    {
+        Log(kWarn, "MADT is not found. running on the BSP only\n");
+        return;
+    }
+
+    uint8_t madt_ids[256];
+    const size_t num_ids = acpi::madt->LocalAPICIDs(madt_ids, sizeof(madt_ids));
+
+    const auto page = AllocateTrampolineFrame();
+    if (page.error)
+    {
+        Log(kWarn, "failed to allocate a frame for the AP trampoline: %s\n", page.error.Name());
+        return;
+    }
+    // 1MiB未満は恒等写像しているので、物理アドレスのままコピーできる
+    auto trampoline = reinterpret_cast<uint8_t *>(static_cast<uintptr_t>(page.value) << 12);
+    memcpy(trampoline, ap_trampoline, ap_trampoline_end - ap_trampoline);
+    auto &params = *reinterpret_cast<APTrampolineParams *>(
+        trampoline + (ap_trampoline_params - ap_trampoline));
+
+    for (size_t i = 0; i < num_ids; ++i)
+    {
+        if (madt_ids[i] == apic_ids[0])
+        {
+            continue;
+        }
+        const int cpu = NumCPUs();
+        if (cpu >= kMaxCPUs)
+        {
+            Log(kWarn, "too many CPUs. only %d CPUs are used\n", kMaxCPUs);
+            break;
+        }
+
+        auto stack = AllocateTaskStack(Task::kDefaultStackBytes);
+        if (stack.error)
+        {
+            Log(kWarn, "failed to allocate a stack for CPU %d: %s\n", cpu, stack.error.Name());
+            break;
+        }
+        ap_stacks[cpu] = stack.value;
+        apic_ids[cpu] = madt_ids[i];
+
+        // APはPCIDを使わない状態でCR3を読み込み、PCIDEはInitializePagingOnAPで立てる
+        params.cr3 = reinterpret_cast<uint64_t>(KernelPML4());
+        params.cr4 = GetCR4() & ~kCR4PCIDE;
+        params.efer = ReadMSR(kMSREFER) & ~kEFERLMA;
+        params.cr0 = GetCR0() & ~kCR0TS;
+        params.stack = stack.value.End() & ~0xflu;
+        params.entry = reinterpret_cast<uint64_t>(APMain);
+        params.cpu = cpu;
+        __atomic_store_n(&params.token, kTrampolineTokenValid | madt_ids[i], __ATOMIC_RELEASE);
+
+        // APがIPIを受け取れるように、起動する前に数に入れておく
+        num_cpus.store(cpu + 1);
+        if (!StartAP(cpu, madt_ids[i], page.value))
+        {
+            num_cpus.store(cpu);
+            if (__atomic_exchange_n(&params.token, 0, __ATOMIC_ACQ_REL) == 0)
+            {
+                // APはトランポリンを抜けて、このスタックと番号で初期化を続けている（APMainで止まる）。
+                // スタックは返さず、番号とparamsも使い回せないので、残りのAPは起動しない
+                Log(kWarn, "CPU %d (Local APIC ID %u) did not finish starting. no more APs are started\n",
+                    cpu, madt_ids[i]);
+                break;
+            }
+            // トークンを取り消したので、遅れて来てもトランポリンで止まりスタックには触れない
+            FreeTaskStack(stack.value);
+            Log(kWarn, "CPU %d (Local APIC ID %u) did not start\n", cpu, madt_ids[i]);
+            continue;
+        }
+        Log(kInfo, "CPU %d (Local APIC ID %u) started\n", cpu, madt_ids[i]);
+    }
+    Log(kInfo, "%d CPUs are running\n", NumCPUs());
+}
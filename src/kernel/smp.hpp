@@ -0,0 +1,72 @@
+/**
+ * @file smp.hpp
+ * @brief BSP以外のプロセッサ（Application Processor, AP）を起動し、CPU間で割り込みを送るプログラム
+ *
+ * CPUにはBSPを0番として、起動した順に番号を振る。実行中のCPUの番号はTRレジスタ（CPUごとに別のTSSを指す）から求める。
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "segment.hpp"
+
+/** @brief 扱うCPUの最大数 */
+const int kMaxCPUs = 16;
+
+/**
+ * @brief 実行中のCPUの番号
+ *
+ * TSSを登録する（InitializeTSS）前は0を返す。割り込みを許可したまま呼ぶと、
+ * 戻った時には別のCPUに移っているかもしれないので、その番号のCPUのデータを触る場合は割り込みを禁止しておく。
+ */
+inline int CurrentCPU()
+{
+    uint16_t tr;
+    __asm__ volatile("str %0"
+                     : "=r"(tr));
+    return tr < kTSS ? 0 : (tr - kTSS) / 16;
+}
+
+/** @brief 実行中のCPUがTSSを登録済みで、CurrentCPUが自分の番号を返すか */
+inline bool HasCPUNumber()
+{
+    uint16_t tr;
+    __asm__ volatile("str %0"
+                     : "=r"(tr));
+    return tr >= kTSS;
+}
+
+/** @brief 起動済みのCPUの数 */
+int NumCPUs();
+
+/**
+ * @brief 番号cpuのCPUに割り込みを送る（IPI, Inter-Processor Interrupt）
+ *
+ * @param cpu
+ * @param vector 割り込みベクタ番号
+ */
+void SendIPI(int cpu, uint8_t vector);
+
+/**
+ * @brief 自分以外の全てのCPUに割り込みを送る
+ *
+ * @param vector
+ */
+void SendIPIToOthers(uint8_t vector);
+
+/**
+ * @brief 実行中のCPUのLocal APIC ID
+ */
+uint8_t LocalAPICID();
+
+/**
+ * @brief MADTに載っているAPを1つずつINIT-SIPI-SIPIで起動する
+ *
+ * APはリアルモードで起動するので、1MiB未満に置いたトランポリンでロングモードまで移り、
+ * セグメント、TSS、IDT、ページング、FPU、LAPICタイマを設定してからアイドルタスクになる。
+ * 以降はTaskManagerが他のCPUの実行待ちキューからタスクを盗んで実行する。
+ * 100ms以内に初期化を終えなかったAPは、遅れて動き出しても途中で止まり、CPUの数には入らない。
+ * acpi::Initialize、InitializeLAPICTimer、InitializeTask、InitializeInterruptの後に呼ぶ。
+ */
+void StartApplicationProcessors();
@@ -0,0 +1,163 @@
+/**
+ * @file spinlock.hpp
+ * @brief 複数のCPUから触るデータを守るスピンロック
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "asmfunc.h"
+#include "interrupt.hpp"
+
+/**
+ * @brief ロックの取得回数と保持時間の統計。時間はTSCのカウント数
+ *
+ * ロックを持っている間に更新するので、ロックごとの更新は競合しない。読む側はロックを取らずに読むので、値の組は多少ずれる。
+ */
+struct LockStats
+{
+    /** @brief RegisterLockStatsで付けた名前。登録していなければnullptr */
+    const char *name{nullptr};
+    uint64_t acquisitions{0};
+    /** @brief すぐに取れずに待った回数 */
+    uint64_t contentions{0};
+    uint64_t total_hold{0};
+    uint64_t max_hold{0};
+    /** @brief 登録済みの統計をつなぐリンク */
+    LockStats *next{nullptr};
+
+    /** @brief 取ったときに呼ぶ */
+    void Acquired(bool contended)
+    {
+        ++acquisitions;
+        if (contended)
+        {
+            ++contentions;
+        }
+    }
+    /** @brief 外す直前に、持っていた時間holdを記録する */
+    void Released(uint64_t hold)
+    {
+        total_hold += hold;
+        if (hold > max_hold)
+        {
+            max_hold = hold;
+        }
+    }
+};
+
+/**
+ * @brief SpinLockを取れずに回って待つ間に繰り返し呼ぶ関数。nullptrなら呼ばない
+ *
+ * ページングの初期化でAcknowledgeTLBFlush（paging.hpp）を設定する。割り込みを禁止して回っているCPUは
+ * TLBの無効化のIPIを受け取れないので、ここで応えないと、ロックを持ったまま応答を待つCPUと互いに待ち合って止まる。
+ */
+inline void (*spin_wait_hook)() = nullptr;
+
+/**
+ * @brief 取れるまで回って待つロック。再入はできない
+ *
+ * 割り込みハンドラと共有するデータを守る場合は、割り込みを禁止してから取らないと
+ * 同じCPUの割り込みハンドラが取ろうとして止まるので、SpinLockGuardを使う。
+ */
+class SpinLock
+{
+public:
+    void Lock()
+    {
+        bool contended = false;
+        while (locked_.exchange(true, std::memory_order_acquire))
+        {
+            contended = true;
+            // 取れるまではキャッシュラインを書き換えずに読むだけにする
+            while (locked_.load(std::memory_order_relaxed))
+            {
+                if (spin_wait_hook)
+                {
+                    spin_wait_hook();
+                }
+                __asm__ volatile("pause");
+            }
+        }
+        stats_.Acquired(contended);
+        hold_start_ = ReadTSC();
+    }
+
+    /** @brief 取れなければすぐにfalseを返す */
+    bool TryLock()
+    {
+        if (locked_.exchange(true, std::memory_order_acquire))
+        {
+            return false;
+        }
+        stats_.Acquired(false);
+        hold_start_ = ReadTSC();
+        return true;
+    }
+
+    void Unlock()
+    {
+        stats_.Released(ReadTSC() - hold_start_);
+        locked_.store(false, std::memory_order_release);
+    }
+
+    LockStats &Stats() { return stats_; }
+
+private:
+    std::atomic<bool> locked_{false};
+    LockStats stats_{};
+    /** @brief 取ったときのTSC */
+    uint64_t hold_start_{0};
+};
+
+/** @brief RegisterLockStatsで登録した統計のリストの先頭 */
+inline LockStats *lock_stats_list = nullptr;
+/** @brief lock_stats_listを守る */
+inline std::atomic<bool> lock_stats_list_lock{false};
+
+/**
+ * @brief statsに名前を付け、DumpLockStats（sync.hpp）で表示するリストに加える
+ *
+ * 1つの統計は1度だけ登録する。初期化のときに呼ぶもので、割り込みハンドラからは呼ばない。
+ */
+inline void RegisterLockStats(LockStats &stats, const char *name)
+{
+    while (lock_stats_list_lock.exchange(true, std::memory_order_acquire))
+    {
+        __asm__ volatile("pause");
+    }
+    stats.name = name;
+    stats.next = lock_stats_list;
+    lock_stats_list = &stats;
+    lock_stats_list_lock.store(false, std::memory_order_release);
+}
+
+/**
+ * @brief 生存期間中はこのCPUの割り込みを禁止してロックを取る
+ *
+ * 割り込みを禁止してからロックを取り、ロックを外してから元の割り込み許可状態に戻す。
+ */
+class SpinLockGuard
+{
+public:
+    explicit SpinLockGuard(SpinLock &lock) : lock_{lock}
+    {
+        lock_.Lock();
+    }
+    ~SpinLockGuard()
+    {
+        lock_.Unlock();
+    }
+    SpinLockGuard(const SpinLockGuard &) = delete;
+    SpinLockGuard &operator=(const SpinLockGuard &) = delete;
+    /** @brief 作る前に割り込みが許可されていたか */
+    bool WasEnabled() const { return interrupt_guard_.WasEnabled(); }
+
+private:
+    // メンバは宣言順に作られ、逆順に壊されるので、割り込みの禁止はロックより先、許可はロックより後になる
+    InterruptGuard interrupt_guard_;
+    SpinLock &lock_;
+};
@@ -0,0 +1,115 @@
+#include "sync.hpp"
+
+#include "asmfunc.h"
+#include "timer.hpp"
+
+void Mutex::Lock()
+{
+    bool contended = false;
+    {
+        SpinLockGuard guard{lock_};
+        Task *task = &task_manager->CurrentTask();
+        if (owner_ == nullptr)
+        {
+            owner_ = task;
+        }
+        else
+        {
+            // Unlockがowner_をこのタスクにしてから起こす
+            contended = true;
+            task_manager->Block(waiters_, lock_);
+        }
+    }
+    stats_.Acquired(contended);
+    hold_start_ = ReadTSC();
+}
+
+bool Mutex::TryLock()
+{
+    {
+        SpinLockGuard guard{lock_};
+        if (owner_ != nullptr)
+        {
+            return false;
+        }
+        owner_ = &task_manager->CurrentTask();
+    }
+    stats_.Acquired(false);
+    hold_start_ = ReadTSC();
+    return true;
+}
+
+void Mutex::Unlock()
+{
+    stats_.Released(ReadTSC() - hold_start_);
+    Task *next;
+    {
+        SpinLockGuard guard{lock_};
+        next = waiters_.Pop();
+        owner_ = next;
+    }
+    // lock_を外してから起こすので、起こしたタスクの優先度が高ければここで切り替わる
+    if (next)
+    {
+        task_manager->Wakeup(next);
+    }
+}
+
+void ConditionVariable::Wait(Mutex &mutex)
+{
+    {
+        SpinLockGuard guard{lock_};
+        // lock_を持ったままmutexを外すので、外してから眠るまでの間の通知を取りこぼさない
+        mutex.Unlock();
+        task_manager->Block(waiters_, lock_);
+    }
+    mutex.Lock();
+}
+
+void ConditionVariable::NotifyOne()
+{
+    Task *task;
+    {
+        SpinLockGuard guard{lock_};
+        task = waiters_.Pop();
+    }
+    if (task)
+    {
+        task_manager->Wakeup(task);
+    }
+}
+
+void ConditionVariable::NotifyAll()
+{
+    bool can_switch;
+    {
+        SpinLockGuard guard{lock_};
+        can_switch = guard.WasEnabled();
+        // lock_を持ったまま起こすので横取りは保留され、外した後でまとめて切り替える
+        while (Task *task = waiters_.Pop())
+        {
+            task_manager->Wakeup(task);
+        }
+    }
+    if (can_switch)
+    {
+        task_manager->SwitchTaskIfPreempted();
+    }
+}
+
+void DumpLockStats(LogLevel level)
+{
+    auto to_ns = [](uint64_t tsc)
+    {
+        return tsc_freq == 0 ? 0 : tsc * 1000000000 / tsc_freq;
+    };
+
+    Log(level, "locks: acquired, contended, average hold [ns], max hold [ns]\n");
+    for (auto stats = lock_stats_list; stats; stats = stats->next)
+    {
+        const auto acquisitions = stats->acquisitions;
+        const auto average = acquisitions == 0 ? 0 : stats->total_hold / acquisitions;
+        Log(level, "  %-12s %8lu %8lu %8lu %10lu\n", stats->name, acquisitions, stats->contentions,
+            to_ns(average), to_ns(stats->max_hold));
+    }
+}
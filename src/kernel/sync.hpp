@@ -0,0 +1,91 @@
+/**
+ * @file sync.hpp
+ * @brief タスクの間で使う、眠って待つミューテックスと条件変数
+ *
+ * 短い区間や割り込みハンドラと共有するデータはSpinLock（spinlock.hpp）で守る。
+ * 描画のように時間のかかる区間はMutexで守り、待つタスクは回らずに眠らせて他のタスクにCPUを譲る。
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "logger.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
+
+/**
+ * @brief 取れなければ眠って待つロック。再入はできない
+ *
+ * 待っているタスクは来た順に並べ、Unlockで先頭のタスクに所有権を直接渡す。
+ * タスクの中で割り込みを許可した状態で使い、割り込みハンドラやSpinLockを持っている間は使わない（TryLockは除く）。
+ */
+class Mutex
+{
+public:
+    void Lock();
+    /** @brief 取れなければすぐにfalseを返す。眠らないので、割り込み禁止中でも呼べる */
+    bool TryLock();
+    void Unlock();
+
+    LockStats &Stats() { return stats_; }
+
+private:
+    /** @brief owner_とwaiters_を守る */
+    SpinLock lock_;
+    /** @brief 持っているタスク。nullptrなら誰も持っていない */
+    Task *owner_{nullptr};
+    WaitQueue waiters_{};
+    LockStats stats_{};
+    /** @brief 取ったときのTSC */
+    uint64_t hold_start_{0};
+};
+
+/**
+ * @brief 生存期間中Mutexを持つ
+ */
+class MutexGuard
+{
+public:
+    explicit MutexGuard(Mutex &mutex) : mutex_{mutex}
+    {
+        mutex_.Lock();
+    }
+    ~MutexGuard()
+    {
+        mutex_.Unlock();
+    }
+    MutexGuard(const MutexGuard &) = delete;
+    MutexGuard &operator=(const MutexGuard &) = delete;
+
+private:
+    Mutex &mutex_;
+};
+
+/**
+ * @brief 条件が成り立つまでMutexを外して眠り、他のタスクからの通知で起きる
+ */
+class ConditionVariable
+{
+public:
+    /**
+     * @brief mutexを外して通知を待ち、mutexを取り直してから戻る
+     *
+     * 通知が無くても戻ることがあるので、条件はmutexを持ったままループで調べ直す。
+     */
+    void Wait(Mutex &mutex);
+    /** @brief 待っているタスクを1つ起こす。割り込みハンドラからも呼べる */
+    void NotifyOne();
+    /** @brief 待っているタスクを全て起こす。割り込みハンドラからも呼べる */
+    void NotifyAll();
+
+private:
+    /** @brief waiters_を守る */
+    SpinLock lock_;
+    WaitQueue waiters_{};
+};
+
+/**
+ * @brief RegisterLockStatsで登録したロックの取得回数と保持時間を優先度levelでログに出す
+ */
+void DumpLockStats(LogLevel level);
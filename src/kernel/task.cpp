@@ -1,25 +1,89 @@
 #include "task.hpp"
 
 #include "asmfunc.h"
-#include "timer.hpp"
 #include "segment.hpp"
+#include "logger.hpp"
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+#include "timer.hpp"
+#include <stdlib.h>  // for exit
 #include <string.h>  // for memset
-#include <algorithm> // for std::find
+#include <algorithm> // for std::clamp
+#include <new>       // for placement new
+
+namespace
+{
+    /** @brief 実行待ちキューのロックの統計に付ける名前 */
+    const char *const kRunQueueLockNames[] = {
+        "run queue 0", "run queue 1", "run queue 2", "run queue 3",
+        "run queue 4", "run queue 5", "run queue 6", "run queue 7",
+        "run queue 8", "run queue 9", "run queue 10", "run queue 11",
+        "run queue 12", "run queue 13", "run queue 14", "run queue 15"};
+    static_assert(sizeof(kRunQueueLockNames) / sizeof(kRunQueueLockNames[0]) == kMaxCPUs);
+
+    /**
+     * @brief 新しいタスクが最初に実行する関数
+     *
+     * 切り替え元が取った実行待ちキューのロックを外し、割り込みを許可してからfuncを呼ぶ。
+     */
+    void TaskEntry(uint64_t id, int64_t data, TaskFunc *func)
+    {
+        task_manager->FinishSwitch();
+        __asm__("sti");
+        func(id, data);
+        task_manager->Exit();
+    }
+
+    /**
+     * @brief 終わったタスクを片付ける役のタスク
+     */
+    void TaskReaper(uint64_t task_id, int64_t data)
+    {
+        task_manager->Reap();
+    }
+} // namespace
 
-Task::Task(uint64_t id) : id_{id}
+Task::Task(uint64_t id) : id_{id}, pml4_{KernelPML4()}
 {
 }
 
-Task &Task::InitContext(TaskFunc *func, int64_t data)
+Task::~Task()
 {
-    // std::vector<uint64_t> task_b_stack(1024); //64[bit]*1024/8[bit/byte]=8192[byte]=8[kbyte]
-    const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]);
-    stack_.resize(stack_size);
-    uint64_t stack_end = reinterpret_cast<uint64_t>(&stack_[stack_size]);
+    if (pml4_ != KernelPML4())
+    {
+        FreeAddressSpace(pml4_);
+    }
+    FreeTaskStack(stack_);
+}
+
+Task &Task::InitContext(TaskFunc *func, int64_t data, size_t stack_bytes)
+{
+    FreeTaskStack(stack_);
+    const auto stack = AllocateTaskStack(stack_bytes);
+    if (stack.error)
+    {
+        Log(kError, "task %lu: failed to allocate a stack: %s\n", id_, stack.error.Name());
+        exit(1);
+    }
+    stack_ = stack.value;
+    uint64_t stack_end = stack_.End();
+
+    if (pml4_ == KernelPML4())
+    {
+        if (auto pml4 = NewAddressSpace())
+        {
+            pml4_ = pml4;
+        }
+        else
+        {
+            Log(kWarn, "task %lu: failed to create an address space\n", id_);
+        }
+    }
 
     memset(&context_, 0, sizeof(context_)); // コンテキストを0初期化
-    context_.cr3 = GetCR3();                // CR3にはPML4テーブルのアドレスが設定されている。→タスクB実行中も同じPML4テーブルを参照することになる。
-    context_.rflags = 0x202;                // 割り込み許可のフラグみかん本315p
+    // CR3に書き込む値（PCIDを含む）は切り替えるときにSwitchTaskが設定する
+    context_.cr3 = reinterpret_cast<uint64_t>(pml4_);
+    context_.rflags = 0x2;                  // 割り込みはTaskEntryがロックを外してから許可する（みかん本315pでは0x202）
     context_.cs = kKernelCS;                // メインタスクと同じCS
     context_.ss = kKernelSS;                // 同じSS
 
@@ -28,17 +92,19 @@ Task &Task::InitContext(TaskFunc *func, int64_t data)
     // みかん本のコラム13.1
     context_.rsp = (stack_end & ~0xflu) - 8;
 
-    context_.rip = reinterpret_cast<uint64_t>(func); // RIPにTaskで実行する関数の先頭アドレス
-    context_.rdi = id_;                              // 第1引数
-    context_.rsi = data;                             // 第2引数
+    context_.rip = reinterpret_cast<uint64_t>(TaskEntry); // TaskEntryを経由してfuncを呼ぶ
+    context_.rdi = id_;                                   // 第1引数
+    context_.rsi = data;                                  // 第2引数
+    context_.rdx = reinterpret_cast<uint64_t>(func);      // 第3引数
 
     // MXCSRのすべての例外をマスクする みかん本315p
-    *reinterpret_cast<uint32_t *>(&context_.fxsave_area[24]) = 0x1f80;
+    *reinterpret_cast<uint32_t *>(&context_.fpu_area[24]) = 0x1f80;
 
     return *this;
 }
 
 TaskContext &Task::Context() { return context_; }
+PageMapEntry *Task::PML4() const { return pml4_; }
 uint64_t Task::ID() const { return id_; }
 Task &Task::Sleep()
 {
@@ -50,6 +116,176 @@ Task &Task::Wakeup()
     task_manager->Wakeup(this);
     return *this;
 }
+int Task::Priority() const { return priority_; }
+TaskState Task::State() const { return state_; }
+int Task::CPU() const { return cpu_; }
+
+void Task::Exit()
+{
+    task_manager->Exit();
+}
+
+Error Task::SendMessage(const Message &msg)
+{
+    return DeliverMessage(id_, msg);
+}
+
+Error Task::DeliverMessage(uint64_t id, const Message &msg)
+{
+    {
+        SpinLockGuard guard{messages_lock_};
+        if (id_ != id)
+        {
+            return MAKE_ERROR(Error::kNoSuchTask);
+        }
+        if (auto err = messages_.Push(msg))
+        {
+            return err;
+        }
+    }
+    task_manager->Wakeup(this);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Message Task::ReceiveMessage()
+{
+    while (true)
+    {
+        {
+            SpinLockGuard guard{messages_lock_};
+            if (messages_.Count() > 0)
+            {
+                const auto msg = messages_.Front();
+                messages_.Pop();
+                return msg;
+            }
+        }
+        // 空だと分かってから眠るまでの間にメッセージが届いても、そのWakeupが記録されているので眠らずに戻ってくる
+        task_manager->Sleep(this);
+    }
+}
+
+Task &Task::SetPriority(int priority)
+{
+    task_manager->SetPriority(this, priority);
+    return *this;
+}
+
+int TaskStats::WaitBucket(uint64_t wait)
+{
+    if (wait == 0)
+    {
+        return 0;
+    }
+    return std::min(kWaitBuckets - 1, 64 - __builtin_clzll(wait));
+}
+
+uint64_t TaskStats::WaitPercentile(int permille) const
+{
+    uint64_t total = 0;
+    for (const auto count : wait_histogram)
+    {
+        total += count;
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    uint64_t count = 0;
+    for (int i = 0; i < kWaitBuckets; ++i)
+    {
+        count += wait_histogram[i];
+        if (count * 1000 >= total * permille)
+        {
+            return i == 0 ? 0 : 1ull << i;
+        }
+    }
+    return 1ull << (kWaitBuckets - 1);
+}
+
+void TaskQueue::PushBack(Task *task)
+{
+    task->prev_ = tail_;
+    task->next_ = nullptr;
+    if (tail_)
+    {
+        tail_->next_ = task;
+    }
+    else
+    {
+        head_ = task;
+    }
+    tail_ = task;
+}
+
+void TaskQueue::PushFront(Task *task)
+{
+    task->prev_ = nullptr;
+    task->next_ = head_;
+    if (head_)
+    {
+        head_->prev_ = task;
+    }
+    else
+    {
+        tail_ = task;
+    }
+    head_ = task;
+}
+
+void TaskQueue::Remove(Task *task)
+{
+    if (task->prev_)
+    {
+        task->prev_->next_ = task->next_;
+    }
+    else
+    {
+        head_ = task->next_;
+    }
+    if (task->next_)
+    {
+        task->next_->prev_ = task->prev_;
+    }
+    else
+    {
+        tail_ = task->prev_;
+    }
+    task->prev_ = task->next_ = nullptr;
+}
+
+void WaitQueue::Push(Task *task)
+{
+    task->wait_next_ = nullptr;
+    task->waiting_ = true;
+    if (tail_)
+    {
+        tail_->wait_next_ = task;
+    }
+    else
+    {
+        head_ = task;
+    }
+    tail_ = task;
+}
+
+Task *WaitQueue::Pop()
+{
+    Task *task = head_;
+    if (task == nullptr)
+    {
+        return nullptr;
+    }
+    head_ = task->wait_next_;
+    if (head_ == nullptr)
+    {
+        tail_ = nullptr;
+    }
+    task->wait_next_ = nullptr;
+    task->waiting_ = false;
+    return task;
+}
 
 TaskManager::TaskManager()
 {
@@ -57,96 +293,685 @@ TaskManager::TaskManager()
     // 番兵役のタスクはTaskManagerを呼び出したコンテキスト
     // （メイン関数を実行しているコンテキスト）
     // に対応するタスクになる
-    running_.push_back(&NewTask());
+    Task &main_task = NewTask();
+    auto &rq = run_queues_[0];
+    rq.current_priority = main_task.Priority();
+    PushReady(rq, &main_task);
+    main_task.state_ = TaskState::kRunning;
+    main_task.run_start_ = ReadTSC();
+    InitializeFPUOwner(main_task.Context().fpu_area.data());
+
+    RegisterLockStats(tasks_lock_.Stats(), "tasks");
+    RegisterLockStats(rq.lock.Stats(), kRunQueueLockNames[0]);
+
+    reaper_ = &NewTask().InitContext(TaskReaper, 0);
+    Wakeup(reaper_);
 }
 
 Task &TaskManager::NewTask()
 {
-    latest_id_++;
-    return *tasks_.emplace_back(new Task{latest_id_});
+    SpinLockGuard guard{tasks_lock_};
+    Task *task = free_tasks_.Front();
+    if (task)
+    {
+        // Recycleで作り直してあるので、新しいIDを付けるだけでよい
+        free_tasks_.Remove(task);
+        task->id_ += 1ull << kTaskSlotBits;
+        task->exited_ = false;
+    }
+    else
+    {
+        task = tasks_.emplace_back(new Task{tasks_.size() + 1}).get();
+    }
+    task->cpu_ = CurrentCPU();
+    return *task;
 }
 
 void TaskManager::SwitchTask(bool current_sleep /*=false*/)
 {
-    Task *current_task = running_.front();
-    running_.pop_front();
-    if (!current_sleep)
+    InterruptGuard guard;
+    auto &rq = CurrentRunQueue();
+    rq.lock.Lock();
+    SwitchTaskLocked(rq, current_sleep);
+}
+
+void TaskManager::Sleep(Task *task)
+{
+    InterruptGuard guard;
+    auto &rq = LockRunQueueOf(task);
+    if (task->state_ == TaskState::kRunning)
     {
-        running_.push_back(current_task);
+        if (&rq != &CurrentRunQueue())
+        {
+            // 他のCPUで実行中なので、そのCPUで切り替えるときに眠らせる
+            task->sleep_pending_ = true;
+            RescheduleAndUnlock(rq, false);
+            return;
+        }
+        if (task->wakeup_pending_)
+        {
+            task->wakeup_pending_ = false;
+            rq.lock.Unlock();
+            return;
+        }
+        SwitchTaskLocked(rq, true);
+        return;
     }
-    Task *next_task = running_.front();
+    task->wakeup_pending_ = false;
+    RemoveReady(rq, task);
+    rq.lock.Unlock();
+}
 
-    SwitchContext(&next_task->Context(), &current_task->Context());
+Error TaskManager::Sleep(uint64_t id)
+{
+    auto task = FindTask(id);
+    if (task == nullptr)
+    {
+        return MAKE_ERROR(Error::kNoSuchTask);
+    }
+
+    Sleep(task);
+    Unpin(task);
+    return MAKE_ERROR(Error::kSuccess);
 }
 
-void TaskManager::Sleep(Task *task)
+void TaskManager::Wakeup(Task *task)
 {
-    auto it = std::find(running_.begin(), running_.end(), task);
-    if (it == running_.begin())
+    InterruptGuard guard;
+    auto &rq = LockRunQueueOf(task);
+    if (task->exited_)
+    {
+        rq.lock.Unlock();
+        return;
+    }
+    if (task->state_ != TaskState::kSleeping)
     {
-        SwitchTask(true);
+        if (task->sleep_pending_)
+        {
+            // まだ眠っていないので、眠らせるのを取りやめる
+            task->sleep_pending_ = false;
+        }
+        else
+        {
+            // 眠ろうとしている途中かもしれないので、次のSleepで眠らずに戻らせる
+            task->wakeup_pending_ = true;
+        }
+        rq.lock.Unlock();
         return;
     }
+    task->ready_since_ = ReadTSC();
+    PushReady(rq, task);
+    if (task->Priority() > rq.current_priority)
+    {
+        RescheduleAndUnlock(rq, guard.WasEnabled());
+        return;
+    }
+    const int cpu = CPUOf(rq);
+    rq.lock.Unlock();
+    KickIdleCPU(cpu);
+}
+
+Error TaskManager::Wakeup(uint64_t id)
+{
+    auto task = FindTask(id);
+    if (task == nullptr)
+    {
+        return MAKE_ERROR(Error::kNoSuchTask);
+    }
+
+    Wakeup(task);
+    Unpin(task);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void TaskManager::SetPriority(Task *task, int priority)
+{
+    priority = std::clamp(priority, 0, Task::kMaxPriority);
 
-    if (it == running_.end())
+    InterruptGuard guard;
+    auto &rq = LockRunQueueOf(task);
+    if (task->priority_ == priority)
     {
+        rq.lock.Unlock();
         return;
     }
 
-    running_.erase(it);
+    if (task->state_ == TaskState::kRunning)
+    {
+        // 実行中のタスクは移った先のキューでも先頭に置く
+        RemoveReady(rq, task);
+        task->priority_ = priority;
+        PushReady(rq, task, true);
+        task->state_ = TaskState::kRunning;
+        rq.current_priority = priority;
+        if (rq.HighestReadyPriority() > priority)
+        {
+            RescheduleAndUnlock(rq, guard.WasEnabled());
+            return;
+        }
+        rq.lock.Unlock();
+        return;
+    }
+
+    const bool ready = RemoveReady(rq, task);
+    task->priority_ = priority;
+    if (!ready)
+    {
+        rq.lock.Unlock();
+        return;
+    }
+    PushReady(rq, task);
+    if (priority > rq.current_priority)
+    {
+        RescheduleAndUnlock(rq, guard.WasEnabled());
+        return;
+    }
+    rq.lock.Unlock();
 }
 
-Error TaskManager::Sleep(uint64_t id)
+void TaskManager::Block(WaitQueue &queue, SpinLock &lock)
 {
-    auto it = std::find_if(
-        tasks_.begin(),
-        tasks_.end(),
-        [id](const auto &t)
-        { return t->ID() == id; });
+    Task *task = &CurrentTask();
+    queue.Push(task);
+    // 取り出した側が起こす前に目覚めることがあるので、取り出されたことを確かめるまで眠り直す
+    do
+    {
+        lock.Unlock();
+        Sleep(task);
+        lock.Lock();
+    } while (task->waiting_);
+}
 
-    if (it == tasks_.end())
+Error TaskManager::SendMessage(uint64_t id, const Message &msg)
+{
+    auto task = FindTask(id);
+    if (task == nullptr)
     {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
+    const auto err = task->DeliverMessage(id, msg);
+    Unpin(task);
+    return err;
+}
 
-    Sleep(it->get());
-    return MAKE_ERROR(Error::kSuccess);
+void TaskManager::SwitchTaskIfPreempted()
+{
+    InterruptGuard guard;
+    auto &rq = CurrentRunQueue();
+    rq.lock.Lock();
+    if (rq.preempt_pending)
+    {
+        SwitchTaskLocked(rq, false);
+        return;
+    }
+    rq.lock.Unlock();
 }
 
-void TaskManager::Wakeup(Task *task)
+Task &TaskManager::CurrentTask()
+{
+    InterruptGuard guard;
+    auto &rq = CurrentRunQueue();
+    SpinLockGuard rq_guard{rq.lock};
+    return rq.Current();
+}
+
+Task &TaskManager::MainTask()
 {
-    auto it = std::find(running_.begin(), running_.end(), task);
-    if (it == running_.end())
+    SpinLockGuard guard{tasks_lock_};
+    return *tasks_.front();
+}
+
+WithError<TaskStats> TaskManager::Stats(uint64_t id)
+{
+    auto task = FindTask(id);
+    if (task == nullptr)
     {
-        running_.push_back(task);
+        return {{}, MAKE_ERROR(Error::kNoSuchTask)};
     }
+    const auto stats = Snapshot(task).stats;
+    Unpin(task);
+    return {stats, MAKE_ERROR(Error::kSuccess)};
 }
 
-Error TaskManager::Wakeup(uint64_t id)
+std::vector<TaskStatsEntry> TaskManager::CollectStats()
 {
-    auto it = std::find_if(
-        tasks_.begin(),
-        tasks_.end(),
-        [id](const auto &t)
-        { return t->ID() == id; });
+    std::vector<Task *> tasks;
+    {
+        SpinLockGuard guard{tasks_lock_};
+        tasks.reserve(tasks_.size());
+        for (auto &task : tasks_)
+        {
+            if (!task->exited_)
+            {
+                tasks.push_back(task.get());
+            }
+        }
+    }
 
-    if (it == tasks_.end())
+    std::vector<TaskStatsEntry> entries;
+    entries.reserve(tasks.size());
+    for (auto task : tasks)
     {
-        return MAKE_ERROR(Error::kNoSuchTask);
+        entries.push_back(Snapshot(task));
     }
+    return entries;
+}
 
-    Wakeup(it->get());
-    return MAKE_ERROR(Error::kSuccess);
+void TaskManager::Exit()
+{
+    // 割り込みは二度と許可しない。眠った後でこのコンテキストに戻ることは無い
+    __asm__("cli");
+    auto &rq = CurrentRunQueue();
+    rq.lock.Lock();
+    Task *task = &rq.Current();
+    task->exited_ = true;
+    rq.lock.Unlock();
+
+    {
+        SpinLockGuard guard{zombies_lock_};
+        zombies_.Push(task);
+    }
+    Wakeup(reaper_);
+    while (true)
+    {
+        // 前にWakeupされていた分で戻ってきても、もう起こされることは無いので眠り直す
+        Sleep(task);
+    }
+}
+
+void TaskManager::Reap()
+{
+    while (true)
+    {
+        Task *task;
+        {
+            SpinLockGuard guard{zombies_lock_};
+            task = zombies_.Pop();
+        }
+        if (task == nullptr)
+        {
+            // 調べてから眠るまでの間にExitしたタスクのWakeupは記録されているので、眠らずに戻ってくる
+            Sleep(reaper_);
+            continue;
+        }
+
+        // 他のCPUで切り替えている途中なら、終わるまで譲る
+        while (!HasSwitchedOut(task))
+        {
+            SwitchTask();
+        }
+        // FindTaskで見つけた側が使い終わるまで待つ。最後に放した側が起こす
+        while (IsPinned(task))
+        {
+            Sleep(reaper_);
+        }
+        Recycle(task);
+    }
+}
+
+Task &TaskManager::StartCPU(int cpu, const TaskStack &stack)
+{
+    Task &task = NewTask();
+    task.stack_ = stack;
+    task.priority_ = 0;
+    task.cpu_ = cpu;
+
+    auto &rq = run_queues_[cpu];
+    {
+        SpinLockGuard guard{rq.lock};
+        rq.current_priority = 0;
+        PushReady(rq, &task);
+        task.state_ = TaskState::kRunning;
+        task.run_start_ = ReadTSC();
+    }
+    InitializeFPUOwner(task.Context().fpu_area.data());
+    RegisterLockStats(rq.lock.Stats(), kRunQueueLockNames[cpu]);
+    return task;
+}
+
+bool TaskManager::StealTask()
+{
+    InterruptGuard guard;
+    const int cpu = CurrentCPU();
+    auto &my_rq = run_queues_[cpu];
+    const int num_cpus = NumCPUs();
+    for (int i = 1; i < num_cpus; ++i)
+    {
+        const int victim = (cpu + i) % num_cpus;
+        auto &rq = run_queues_[victim];
+        // デッドロックしないように、番号の小さいCPUのキューからロックを取る
+        if (victim < cpu)
+        {
+            rq.lock.Lock();
+            my_rq.lock.Lock();
+        }
+        else
+        {
+            my_rq.lock.Lock();
+            rq.lock.Lock();
+        }
+
+        Task *task = FindStealableTask(rq);
+        if (task)
+        {
+            RemoveReady(rq, task);
+            task->cpu_ = cpu;
+            PushReady(my_rq, task);
+        }
+        rq.lock.Unlock();
+
+        if (task == nullptr)
+        {
+            my_rq.lock.Unlock();
+            continue;
+        }
+        if (task->Priority() > my_rq.current_priority)
+        {
+            SwitchTaskLocked(my_rq, false);
+        }
+        else
+        {
+            my_rq.lock.Unlock();
+        }
+        return true;
+    }
+    return false;
+}
+
+void TaskManager::Idle()
+{
+    const uint32_t bit = 1u << CurrentCPU();
+    while (true)
+    {
+        // 他のCPUで順番を待っているタスクを盗み、無ければゼロクリア済みフレームを作り溜めておく
+        if (StealTask() || RefillZeroedFramePool())
+        {
+            continue;
+        }
+
+        // 休む印を付けてから盗めるタスクを調べ直すので、その間に積まれたタスクのIPIを取りこぼさない
+        __asm__("cli");
+        idle_cpus_.fetch_or(bit);
+        if (StealTask())
+        {
+            idle_cpus_.fetch_and(~bit);
+            __asm__("sti");
+            continue;
+        }
+        // ティックレスなら次のタイマの時刻まで割り込まないようにしてから休む。
+        // stiの直後の1命令の間は割り込まないので、設定してからhltするまでの間に割り込みを取りこぼさない
+        timer_manager->ArmIdleDeadline();
+        __asm__("sti\n\thlt");
+        idle_cpus_.fetch_and(~bit);
+    }
+}
+
+void TaskManager::FinishSwitch()
+{
+    CurrentRunQueue().lock.Unlock();
+}
+
+int TaskManager::RunQueue::HighestReadyPriority() const
+{
+    return 31 - __builtin_clz(ready_priorities);
+}
+
+Task &TaskManager::RunQueue::Current() const
+{
+    return *queues[current_priority].Front();
+}
+
+Task *TaskManager::FindTask(uint64_t id)
+{
+    SpinLockGuard guard{tasks_lock_};
+    const auto slot = id & ((1ull << kTaskSlotBits) - 1);
+    if (slot == 0 || slot > tasks_.size())
+    {
+        return nullptr;
+    }
+    Task *task = tasks_[slot - 1].get();
+    if (task->id_ != id || task->exited_)
+    {
+        return nullptr;
+    }
+    ++task->pins_;
+    return task;
+}
+
+void TaskManager::Unpin(Task *task)
+{
+    bool wake_reaper;
+    {
+        SpinLockGuard guard{tasks_lock_};
+        wake_reaper = --task->pins_ == 0 && task->exited_;
+    }
+    if (wake_reaper)
+    {
+        Wakeup(reaper_);
+    }
+}
+
+bool TaskManager::IsPinned(Task *task)
+{
+    // exited_を立てた後は、tasks_lock_を取って調べればFindTaskが新たに留めることは無い
+    SpinLockGuard guard{tasks_lock_};
+    return task->pins_ > 0;
+}
+
+TaskManager::RunQueue &TaskManager::CurrentRunQueue()
+{
+    return run_queues_[CurrentCPU()];
+}
+
+int TaskManager::CPUOf(const RunQueue &rq) const
+{
+    return &rq - run_queues_.data();
+}
+
+TaskManager::RunQueue &TaskManager::LockRunQueueOf(Task *task)
+{
+    while (true)
+    {
+        auto &rq = run_queues_[__atomic_load_n(&task->cpu_, __ATOMIC_RELAXED)];
+        rq.lock.Lock();
+        if (&rq == &run_queues_[task->cpu_])
+        {
+            return rq;
+        }
+        // ロックを取る前に盗まれて他のCPUへ移った
+        rq.lock.Unlock();
+    }
+}
+
+void TaskManager::SwitchTaskLocked(RunQueue &rq, bool current_sleep)
+{
+    rq.preempt_pending = false;
+
+    Task *current_task = &rq.Current();
+    if (current_task->sleep_pending_)
+    {
+        current_task->sleep_pending_ = false;
+        current_sleep = true;
+    }
+    RemoveReady(rq, current_task);
+    if (!current_sleep)
+    {
+        PushReady(rq, current_task);
+    }
+    rq.current_priority = rq.HighestReadyPriority();
+    Task *next_task = rq.queues[rq.current_priority].Front();
+    next_task->state_ = TaskState::kRunning;
+    if (next_task == current_task)
+    {
+        rq.lock.Unlock();
+        return;
+    }
+
+    const auto now = ReadTSC();
+    current_task->stats_.runtime += now - current_task->run_start_;
+    if (current_sleep)
+    {
+        ++current_task->stats_.voluntary;
+    }
+    else
+    {
+        ++current_task->stats_.preempted;
+        current_task->ready_since_ = now;
+    }
+    const auto wait = now - next_task->ready_since_;
+    ++next_task->stats_.switches;
+    ++next_task->stats_.wait_histogram[TaskStats::WaitBucket(wait)];
+    next_task->stats_.wait_max = std::max(next_task->stats_.wait_max, wait);
+    next_task->run_start_ = now;
+
+    if (!current_sleep && current_task->Priority() > 0 && idle_cpus_.load() != 0)
+    {
+        // アイドル中のCPUが盗んで実行できるように、FPUの状態を保存しておく
+        ReleaseFPUState(current_task->Context().fpu_area.data());
+    }
+    // 同じアドレス空間ならCR3を書き込まず、違えばPCIDでTLBを残せるか判断した値にする
+    next_task->Context().cr3 = CR3ForSwitch(next_task->PML4());
+    SwitchFPUContext(next_task->Context().fpu_area.data());
+    if (current_task->exited_)
+    {
+        // 終えたタスクの状態は使わない。片付けた後の領域に#NMのハンドラが保存しないよう、載せたこのCPUで外しておく
+        ForgetFPUState(current_task->Context().fpu_area.data());
+    }
+    if (timer_manager)
+    {
+        // アイドルタスクが外したタスク切り替えの時刻を設定し直す
+        timer_manager->LeaveIdle();
+    }
+    // rqのロックはコンテキストを保存し終わるまで持ったままにし、切り替え先で外す。
+    // 外すまでは、他のCPUがcurrent_taskを盗んで保存途中のコンテキストから実行することはない
+    SwitchContext(&next_task->Context(), &current_task->Context());
+    FinishSwitch();
+}
+
+void TaskManager::RescheduleAndUnlock(RunQueue &rq, bool can_switch)
+{
+    if (&rq == &CurrentRunQueue())
+    {
+        if (can_switch)
+        {
+            SwitchTaskLocked(rq, false);
+            return;
+        }
+        rq.preempt_pending = true;
+        rq.lock.Unlock();
+        return;
+    }
+
+    rq.preempt_pending = true;
+    const int cpu = CPUOf(rq);
+    rq.lock.Unlock();
+    SendIPI(cpu, InterruptVector::kRescheduleIPI);
+}
+
+void TaskManager::KickIdleCPU(int cpu)
+{
+    const uint32_t idle = idle_cpus_.load() & ~(1u << cpu) & ~(1u << CurrentCPU());
+    if (idle != 0)
+    {
+        SendIPI(__builtin_ctz(idle), InterruptVector::kRescheduleIPI);
+    }
+}
+
+Task *TaskManager::FindStealableTask(const RunQueue &rq)
+{
+    const int cpu = CPUOf(rq);
+    // 実行中のタスクより優先度の高いタスクは、そのCPUがすぐに実行するので盗まない
+    for (int priority = rq.current_priority; priority > 0; --priority)
+    {
+        for (Task *task = rq.queues[priority].Front(); task; task = task->next_)
+        {
+            if (task->state_ == TaskState::kReady &&
+                !IsFPUStateLoaded(cpu, task->Context().fpu_area.data()))
+            {
+                return task;
+            }
+        }
+    }
+    return nullptr;
+}
+
+bool TaskManager::HasSwitchedOut(Task *task)
+{
+    InterruptGuard guard;
+    // 眠らせるCPUは切り替え終わるまで実行待ちキューのロックを持っているので、取れてkSleepingなら保存し終えている
+    auto &rq = LockRunQueueOf(task);
+    bool switched_out = task->state_ == TaskState::kSleeping;
+    rq.lock.Unlock();
+    // 切り替えたCPUがFPUの持ち主から外してある。他のCPUに載ったままなら、そのCPUの#NMのハンドラが領域に保存しうる
+    for (int cpu = 0; switched_out && cpu < NumCPUs(); ++cpu)
+    {
+        switched_out = !IsFPUStateLoaded(cpu, task->Context().fpu_area.data());
+    }
+    return switched_out;
+}
+
+void TaskManager::Recycle(Task *task)
+{
+    // デストラクタがアドレス空間を返し、スタックをプールに戻す（FPUの持ち主からは切り替えたCPUが外してある）。
+    // 領域はtasks_が持ったままなので、作り直してNewTaskで再利用する
+    const auto id = task->id_;
+    task->~Task();
+    new (task) Task{id};
+    task->exited_ = true;
+
+    SpinLockGuard guard{tasks_lock_};
+    free_tasks_.PushBack(task);
+}
+
+TaskStatsEntry TaskManager::Snapshot(Task *task)
+{
+    InterruptGuard guard;
+    auto &rq = LockRunQueueOf(task);
+    TaskStatsEntry entry{task->id_, task->priority_, task->state_, task->cpu_, task->stats_};
+    if (task->state_ == TaskState::kRunning)
+    {
+        entry.stats.runtime += ReadTSC() - task->run_start_;
+    }
+    rq.lock.Unlock();
+    return entry;
+}
+
+void TaskManager::PushReady(RunQueue &rq, Task *task, bool front)
+{
+    auto &queue = rq.queues[task->Priority()];
+    if (front)
+    {
+        queue.PushFront(task);
+    }
+    else
+    {
+        queue.PushBack(task);
+    }
+    task->state_ = TaskState::kReady;
+    rq.ready_priorities |= 1u << task->Priority();
+}
+
+bool TaskManager::RemoveReady(RunQueue &rq, Task *task)
+{
+    if (task->state_ == TaskState::kSleeping)
+    {
+        return false;
+    }
+    auto &queue = rq.queues[task->Priority()];
+    queue.Remove(task);
+    task->state_ = TaskState::kSleeping;
+    if (queue.Empty())
+    {
+        rq.ready_priorities &= ~(1u << task->Priority());
+    }
+    return true;
 }
 
 TaskManager *task_manager;
 
 void InitializeTask()
 {
+    // スタックの範囲は全てのタスクのアドレス空間で共有するので、アドレス空間を作る前に用意する
+    InitializeTaskStacks();
     task_manager = new TaskManager;
-
-    __asm__("cli");
-    timer_manager->AddTimer(
-        Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue});
-    __asm__("sti");
 }
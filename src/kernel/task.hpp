@@ -1,13 +1,20 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <vector>
 #include <memory> // unique_ptr
-#include <deque>
 
 #include "error.hpp"
+#include "fpu.hpp"
+#include "message.hpp"
+#include "queue.hpp"
+#include "paging.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+#include "task_stack.hpp"
 
 /**
  * @brief タスクのコンテキストを保存するための構造体
@@ -19,50 +26,418 @@ struct TaskContext
     uint64_t cs, ss, fs, gs;                         // offset 0x20
     uint64_t rax, rbx, rcx, rdx, rdi, rsi, rsp, rbp; // offset 0x40
     uint64_t r8, r9, r10, r11, r12, r13, r14, r15;   // offset 0x80
-    std::array<uint8_t, 512> fxsave_area;            // offset 0xc0
+    std::array<uint8_t, kFPUStateBytes> fpu_area;    // offset 0xc0 SwitchContextでは切り替えない（fpu.hpp）
 } __attribute__((packed));
 
 using TaskFunc = void(uint64_t, int64_t);
 
+/**
+ * @brief タスクの状態
+ *
+ */
+enum class TaskState
+{
+    kSleeping, // 実行待ちキューにいない
+    kReady,    // 実行待ちキューにいる
+    kRunning,  // 実行中（実行しているCPUの実行待ちキューの先頭にいる）
+};
+
+/**
+ * @brief タスクのCPU時間と切り替えの統計。時間はTSCのカウント数
+ *
+ * 切り替えのたびにSwitchTaskがTSCを読んで更新する。
+ */
+struct TaskStats
+{
+    /** @brief 実行待ち時間のヒストグラムの段数 */
+    static const int kWaitBuckets = 32;
+
+    /** @brief 実行していた時間の合計 */
+    uint64_t runtime{0};
+    /** @brief 実行を始めた（切り替えられてきた）回数 */
+    uint64_t switches{0};
+    /** @brief 自分から眠って切り替えた回数 */
+    uint64_t voluntary{0};
+    /** @brief 実行可能なまま（タイマや横取りで）切り替えられた回数 */
+    uint64_t preempted{0};
+    /** @brief 実行可能になってから実行を始めるまでの時間の最大値 */
+    uint64_t wait_max{0};
+    /**
+     * @brief 実行可能になってから実行を始めるまでの時間のヒストグラム
+     *
+     * i段目（i >= 1）は2^(i-1)以上2^i未満、0段目は0、最後の段はそれ以上の全ての待ち時間を数える。
+     */
+    std::array<uint32_t, kWaitBuckets> wait_histogram{};
+
+    /** @brief 待ち時間waitを数える段 */
+    static int WaitBucket(uint64_t wait);
+    /** @brief 待ち時間の小さい方から数えて割合permille（0〜1000）に達する段の上限（2^i）。1度も待っていなければ0 */
+    uint64_t WaitPercentile(int permille) const;
+};
+
 class Task
 {
 public:
-    static const size_t kDefaultStackBytes = 4096;
+    /** @brief printkやLogは1KiBのバッファをスタックに置くので、余裕を持たせる */
+    static const size_t kDefaultStackBytes = 16 * 1024;
+    /** @brief タスクごとのメッセージキューに溜められるメッセージ数 */
+    static const size_t kMessageQueueCapacity = 32;
+    /** @brief 優先度の最大値。優先度は0からkMaxPriorityまでで、大きいほど優先して実行する */
+    static constexpr int kMaxPriority = 3;
+    static constexpr int kDefaultPriority = 1;
 
     Task(uint64_t id);
-    Task &InitContext(TaskFunc *func, int64_t data);
+    ~Task();
+    /**
+     * @brief タスクのアドレス空間を作り、funcから実行を始めるようにコンテキストを設定する
+     *
+     * アドレス空間はカーネルの写像を共有し、kPrivateSpaceBaseから後ろはタスク専用になる。
+     * 作れなかった場合はカーネルのアドレス空間で動かす。
+     * スタックはガードページ付きでAllocateTaskStackから確保する。
+     *
+     * @param stack_bytes スタックの大きさ。ページの大きさに切り上げる
+     */
+    Task &InitContext(TaskFunc *func, int64_t data, size_t stack_bytes = kDefaultStackBytes);
     TaskContext &Context();
+    /** @brief タスクのアドレス空間（PML4テーブル） */
+    PageMapEntry *PML4() const;
     uint64_t ID() const;
     Task &Sleep();
     Task &Wakeup();
+    int Priority() const;
+    /**
+     * @brief 優先度を変える
+     *
+     * 実行可能なタスクで、変えた結果より優先度の高いタスクが実行を待つことになればすぐに切り替える。
+     *
+     * @param priority 0からkMaxPriorityまでに丸める
+     */
+    Task &SetPriority(int priority);
+    TaskState State() const;
+    /**
+     * @brief タスクを終える。実行中のタスク自身が呼び、戻らない
+     *
+     * スタックとアドレス空間は、切り替え終わった後で片付け役のタスクがプールに戻す（TaskManager::Exit）。
+     * InitContextで渡した関数から戻った場合も終える。
+     */
+    [[noreturn]] void Exit();
+    /** @brief 実行待ちキューがあるCPU（最後に実行した、または次に実行するCPU）の番号 */
+    int CPU() const;
+
+    /**
+     * @brief メッセージをキューに積み、タスクが眠っていれば起こす
+     *
+     * 割り込みハンドラや他のCPUからも呼べる。起こしたタスクの方が優先度が高ければ横取りする（TaskManager::Wakeup）。
+     *
+     * @param msg
+     * @return Error キューが一杯ならkFull（メッセージは捨てる）
+     */
+    Error SendMessage(const Message &msg);
+
+    /**
+     * @brief メッセージを1つ取り出す。キューが空なら届くまで眠る
+     *
+     * 実行中のタスク自身が呼ぶ。
+     *
+     * @return Message
+     */
+    Message ReceiveMessage();
 
 private:
+    friend class TaskManager;
+    friend class TaskQueue;
+    friend class WaitQueue;
+
     uint64_t id_;
-    std::vector<uint64_t> stack_;
-    alignas(16) TaskContext context_;
+    int priority_{kDefaultPriority};
+    TaskState state_{TaskState::kSleeping};
+    /** @brief 実行待ちキューがあるCPU。変えるのはそのCPUの実行待ちキューのロックを取っている間だけ */
+    int cpu_{0};
+    /** @brief 眠っていない間にWakeupされた。次のSleepは眠らずに戻る */
+    bool wakeup_pending_{false};
+    /** @brief 他のCPUで実行中にSleepされた。そのCPUで次に切り替えるときに眠らせる */
+    bool sleep_pending_{false};
+    /** @brief Exitした、または片付けてNewTaskで再利用するのを待っている。Wakeupしても起きない */
+    bool exited_{false};
+    /** @brief FindTaskで見つけて使っている数。0になるまで片付けない。TaskManager::tasks_lock_を取って読み書きする */
+    int pins_{0};
+    /** @brief 統計。実行待ちキューのロックを取って更新する */
+    TaskStats stats_{};
+    /** @brief 実行を始めたときのTSC */
+    uint64_t run_start_{0};
+    /** @brief 実行可能になったときのTSC */
+    uint64_t ready_since_{0};
+    /** @brief 待ち行列（WaitQueue）の次のタスク。実行待ちキューのリンクとは別にする */
+    Task *wait_next_{nullptr};
+    /** @brief 待ち行列に入っている。待ち行列を守るロックを取って読み書きする */
+    bool waiting_{false};
+    /** @brief 実行待ちキューの前後のタスク。キューはTask自身に埋め込んだリンクでつなぐ */
+    Task *prev_{nullptr}, *next_{nullptr};
+    TaskStack stack_;
+    std::array<Message, kMessageQueueCapacity> message_buffer_{};
+    ArrayQueue<Message> messages_{message_buffer_};
+    SpinLock messages_lock_;
+    /** @brief InitContextを呼ぶまでは、InitializeTaskを呼んだコンテキストと同じカーネルのアドレス空間 */
+    PageMapEntry *pml4_;
+
+    /**
+     * @brief IDがidのままならメッセージを積み、タスクが眠っていれば起こす
+     *
+     * @return Error IDが変わっていればkNoSuchTask、キューが一杯ならkFull（どちらもメッセージは捨てる）
+     */
+    Error DeliverMessage(uint64_t id, const Message &msg);
+    /** @brief fpu_areaをxsaveで使えるように64バイト境界に置く。XSAVEヘッダは0で初期化しておく必要がある */
+    alignas(64) TaskContext context_{};
+};
+
+/**
+ * @brief Taskに埋め込んだリンクでつなぐ双方向リスト。追加も削除も定数時間でできる
+ *
+ * 1つのタスクは同時に1つのキューにしか入れない。
+ */
+class TaskQueue
+{
+public:
+    bool Empty() const { return head_ == nullptr; }
+    Task *Front() const { return head_; }
+    void PushBack(Task *task);
+    void PushFront(Task *task);
+    /** @brief このキューに入っているtaskを取り除く */
+    void Remove(Task *task);
+
+private:
+    Task *head_{nullptr}, *tail_{nullptr};
+};
+
+/**
+ * @brief ロックや条件を待って眠っているタスクの待ち行列（先に入ったものから取り出す）
+ *
+ * 待ち行列ごとにSpinLockを1つ決めて、それを取ってから操作する。眠るのはTaskManager::Blockで行い、
+ * 取り出したタスクは呼び出し側がTaskManager::Wakeupで起こす。
+ */
+class WaitQueue
+{
+public:
+    bool Empty() const { return head_ == nullptr; }
+    void Push(Task *task);
+    /** @brief 先頭のタスクを取り出す。空ならnullptr */
+    Task *Pop();
+
+private:
+    Task *head_{nullptr}, *tail_{nullptr};
+};
+
+/**
+ * @brief TaskManager::CollectStatsで集めるタスク1つ分の統計
+ */
+struct TaskStatsEntry
+{
+    uint64_t id;
+    int priority;
+    TaskState state;
+    int cpu;
+    TaskStats stats;
 };
 
+/**
+ * @brief タスクを管理し、CPUごとの実行待ちキューで切り替える
+ *
+ * タスクは実行待ちキューがあるCPU（Task::CPU）で実行する。起こしたタスクは、そのCPUの実行待ちキューに戻す。
+ * やることの無いCPUは、他のCPUの実行待ちキューで順番を待っているタスクを盗んで実行する（StealTask）。
+ * 実行待ちキューはCPUごとのロックで守り、2つ取る場合は番号の小さいCPUのものから取る。
+ */
 class TaskManager
 {
 public:
+    /** @brief タスクIDの下位kTaskSlotBitsビットはtasks_の位置+1、上位ビットはその位置を再利用した回数 */
+    static const int kTaskSlotBits = 32;
+
     TaskManager();
+    /**
+     * @brief タスクを作る。終わったタスクを片付けたものがあれば、ヒープから確保せずに再利用する
+     *
+     * 再利用したタスクには新しいIDを付けるので、終わったタスクのIDでは見つからない。
+     */
     Task &NewTask();
     /**
-     * @brief 
-     * 
-     * @param current_sleep がtrueの場合はSwitchしたあとrunning_キューの末尾に追加しない（Sleep）させる。
+     * @brief 実行中のCPUで、実行可能なタスクのうち最も優先度の高いものに切り替える。同じ優先度のタスクは順番に実行する
+     *
+     * 優先度0のアイドルタスクなど、常にどれかのタスクが実行可能であること。
+     *
+     * @param current_sleep がtrueの場合はSwitchしたあと実行待ちキューの末尾に追加しない（Sleep）させる。
      */
     void SwitchTask(bool current_sleep = false);
 
+    /**
+     * @brief タスクを眠らせる
+     *
+     * 実行中のタスク自身を眠らせる場合、前回眠ってからWakeupされていれば眠らずに戻る。
+     * そのため、条件を調べてから眠るまでの間に起こされても起こし損なわないが、起きた後は条件を調べ直すこと。
+     * 他のCPUで実行中のタスクは、そのCPUにIPIを送って切り替えさせる。
+     */
     void Sleep(Task *task);
     Error Sleep(uint64_t id);
+    /**
+     * @brief タスクを実行可能にする
+     *
+     * タスクのCPUで実行中のタスクより優先度が高ければ横取りする。割り込みが禁止されている場合（割り込みハンドラの中など）は
+     * その場では切り替えず、SwitchTaskIfPreemptedを呼んだときに切り替える。他のCPUならIPIを送って切り替えさせる。
+     * 横取りしない場合は、アイドル中のCPUを起こしてタスクを盗ませる。
+     *
+     * @param task
+     */
     void Wakeup(Task *task);
     Error Wakeup(uint64_t id);
+    void SetPriority(Task *task, int priority);
+    /**
+     * @brief 実行中のタスクをqueueの末尾に入れ、WaitQueue::Popで取り出されるまで眠る
+     *
+     * queueを守るlockを取り、割り込みを禁止した状態で呼ぶ。眠る間はlockを外し、戻るときには取り直している。
+     * 割り込みハンドラからは呼ばない。
+     */
+    void Block(WaitQueue &queue, SpinLock &lock);
+
+    /**
+     * @brief IDがidのタスクにメッセージを送る（Task::SendMessage）
+     *
+     * @return Error タスクが無ければkNoSuchTask、キューが一杯ならkFull
+     */
+    Error SendMessage(uint64_t id, const Message &msg);
+
+    /**
+     * @brief Wakeupなどで横取りが保留されていれば切り替える。割り込みハンドラの最後（EOIの後）に呼ぶ
+     */
+    void SwitchTaskIfPreempted();
+
+    /** @brief 実行中のCPUで実行中のタスク */
+    Task &CurrentTask();
+    /** @brief 番兵役のタスク。TaskManagerを作ったコンテキスト（KernelMainNewStack）に対応する */
+    Task &MainTask();
+
+    /**
+     * @brief IDがidのタスクの統計。実行中ならruntimeには今実行している分も含める
+     *
+     * @return WithError<TaskStats> タスクが無ければkNoSuchTask
+     */
+    WithError<TaskStats> Stats(uint64_t id);
+    /** @brief 終わっていない全てのタスクの統計をtasks_の順に集める */
+    std::vector<TaskStatsEntry> CollectStats();
+
+    /**
+     * @brief 実行中のタスクを終える。戻らない
+     *
+     * タスクは自分のスタックの上にいるので自分では片付けられない。Wakeupで起きないようにしてから片付け役のタスクに渡して眠る。
+     */
+    [[noreturn]] void Exit();
+    /**
+     * @brief 片付け役のタスクの本体。Exitしたタスクが切り替え終わるのを待ち、スタックとアドレス空間をプールに戻して
+     * Taskを再利用できるようにする。片付けるものが無ければ眠る
+     */
+    [[noreturn]] void Reap();
+
+    /**
+     * @brief APを起動したコンテキストを、そのCPUの優先度0のアイドルタスクにする
+     *
+     * @param cpu 実行中のCPUの番号
+     * @param stack 起動したコンテキストが使っているスタック
+     * @return Task& 作ったタスク。この後Idleを呼ぶ
+     */
+    Task &StartCPU(int cpu, const TaskStack &stack);
+
+    /**
+     * @brief 他のCPUの実行待ちキューで順番を待っているタスクを1つ、実行中のCPUに移して切り替える
+     *
+     * 優先度0のタスクと、FPUの状態がそのCPUに載ったままのタスクは移さない。
+     *
+     * @return true タスクを移した（実行して戻ってきた）
+     */
+    bool StealTask();
+
+    /**
+     * @brief アイドルタスクの本体。タスクを盗むか、ゼロクリア済みフレームを補充し、することが無ければhltで休む
+     */
+    [[noreturn]] void Idle();
+
+    /**
+     * @brief SwitchTaskで切り替え元が取った実行待ちキューのロックを、切り替え先で外す
+     *
+     * 初めて実行するタスクは、SwitchTaskの途中ではなくタスクの入り口から始まるので、そこで呼ぶ。
+     */
+    void FinishSwitch();
 
 private:
+    /** @brief CPUごとの実行待ちキュー */
+    struct RunQueue
+    {
+        /** @brief このCPUのキューと、キューにいるタスクの状態を守る */
+        SpinLock lock;
+        /** @brief 優先度ごとの実行待ちキュー。実行中のタスクはqueues[current_priority]の先頭にいる */
+        std::array<TaskQueue, Task::kMaxPriority + 1> queues{};
+        /** @brief 空でない実行待ちキューの優先度のビットを立てたもの。最も優先度の高いキューをすぐ見つけるために使う */
+        uint32_t ready_priorities{0};
+        int current_priority{Task::kDefaultPriority};
+        /** @brief 割り込み禁止中に、より優先度の高いタスクが実行可能になった */
+        bool preempt_pending{false};
+
+        int HighestReadyPriority() const;
+        Task &Current() const;
+    };
+
+    /** @brief tasks_とfree_tasks_を守る */
+    SpinLock tasks_lock_;
+    /** @brief IDの下位kTaskSlotBitsビットがiのタスクはtasks_[i - 1]にある */
     std::vector<std::unique_ptr<Task>> tasks_{};
-    uint64_t latest_id_{0};
-    std::deque<Task *> running_{};
+    /** @brief 片付け終わり、NewTaskで再利用できるタスク */
+    TaskQueue free_tasks_{};
+    /** @brief zombies_を守る */
+    SpinLock zombies_lock_;
+    /** @brief Exitして片付けを待っているタスク */
+    WaitQueue zombies_{};
+    /** @brief 片付け役のタスク */
+    Task *reaper_{nullptr};
+    std::array<RunQueue, kMaxCPUs> run_queues_{};
+    /** @brief アイドルタスクがhltで休んでいるCPUのビットを立てたもの */
+    std::atomic<uint32_t> idle_cpus_{0};
+
+    /**
+     * @brief IDからタスクを探し、片付けられないように留める。見つからなければnullptr
+     *
+     * 使い終わったらUnpinを呼ぶ。留めている間はRecycleされないので、IDも変わらない。
+     */
+    Task *FindTask(uint64_t id);
+    /** @brief FindTaskで留めたタスクを放す。Exitしたタスクを最後に放したら片付け役のタスクを起こす */
+    void Unpin(Task *task);
+    /** @brief FindTaskで留めているタスクがいるか */
+    bool IsPinned(Task *task);
+    RunQueue &CurrentRunQueue();
+    int CPUOf(const RunQueue &rq) const;
+    /** @brief taskの実行待ちキューのロックを取って返す。ロックを取る間にタスクが他のCPUへ移っても正しいキューを返す */
+    RunQueue &LockRunQueueOf(Task *task);
+    void PushReady(RunQueue &rq, Task *task, bool front = false);
+    /** @brief 実行待ちキューから取り除く。キューに無ければfalse */
+    bool RemoveReady(RunQueue &rq, Task *task);
+    /**
+     * @brief 実行中のCPUの実行待ちキューrqのロックを取り、割り込みを禁止した状態で呼んで切り替える
+     *
+     * ロックは切り替え先が外す（FinishSwitch）ので、戻ってきたときには外れている。
+     */
+    void SwitchTaskLocked(RunQueue &rq, bool current_sleep);
+    /**
+     * @brief rqのCPUに、より優先度の高いタスクへ切り替えさせ、rqのロックを外す
+     *
+     * 実行中のCPUならcan_switchがtrueのときに切り替え、falseなら保留する。他のCPUにはIPIを送る。
+     */
+    void RescheduleAndUnlock(RunQueue &rq, bool can_switch);
+    /** @brief cpu以外のアイドル中のCPUがあれば1つ起こして、タスクを盗ませる */
+    void KickIdleCPU(int cpu);
+    /** @brief 実行待ちキューrqから他のCPUへ移してよいタスクを探す */
+    Task *FindStealableTask(const RunQueue &rq);
+    /** @brief taskの統計を、実行中の分を足して写す */
+    TaskStatsEntry Snapshot(Task *task);
+    /** @brief Exitしたtaskが眠り終えた（コンテキストを保存し終えた）か */
+    bool HasSwitchedOut(Task *task);
+    /** @brief Exitしたtaskのスタックとアドレス空間をプールに戻し、free_tasks_に入れる */
+    void Recycle(Task *task);
 };
 
 extern TaskManager *task_manager;
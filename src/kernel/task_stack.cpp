@@ -0,0 +1,85 @@
+#include "task_stack.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "spinlock.hpp"
+
+namespace
+{
+    /** @brief 次に新しいスタックを置く位置（ガードページの先頭） */
+    uint64_t next_stack_base = kTaskStackRegionBase;
+    /** @brief 解放済みで、写像したまま再利用を待っているスタック */
+    std::vector<TaskStack> free_stacks;
+    /** @brief next_stack_baseとfree_stacksを守る */
+    SpinLock stack_lock;
+} // namespace
+
+void InitializeTaskStacks()
+{
+    RegisterLockStats(stack_lock.Stats(), "task stack");
+    if (auto err = ReserveSharedRegion(kTaskStackRegionBase, kTaskStackRegionBytes))
+    {
+        Log(kError, "failed to reserve the task stack region: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+        exit(1);
+    }
+}
+
+WithError<TaskStack> AllocateTaskStack(size_t bytes)
+{
+    bytes = std::max<size_t>((bytes + kBytesPerFrame - 1) / kBytesPerFrame, 1) * kBytesPerFrame;
+
+    SpinLockGuard guard{stack_lock};
+    auto it = std::find_if(free_stacks.begin(), free_stacks.end(),
+                           [bytes](const TaskStack &stack)
+                           { return stack.bytes == bytes; });
+    if (it != free_stacks.end())
+    {
+        const auto stack = *it;
+        *it = free_stacks.back();
+        free_stacks.pop_back();
+        return {stack, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    // 直前のスタックとの間にガードページを1枚空ける
+    const auto base = next_stack_base + kBytesPerFrame;
+    if (base + bytes > kTaskStackRegionBase + kTaskStackRegionBytes)
+    {
+        return {{}, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    const size_t num_frames = bytes / kBytesPerFrame;
+    const auto frame = AllocateFrames(num_frames, MemoryTag::kTaskStack);
+    if (frame.error)
+    {
+        return {{}, frame.error};
+    }
+    if (auto err = MapRange(KernelPML4(), base, reinterpret_cast<uint64_t>(frame.value.Frame()), bytes))
+    {
+        FreeFrames(frame.value, num_frames, MemoryTag::kTaskStack);
+        return {{}, err};
+    }
+
+    next_stack_base = base + bytes;
+    return {TaskStack{base, bytes}, MAKE_ERROR(Error::kSuccess)};
+}
+
+void FreeTaskStack(const TaskStack &stack)
+{
+    if (stack.bytes == 0)
+    {
+        return;
+    }
+
+    SpinLockGuard guard{stack_lock};
+    free_stacks.push_back(stack);
+}
+
+bool IsInTaskStackRegion(uint64_t addr)
+{
+    return kTaskStackRegionBase <= addr && addr < next_stack_base;
+}
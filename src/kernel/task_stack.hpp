@@ -0,0 +1,70 @@
+/**
+ * @file task_stack.hpp
+ * @brief タスクのスタックを管理するプログラム
+ *
+ * タスクのスタックはカーネルの共有領域にある専用の仮想アドレス範囲に1つずつ写像し、
+ * それぞれの直下に写像しないガードページを置く。スタックがあふれるとガードページでページフォルトが起きるので、
+ * 他のメモリを黙って壊すことがない。解放したスタックは写像したまま取っておき、同じ大きさの要求に再利用する。
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+/** @brief スタック用の仮想アドレス範囲の先頭。PML4テーブルの255番目の要素（共有する前半の最後）を使う */
+const uint64_t kTaskStackRegionBase = 0x00007f8000000000;
+/** @brief スタック用の仮想アドレス範囲の大きさ */
+const uint64_t kTaskStackRegionBytes = 512ull * 1024 * 1024 * 1024;
+
+/**
+ * @brief タスクのスタックの範囲
+ *
+ * [base, base + bytes)が写像されていて、base直下の1ページはガードページ。
+ */
+struct TaskStack
+{
+    uint64_t base = 0;
+    size_t bytes = 0;
+
+    /** @brief スタックの底（最初のRSPはこれより下）のアドレス */
+    uint64_t End() const { return base + bytes; }
+};
+
+/**
+ * @brief スタック用の仮想アドレス範囲を用意する
+ *
+ * 範囲は全てのタスクのアドレス空間から見えなければならないので、最初のタスクを作る前に呼ぶ。
+ */
+void InitializeTaskStacks();
+
+/**
+ * @brief bytes以上の大きさのスタックを確保する
+ *
+ * 同じ大きさの解放済みのスタックがあれば再利用し、無ければフレームを確保して新しく写像する。
+ *
+ * @param bytes ページの大きさに切り上げる
+ * @return WithError<TaskStack>
+ */
+WithError<TaskStack> AllocateTaskStack(size_t bytes);
+
+/**
+ * @brief スタックを解放する。写像は残したまま次のAllocateTaskStackで再利用する
+ *
+ * @param stack
+ */
+void FreeTaskStack(const TaskStack &stack);
+
+/**
+ * @brief addrがスタック用の仮想アドレス範囲のうち、これまでにスタックを置いた部分にあるか
+ *
+ * その部分で写像されていないのはガードページだけなので、ページフォルトのハンドラは
+ * ページが存在しないことによるフォルトでこれが真ならスタックのあふれと判断できる。
+ *
+ * @param addr
+ * @return true
+ * @return false
+ */
+bool IsInTaskStackRegion(uint64_t addr);
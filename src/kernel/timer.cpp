@@ -1,6 +1,11 @@
 #include "timer.hpp"
+
+#include <algorithm>
+
 #include "interrupt.hpp"
 #include "acpi.hpp"
+#include "asmfunc.h"
+#include "logger.hpp"
 #include "task.hpp"
 
 namespace
@@ -19,28 +24,98 @@ namespace
     volatile uint32_t &current_count = *reinterpret_cast<uint32_t *>(0xfee00390);
     /** @brief カウンタの減少スピードの設定*/
     volatile uint32_t &divide_config = *reinterpret_cast<uint32_t *>(0xfee003e0);
+
+    /** @brief LVT Timerレジスタのタイマモード（17-18bit） */
+    const uint32_t kLVTTimerOneShot = 0b00 << 17;
+    const uint32_t kLVTTimerPeriodic = 0b01 << 17;
+    const uint32_t kLVTTimerTSCDeadline = 0b10 << 17;
+    /** @brief TSC-deadlineモードで割り込むTSCの値を書くMSR。0を書くと止まる */
+    const uint32_t kIA32TSCDeadline = 0x6e0;
+
+    /** @brief ティックレスで動いているか。InitializeLAPICTimerで設定する */
+    bool tickless = false;
+    /** @brief ワンショットモードではなくTSC-deadlineモードで割り込む */
+    bool tsc_deadline = false;
+    /** @brief tickが0のときのTSCの値 */
+    uint64_t tsc_base;
+    /** @brief 1tickあたりのTSCのカウント数 */
+    uint64_t tsc_per_tick;
+
+    /** @brief APのLAPICタイマがタスクを切り替えるために割り込む間隔（LAPICタイマのカウント数） */
+    uint32_t TaskSwitchCount()
+    {
+        return lapic_timer_freq / kTimerFreq * kTaskTimerPeriod;
+    }
+
+    /**
+     * @brief TSCがCPUの周波数や省電力状態によらず一定の速さで進むか（CPUID 0x80000007のEDXのbit8）
+     */
+    bool IsTSCInvariant()
+    {
+        uint32_t eax, ebx, ecx, edx;
+        CPUID(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+        if (eax < 0x80000007)
+        {
+            return false;
+        }
+        CPUID(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+        return (edx >> 8) & 1;
+    }
+
+    bool IsTSCDeadlineSupported()
+    {
+        uint32_t eax, ebx, ecx, edx;
+        CPUID(1, 0, &eax, &ebx, &ecx, &edx);
+        return (ecx >> 24) & 1;
+    }
 } // namespace
 
-void InitializeLAPICTimer(std::deque<Message> &msg_queue)
+void InitializeLAPICTimer()
 {
-    timer_manager = new TimerManager{msg_queue};
+    timer_manager = new TimerManager;
 
     divide_config = 0b1011;  //
     lvt_timer = 0b001 << 16; // 17bitが0（単発）、16bitが1（割り込み不可）
+    // LAPICタイマと同時にTSCの周波数も測る
+    const auto tsc_start = ReadTSC();
     StartLAPICTimer();
     acpi::WaitMilliseconds(100);
     const auto elapsed = LAPICTimerElapsed();
+    const auto tsc_end = ReadTSC();
     StopLAPICTimer();
 
     lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+    tsc_freq = (tsc_end - tsc_start) * 10;
 
     divide_config = 0b1011; // 1対1で分周する設定
+
+    if (IsTSCInvariant())
+    {
+        tsc_per_tick = tsc_freq / kTimerFreq;
+        tsc_base = ReadTSC();
+        tsc_deadline = IsTSCDeadlineSupported();
+        tickless = true;
+        lvt_timer = (tsc_deadline ? kLVTTimerTSCDeadline : kLVTTimerOneShot) | InterruptVector::kLAPICTimer;
+        Log(kInfo, "LAPIC timer: tickless (%s), %lu TSC counts per tick\n",
+            tsc_deadline ? "TSC-deadline" : "one-shot", tsc_per_tick);
+        timer_manager->ArmNextDeadline();
+        return;
+    }
+
+    Log(kInfo, "LAPIC timer: periodic at %d Hz (TSC is not invariant)\n", kTimerFreq);
     // lvt_timer = (0b001 << 16) | 32; // 16bitの位置に書き込んで割り込み不許可にする（みかん本227pと表9.3）
-    lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer; // 17bitの位置に書き込んで周期モード、16が0なので割り込み許可、0-7のbit（割り込みベクタ番号）にkLAPICTimerを登録 // みかん本271p
+    lvt_timer = kLVTTimerPeriodic | InterruptVector::kLAPICTimer; // 17bitの位置に書き込んで周期モード、16が0なので割り込み許可、0-7のbit（割り込みベクタ番号）にkLAPICTimerを登録 // みかん本271p
     // initial_count = 0x1000000u;
     initial_count = lapic_timer_freq / kTimerFreq;
 }
 
+void InitializeLAPICTimerOnAP()
+{
+    divide_config = 0b1011;
+    lvt_timer = kLVTTimerPeriodic | InterruptVector::kLAPICTimer;
+    initial_count = TaskSwitchCount();
+}
+
 void StartLAPICTimer()
 {
     initial_count = kCountMax;
@@ -56,67 +131,218 @@ void StopLAPICTimer()
     initial_count = 0;
 }
 
-Timer::Timer(unsigned long timeout, int value)
-    : timeout_{timeout}, value_{value}
+Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
+    : timeout_{timeout}, value_{value}, task_id_{task_id}
 {
 }
 
-TimerManager::TimerManager(std::deque<Message> &msg_queue)
-    : msg_queue_{msg_queue}
+TimerManager::TimerManager()
 {
-    timers_.push(Timer{std::numeric_limits<unsigned long>::max(), -1}); // 番兵タイマを追加
+    timers_.push(Timer{std::numeric_limits<unsigned long>::max(), -1, 0}); // 番兵タイマを追加
+    RegisterLockStats(lock_.Stats(), "timer");
 }
 void TimerManager::AddTimer(const Timer &timer)
 {
-    timers_.push(timer);
+    {
+        SpinLockGuard guard{lock_};
+        const bool earliest = timer.Timeout() < timers_.top().Timeout();
+        timers_.push(timer);
+        if (!earliest)
+        {
+            return;
+        }
+        // 設定済みの割り込みより先にタイムアウトするかもしれない
+        if (CurrentCPU() == 0)
+        {
+            RearmLocked();
+            return;
+        }
+    }
+    // 時刻を管理しているのはBSPのLAPICタイマなので、BSPに設定し直させる
+    SendIPI(0, InterruptVector::kTimerRearmIPI);
+}
+
+unsigned long TimerManager::CurrentTick() const
+{
+    if (tickless)
+    {
+        return (ReadTSC() - tsc_base) / tsc_per_tick;
+    }
+    return tick_;
 }
 
 bool TimerManager::Tick()
 {
-    ++tick_;
     bool task_timer_timeout = false;
-    while (true)
     {
-        const auto &t = timers_.top();
-        if (t.Timeout() > tick_)
+        SpinLockGuard guard{lock_};
+        if (tickless)
+        {
+            tick_ = CurrentTick();
+        }
+        else
         {
-            break;
+            ++tick_;
         }
 
-        if (t.Value() == kTaskTimerValue)
+        if (task_timer_timeout_ <= tick_)
         {
             // Task切り替えのタイマがタイムアウトした場合
             task_timer_timeout = true;
-            timers_.pop();
-            // タイマに再追加して周期タイマ化
-            timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue});
-            continue;
+            task_timer_timeout_ = tick_ + kTaskTimerPeriod;
         }
+    }
 
-        // タイムアウトしている場合 - タイムアウト通知用のメッセージを生成してメイン関数に通知
-        Message m{Message::kTimerTimeout};
-        m.arg.timer.timeout = t.Timeout();
-        m.arg.timer.value = t.Value();
-        msg_queue_.push_back(m);
+    while (true)
+    {
+        // メッセージを送るとタスクの実行待ちキューのロックを取るので、タイマを取り出したらlock_は外しておく
+        Timer t{0, 0, 0};
+        {
+            SpinLockGuard guard{lock_};
+            if (timers_.top().Timeout() > tick_)
+            {
+                break;
+            }
+            t = timers_.top();
+            timers_.pop();
+        }
 
-        timers_.pop();
+        // タイムアウトしている場合 - タイムアウト通知用のメッセージを生成してタイマを設定したタスクに通知
+        if (t.TaskID() != 0 && task_manager)
+        {
+            Message m{Message::kTimerTimeout};
+            m.arg.timer.timeout = t.Timeout();
+            m.arg.timer.value = t.Value();
+            task_manager->SendMessage(t.TaskID(), m);
+        }
     }
 
+    ArmNextDeadline();
     return task_timer_timeout;
 }
 
+void TimerManager::ArmNextDeadline()
+{
+    SpinLockGuard guard{lock_};
+    idle_[0] = false;
+    RearmLocked();
+}
+
+void TimerManager::ArmIdleDeadline()
+{
+    const int cpu = CurrentCPU();
+    if (cpu != 0)
+    {
+        // APはタイマを管理しないので、次にタスクを切り替えるまで割り込まなくてよい
+        idle_[cpu] = true;
+        initial_count = 0;
+        return;
+    }
+
+    SpinLockGuard guard{lock_};
+    idle_[0] = true;
+    RearmLocked();
+}
+
+void TimerManager::LeaveIdle()
+{
+    const int cpu = CurrentCPU();
+    if (!idle_[cpu])
+    {
+        return;
+    }
+    if (cpu != 0)
+    {
+        idle_[cpu] = false;
+        initial_count = TaskSwitchCount();
+        return;
+    }
+    ArmNextDeadline();
+}
+
+void TimerManager::Rearm()
+{
+    SpinLockGuard guard{lock_};
+    RearmLocked();
+}
+
+void TimerManager::RearmLocked()
+{
+    if (idle_[0])
+    {
+        Program(timers_.top().Timeout());
+    }
+    else
+    {
+        Program(std::min(timers_.top().Timeout(), task_timer_timeout_));
+    }
+}
+
+void TimerManager::Program(unsigned long timeout)
+{
+    if (!tickless)
+    {
+        return;
+    }
+
+    if (timeout == std::numeric_limits<unsigned long>::max())
+    {
+        // 番兵タイマしか無いので、次のAddTimerまで割り込まない
+        if (tsc_deadline)
+        {
+            WriteMSR(kIA32TSCDeadline, 0);
+        }
+        else
+        {
+            initial_count = 0;
+        }
+        return;
+    }
+
+    if (tsc_deadline)
+    {
+        // 過ぎた時刻を書くとすぐに割り込む
+        WriteMSR(kIA32TSCDeadline, tsc_base + timeout * tsc_per_tick);
+        return;
+    }
+
+    // 残りのTSCのカウント数をLAPICタイマのカウント数に換算する。掛け算があふれないようにtick単位と端数に分ける
+    const uint64_t deadline = tsc_base + timeout * tsc_per_tick;
+    const uint64_t now = ReadTSC();
+    const uint64_t remaining = deadline > now ? deadline - now : 0;
+    const uint64_t lapic_per_tick = lapic_timer_freq / kTimerFreq;
+    const uint64_t count = remaining / tsc_per_tick * lapic_per_tick +
+                           remaining % tsc_per_tick * lapic_per_tick / tsc_per_tick + 1;
+    // ワンショットモードはカウントが32bitなので、遠すぎる場合は途中で1度割り込んで設定し直す
+    initial_count = std::min<uint64_t>(count, kCountMax);
+}
+
 TimerManager *timer_manager;
 unsigned long lapic_timer_freq;
+unsigned long tsc_freq;
 
 void LAPICTimerOnInterrupt()
 {
+    if (CurrentCPU() != 0)
+    {
+        // APのLAPICタイマはタスクを切り替えるためだけに周期的に割り込む
+        NotifyEndOfInterrupt();
+        task_manager->SwitchTask();
+        return;
+    }
+
     const bool task_timer_timeout = timer_manager->Tick();
     NotifyEndOfInterrupt();
 
-    if (task_timer_timeout)
+    if (task_timer_timeout && task_manager)
     {
         // SwitchTaskはNotifiEndOfInterrupt()後に実行する。
         // 次のタイマ割り込みが発生しないため次回以降のタスク切換えが起こらなくなる...
         task_manager->SwitchTask();
     }
+    else if (task_manager)
+    {
+        // Tickで起こしたタスクが実行中のタスクより優先度が高ければ切り替える
+        task_manager->SwitchTaskIfPreempted();
+    }
 }
@@ -6,18 +6,32 @@
 
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <queue>
 #include <vector>
 #include <limits>
 #include "message.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
 
 /**
  * @brief Local APICタイマの周期を分周する回路の設定をする関数
  * ※分周＝クロックをn分の1にすること みかん本227p
+ *
+ * TSCが不変（invariant）ならティックレスで動かす。LAPICタイマは周期的に割り込まず、
+ * 次にタイムアウトするタイマの時刻に1回だけ割り込むように設定し直す（TSC-deadlineモードが使えればそれを、
+ * 使えなければワンショットモードを使う）。tickはTSCから計算する。TSCが使えなければ従来通りkTimerFreqで周期的に割り込む。
  * 
  */
-void InitializeLAPICTimer(std::deque<Message> &msg_queue);
+void InitializeLAPICTimer();
+/**
+ * @brief APのLAPICタイマを、タスクを切り替える間隔で周期的に割り込むように設定する
+ *
+ * 時刻とタイマはBSPのLAPICタイマだけで管理し、APのLAPICタイマはタスクの切り替えにだけ使う。
+ * APのLAPICタイマもBSPと同じ周波数で進むとして、InitializeLAPICTimerで測った値を使う。
+ */
+void InitializeLAPICTimerOnAP();
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
@@ -29,13 +43,20 @@ void StopLAPICTimer();
 class Timer
 {
 public:
-    Timer(unsigned long timeout, int value);
+    /**
+     * @param timeout タイムアウトするtick
+     * @param value タイムアウトを通知するメッセージに載せる値
+     * @param task_id タイムアウトを通知するタスク。0なら通知しない
+     */
+    Timer(unsigned long timeout, int value, uint64_t task_id);
     unsigned long Timeout() const { return timeout_; }
     int Value() const { return value_; }
+    uint64_t TaskID() const { return task_id_; }
 
 private:
     unsigned long timeout_;
     int value_;
+    uint64_t task_id_;
 };
 
 /**
@@ -47,42 +68,89 @@ inline bool operator<(const Timer &lhs, const Timer &rhs)
     return lhs.Timeout() > rhs.Timeout();
 }
 
+/** @brief 1秒間にTimerManager::Tick()が呼ばれる頻度。秒間100回なら10[msec]に1回tick_が増える */
+const int kTimerFreq = 100;
+/** @brief タスクを切り替える間隔[tick] */
+const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
+
 /**
  * @brief タイマの割り込み回数を数える
+ *
+ * タイマはBSPのLAPICタイマで管理する。どのCPUからもタイマを追加できる（lock_で守る）。
  * 
  */
 class TimerManager
 {
 public:
-    TimerManager(std::deque<Message> &msg_queue);
+    TimerManager();
+    /**
+     * @brief タイマを追加する
+     *
+     * 設定済みの割り込みより先にタイムアウトする場合、BSPならその場で、APならBSPにIPIを送って設定し直させる。
+     */
     void AddTimer(const Timer &timer);
 
     /**
      * @brief 割り込み回数を数え上げる
+     *
+     * ティックレスの場合は数えずにTSCから現在のtickを求め、次の割り込みを設定する。
      * 
      * @return true : タスク切換えタイマのタイムアウトが発生した場合
      * @return false : それ以外
      */
     bool Tick();
-    /** @brief 現在の累計割り込み回数を返す*/
-    unsigned long CurrentTick() const { return tick_; }
+    /**
+     * @brief 現在の累計割り込み回数を返す。ティックレスの場合は起動してからの時間をtickに換算した値
+     *
+     * tick_は1命令で読めるので、割り込みを禁止せずにどのCPUからも呼べる。
+     */
+    unsigned long CurrentTick() const;
+
+    /**
+     * @brief 次のタイマかタスク切り替えの時刻のうち早い方に割り込むように設定する。周期的に割り込む場合は何もしない
+     *
+     * BSPで割り込み禁止で呼ぶ。
+     */
+    void ArmNextDeadline();
+    /**
+     * @brief アイドル中は時間でタスクを切り替えないので、次のタイマの時刻だけに割り込むように設定する
+     *
+     * アイドルタスクが割り込み禁止でhltの直前に呼ぶ。タイマが無ければ割り込まない。
+     * APではタスクを切り替えるための周期的な割り込みを止める。
+     */
+    void ArmIdleDeadline();
+    /**
+     * @brief アイドルから戻ったらタスク切り替えの時刻を設定し直す。タスクを切り替えるたびに割り込み禁止で呼ぶ
+     */
+    void LeaveIdle();
+    /**
+     * @brief BSPがアイドル中かどうかに応じてLAPICタイマを設定し直す。APがタイマを追加したときにBSPで呼ぶ
+     */
+    void Rearm();
 
 private:
     // tick_は割り込みハンドラの中で変更され、割子お見ハンドラの外から参照されるので、コンパイラが最適化のために定数にする可能性がある。
     // volatileキーワードで揮発性変数（値がいつでも変化する可能性がある）であることを伝え最適化対象から除外するみかん本のコラム11.1
     volatile unsigned long tick_{0};
+    /** @brief 次にタスクを切り替えるtick */
+    unsigned long task_timer_timeout_{kTaskTimerPeriod};
+    /** @brief CPUごとに、ArmIdleDeadlineでタスク切り替えの時刻を外している */
+    std::array<bool, kMaxCPUs> idle_{};
 
     std::priority_queue<Timer> timers_{};
-    std::deque<Message> &msg_queue_;
+    /** @brief timers_、tick_の更新、task_timer_timeout_、idle_[0]を守る */
+    SpinLock lock_;
+
+    /** @brief lock_を取った状態でRearmする */
+    void RearmLocked();
+    /** @brief LAPICタイマがtimeoutのtickに割り込むように設定する */
+    void Program(unsigned long timeout);
 };
 
 extern TimerManager *timer_manager;
 /** @brief 1秒あたりのカウント数（TimerManager::Tick()の周波数）を記録するグローバル変数*/
 extern unsigned long lapic_timer_freq;
-/** @brief 1秒間にTimerManager::Tick()が呼ばれる頻度。秒間100回なら10[msec]に1回tick_が増える */
-const int kTimerFreq = 100;
-
-const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
-const int kTaskTimerValue = std::numeric_limits<int>::min();
+/** @brief 1秒あたりのTSCのカウント数。InitializeLAPICTimerで測る */
+extern unsigned long tsc_freq;
 
 void LAPICTimerOnInterrupt();
@@ -0,0 +1,104 @@
+#include "work_queue.hpp"
+
+#include <algorithm>
+
+#include "logger.hpp"
+#include "smp.hpp"
+
+namespace
+{
+    static_assert(WorkQueue::kLevels == 3, "initialize WorkQueue::queues_ for each level");
+
+    void WorkerMain(uint64_t task_id, int64_t data)
+    {
+        work_queue->RunWorker();
+    }
+} // namespace
+
+WorkQueue::WorkQueue()
+    : queues_{{ArrayQueue<Work>{buffers_[0]}, ArrayQueue<Work>{buffers_[1]}, ArrayQueue<Work>{buffers_[2]}}}
+{
+    RegisterLockStats(lock_.Stats(), "work queue");
+}
+
+Error WorkQueue::Submit(WorkFunc *func, void *arg, WorkFunc *done, int priority)
+{
+    priority = std::clamp(priority, 1, Task::kMaxPriority);
+
+    Task *worker;
+    {
+        SpinLockGuard guard{lock_};
+        if (auto err = queues_[priority - 1].Push(Work{func, arg, done, priority}))
+        {
+            return err;
+        }
+        worker = idle_workers_.Pop();
+    }
+    if (worker)
+    {
+        task_manager->Wakeup(worker);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void WorkQueue::RunWorker()
+{
+    Task &task = task_manager->CurrentTask();
+    while (true)
+    {
+        Work work;
+        {
+            SpinLockGuard guard{lock_};
+            while (!PopLocked(work))
+            {
+                task_manager->Block(idle_workers_, lock_);
+            }
+        }
+
+        task.SetPriority(work.priority);
+        work.func(work.arg);
+        if (work.done)
+        {
+            work.done(work.arg);
+        }
+    }
+}
+
+size_t WorkQueue::Pending()
+{
+    SpinLockGuard guard{lock_};
+    size_t count = 0;
+    for (const auto &queue : queues_)
+    {
+        count += queue.Count();
+    }
+    return count;
+}
+
+bool WorkQueue::PopLocked(Work &work)
+{
+    for (int i = kLevels - 1; i >= 0; --i)
+    {
+        auto &queue = queues_[i];
+        if (queue.Count() > 0)
+        {
+            work = queue.Front();
+            queue.Pop();
+            return true;
+        }
+    }
+    return false;
+}
+
+WorkQueue *work_queue;
+
+void InitializeWorkQueue()
+{
+    work_queue = new WorkQueue;
+    const int num_workers = std::max(2, NumCPUs());
+    for (int i = 0; i < num_workers; ++i)
+    {
+        task_manager->NewTask().InitContext(WorkerMain, i).Wakeup();
+    }
+    Log(kInfo, "work queue: %d workers\n", num_workers);
+}
@@ -0,0 +1,84 @@
+/**
+ * @file work_queue.hpp
+ * @brief 時間のかかる処理をワーカタスクに任せる作業キュー
+ *
+ * 呼び出し元（イベントループなど）で処理せずにジョブとして積み、TaskManagerのタスクで作ったワーカの集まりに実行させる。
+ * ジョブの優先度はタスクの優先度と同じ1〜Task::kMaxPriorityで、ワーカはそのジョブを実行する間その優先度になる。
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+#include "queue.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
+
+using WorkFunc = void(void *arg);
+
+/**
+ * @brief 作業キューに積む1つのジョブ
+ */
+struct Work
+{
+    WorkFunc *func;
+    void *arg;
+    /** @brief funcから戻った後に同じワーカでargを渡して呼ぶ。nullptrなら呼ばない */
+    WorkFunc *done;
+    int priority;
+};
+
+class WorkQueue
+{
+public:
+    /** @brief 優先度ごとに積めるジョブの数 */
+    static const size_t kCapacity = 64;
+    /** @brief 優先度の段数。優先度0はアイドルタスク用なので使わない */
+    static const int kLevels = Task::kMaxPriority;
+
+    WorkQueue();
+
+    /**
+     * @brief ジョブを積み、眠っているワーカがいれば起こす
+     *
+     * 割り込みハンドラや他のCPUからも呼べる。同じ優先度のジョブは積んだ順に始める（終わる順は決まらない）。
+     *
+     * @param func ワーカで実行する関数
+     * @param arg funcとdoneに渡す値
+     * @param done 終わったときに呼ぶ関数。nullptrなら呼ばない
+     * @param priority 1からTask::kMaxPriorityまでに丸める
+     * @return Error その優先度のジョブが一杯ならkFull（積まない）
+     */
+    Error Submit(WorkFunc *func, void *arg, WorkFunc *done = nullptr,
+                 int priority = Task::kDefaultPriority);
+
+    /** @brief ワーカタスクの本体。優先度の高いジョブから取り出して実行し、無ければ眠る */
+    [[noreturn]] void RunWorker();
+
+    /** @brief 積まれてまだ始まっていないジョブの数 */
+    size_t Pending();
+
+private:
+    /** @brief queues_と眠っているワーカを守る */
+    SpinLock lock_;
+    std::array<std::array<Work, kCapacity>, kLevels> buffers_{};
+    /** @brief queues_[i]は優先度i + 1のジョブ */
+    std::array<ArrayQueue<Work>, kLevels> queues_;
+    /** @brief ジョブが無くて眠っているワーカ */
+    WaitQueue idle_workers_{};
+
+    /** @brief lock_を取った状態で、最も優先度の高いジョブを取り出す。無ければfalse */
+    bool PopLocked(Work &work);
+};
+
+extern WorkQueue *work_queue;
+
+/**
+ * @brief 作業キューを作り、CPUの数（最低2つ）だけワーカタスクを起動する
+ *
+ * StartApplicationProcessorsの後に呼ぶ。
+ */
+void InitializeWorkQueue();